@@ -66,11 +66,34 @@ static void print_help()
 		"\t                              process\n"
 		"\t-t, --term <TERM>             Value of the TERM environment variable\n"
 		"\t                              for the child process\n"
+		"\t    --pty-budget <bytes>      Max bytes read from the child per\n"
+		"\t                              wakeup; default: 131072\n"
+		"\t    --pty-budget-time <usecs> Max time spent reading from the child\n"
+		"\t                              per wakeup; 0 disables; default: 5000\n"
+		"\t    --latency                 Trace keypress-to-photon latency and\n"
+		"\t                              log percentiles\n"
+		"\t    --trace <file>            Record hot-path events and dump\n"
+		"\t                              them to <file> on SIGQUIT, crash\n"
+		"\t                              and exit\n"
+		"\n"
+		"Font Options:\n"
+		"\t    --glyph-cache <dir>       Directory of the glyph cache files;\n"
+		"\t                              empty disables the cache;\n"
+		"\t                              default: /var/cache/kmscon\n"
+		"\t    --glyph-budget <KiB>      Max memory of the glyphs kept per\n"
+		"\t                              font; default: 4096\n"
 		"\n"
 		"Input Device Options:\n"
 		"\t    --xkb-layout <layout>     Set XkbLayout for input devices\n"
 		"\t    --xkb-variant <variant>   Set XkbVariant for input devices\n"
-		"\t    --xkb-options <options>   Set XkbOptions for input devices\n",
+		"\t    --xkb-options <options>   Set XkbOptions for input devices\n"
+		"\t    --repeat-delay <msecs>    Delay until held keys repeat;\n"
+		"\t                              default: 250\n"
+		"\t    --repeat-rate <hz>        Key repeats per second (0-1000); 0\n"
+		"\t                              disables key repeat; default: 30\n"
+		"\t    --keymap-cache <dir>      Directory of the compiled key maps;\n"
+		"\t                              empty disables the cache;\n"
+		"\t                              default: /var/cache/kmscon\n",
 		"kmscon");
 }
 
@@ -90,10 +113,22 @@ int conf_parse_argv(int argc, char **argv)
 		{ "login", required_argument, NULL, 'l' },
 		{ "term", required_argument, NULL, 't' },
 		{ "seat", required_argument, NULL, 1004 },
+		{ "pty-budget", required_argument, NULL, 1005 },
+		{ "pty-budget-time", required_argument, NULL, 1006 },
+		{ "glyph-cache", required_argument, NULL, 1007 },
+		{ "glyph-budget", required_argument, NULL, 1008 },
+		{ "keymap-cache", required_argument, NULL, 1009 },
+		{ "repeat-delay", required_argument, NULL, 1010 },
+		{ "repeat-rate", required_argument, NULL, 1011 },
+		{ "latency", no_argument, &conf_global.latency, 1 },
+		{ "trace", required_argument, NULL, 1012 },
 		{ NULL, 0, NULL, 0 },
 	};
 	int idx;
 	int c;
+	int pty_budget_time = -1;
+	int repeat_delay = -1;
+	int repeat_rate = -1;
 
 	if (!argv || argc < 1)
 		return -EINVAL;
@@ -128,6 +163,30 @@ int conf_parse_argv(int argc, char **argv)
 		case 1004:
 			conf_global.seat = optarg;
 			break;
+		case 1005:
+			conf_global.pty_budget = strtoul(optarg, NULL, 10);
+			break;
+		case 1006:
+			pty_budget_time = strtoul(optarg, NULL, 10);
+			break;
+		case 1007:
+			conf_global.glyph_cache = optarg;
+			break;
+		case 1008:
+			conf_global.glyph_budget = strtoul(optarg, NULL, 10);
+			break;
+		case 1009:
+			conf_global.keymap_cache = optarg;
+			break;
+		case 1010:
+			repeat_delay = strtoul(optarg, NULL, 10);
+			break;
+		case 1011:
+			repeat_rate = strtoul(optarg, NULL, 10);
+			break;
+		case 1012:
+			conf_global.trace = optarg;
+			break;
 		case 'l':
 			conf_global.login = optarg;
 			--optind;
@@ -170,6 +229,21 @@ done:
 		conf_global.xkb_variant = "";
 	if (!conf_global.xkb_options)
 		conf_global.xkb_options = "";
+	if (repeat_delay < 0)
+		conf_global.repeat_delay = 250;
+	else
+		conf_global.repeat_delay = repeat_delay;
+	if (repeat_rate < 0) {
+		conf_global.repeat_rate = 30;
+	} else if (repeat_rate > 1000) {
+		fprintf(stderr, "Key repeat rate %d too high; using 1000\n",
+			repeat_rate);
+		conf_global.repeat_rate = 1000;
+	} else {
+		conf_global.repeat_rate = repeat_rate;
+	}
+	if (!conf_global.keymap_cache)
+		conf_global.keymap_cache = "/var/cache/kmscon";
 
 	if (!conf_global.term)
 		conf_global.term = "linux";
@@ -177,6 +251,18 @@ done:
 	if (!conf_global.seat)
 		conf_global.seat = "seat0";
 
+	if (!conf_global.pty_budget)
+		conf_global.pty_budget = 128 * 1024;
+	if (pty_budget_time < 0)
+		conf_global.pty_budget_time = 5000;
+	else
+		conf_global.pty_budget_time = pty_budget_time;
+
+	if (!conf_global.glyph_cache)
+		conf_global.glyph_cache = "/var/cache/kmscon";
+	if (!conf_global.glyph_budget)
+		conf_global.glyph_budget = 4096;
+
 	if (show_help) {
 		print_help();
 		conf_global.exit = 1;
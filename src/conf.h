@@ -58,6 +58,12 @@ struct conf_obj {
 	const char *xkb_layout;
 	const char *xkb_variant;
 	const char *xkb_options;
+	/* msecs until a held key repeats */
+	unsigned int repeat_delay;
+	/* key repeats per second; 0 disables */
+	unsigned int repeat_rate;
+	/* key map cache directory; empty to disable */
+	const char *keymap_cache;
 
 	/* TERM value */
 	const char *term;
@@ -65,6 +71,20 @@ struct conf_obj {
 	char *login;
 	/* argv for login process */
 	char **argv;
+	/* max bytes read from the pty per wakeup */
+	unsigned int pty_budget;
+	/* max time in usecs spent reading from the pty per wakeup */
+	unsigned int pty_budget_time;
+
+	/* trace keypress-to-photon latency */
+	int latency;
+	/* event trace dump file; NULL disables tracing */
+	const char *trace;
+
+	/* glyph cache directory; empty to disable */
+	const char *glyph_cache;
+	/* max KiB of cached glyphs per font */
+	unsigned int glyph_budget;
 
 	/* seat name */
 	const char *seat;
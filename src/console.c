@@ -39,6 +39,7 @@
 #include "font.h"
 #include "gl.h"
 #include "log.h"
+#include "trace.h"
 #include "unicode.h"
 
 #define LOG_SUBSYSTEM "console"
@@ -48,6 +49,7 @@
 
 struct cell {
 	kmscon_symbol_t ch;
+	unsigned int width;	/* 0 for the right half of a wide character */
 };
 
 struct line {
@@ -102,6 +104,10 @@ struct kmscon_console {
 	/* cursor */
 	unsigned int cursor_x;
 	unsigned int cursor_y;
+
+	/* position of the last written character */
+	unsigned int last_x;
+	unsigned int last_y;
 };
 
 /* Console Buffer and Cell Objects
@@ -150,6 +156,9 @@ struct kmscon_console {
  * A single cell describes a single character that is printed in that cell. The
  * character itself is a kmscon_char unicode character. The cell also contains
  * the color of the character and some other metadata.
+ * Wide characters (eg. CJK) occupy two cells. The left cell contains the
+ * character and has width 2, the right cell is empty and has width 0. Whenever
+ * one half is overwritten, the other half is reset.
  */
 
 static void destroy_cell(struct cell *cell)
@@ -164,6 +173,7 @@ static int init_cell(struct cell *cell)
 		return -EINVAL;
 
 	memset(cell, 0, sizeof(*cell));
+	cell->width = 1;
 	return 0;
 }
 
@@ -173,6 +183,7 @@ static void reset_cell(struct cell *cell)
 		return;
 
 	memset(cell, 0, sizeof(*cell));
+	cell->width = 1;
 }
 
 static void free_line(struct line *line)
@@ -633,6 +644,35 @@ static void kmscon_buffer_clear_sb(struct kmscon_buffer *buf)
 	buf->position = NULL;
 }
 
+static void mark_line(struct line *line)
+{
+	unsigned int i;
+
+	if (!line)
+		return;
+
+	for (i = 0; i < line->size; ++i)
+		kmscon_symbol_mark(line->cells[i].ch);
+}
+
+/* keeps all composed symbols of the buffer and its scrollback alive */
+static void kmscon_buffer_mark(void *data)
+{
+	struct kmscon_buffer *buf = data;
+	struct line *iter;
+	unsigned int i;
+
+	for (iter = buf->sb_first; iter; iter = iter->next)
+		mark_line(iter);
+
+	for (i = 0; i < buf->scroll_y; ++i)
+		mark_line(buf->scroll_buf[i]);
+	for (i = 0; i < buf->mtop_y; ++i)
+		mark_line(buf->mtop_buf[i]);
+	for (i = 0; i < buf->mbottom_y; ++i)
+		mark_line(buf->mbottom_buf[i]);
+}
+
 static int kmscon_buffer_new(struct kmscon_buffer **out, unsigned int x,
 				unsigned int y)
 {
@@ -648,14 +688,20 @@ static int kmscon_buffer_new(struct kmscon_buffer **out, unsigned int x,
 
 	memset(buf, 0, sizeof(*buf));
 
-	ret = kmscon_buffer_resize(buf, x, y);
+	ret = kmscon_symbol_add_marker(kmscon_buffer_mark, buf);
 	if (ret)
 		goto err_free;
 
+	ret = kmscon_buffer_resize(buf, x, y);
+	if (ret)
+		goto err_marker;
+
 	log_debug("new buffer object");
 	*out = buf;
 	return 0;
 
+err_marker:
+	kmscon_symbol_rm_marker(kmscon_buffer_mark, buf);
 err_free:
 	free(buf);
 	return ret;
@@ -669,6 +715,7 @@ static void kmscon_buffer_free(struct kmscon_buffer *buf)
 		return;
 
 	log_debug("destroying buffer object");
+	kmscon_symbol_rm_marker(kmscon_buffer_mark, buf);
 	kmscon_buffer_clear_sb(buf);
 
 	for (i = 0; i < buf->scroll_y; ++i)
@@ -763,7 +810,10 @@ static void kmscon_buffer_draw(struct kmscon_buffer *buf,
 
 		for (j = 0; j < num; ++j) {
 			cell = &line->cells[j];
-			font_screen_draw_char(fscr, cell->ch, j, i, 1, 1);
+			if (!cell->width)
+				continue;
+			font_screen_draw_char(fscr, cell->ch, j, i, cell->width,
+						1);
 		}
 	}
 
@@ -772,9 +822,11 @@ static void kmscon_buffer_draw(struct kmscon_buffer *buf,
 }
 
 static void kmscon_buffer_write(struct kmscon_buffer *buf, unsigned int x,
-				unsigned int y, kmscon_symbol_t ch)
+				unsigned int y, kmscon_symbol_t ch,
+				unsigned int width)
 {
 	struct line *line, **slot;
+	struct cell *cells;
 	int ret;
 	bool scroll = false;
 
@@ -821,7 +873,26 @@ static void kmscon_buffer_write(struct kmscon_buffer *buf, unsigned int x,
 		}
 	}
 
-	line->cells[x].ch = ch;
+	cells = line->cells;
+
+	/* overwriting either half of a wide character resets the other one */
+	if (!cells[x].width && x > 0)
+		reset_cell(&cells[x - 1]);
+	else if (cells[x].width == 2 && x + 1 < line->size)
+		reset_cell(&cells[x + 1]);
+
+	if (width == 2 && x + 1 >= line->size)
+		width = 1;
+
+	cells[x].ch = ch;
+	cells[x].width = width;
+
+	if (width == 2) {
+		if (cells[x + 1].width == 2 && x + 2 < line->size)
+			reset_cell(&cells[x + 2]);
+		reset_cell(&cells[x + 1]);
+		cells[x + 1].width = 0;
+	}
 }
 
 static kmscon_symbol_t kmscon_buffer_read(struct kmscon_buffer *buf,
@@ -891,6 +962,8 @@ static void kmscon_buffer_scroll_up(struct kmscon_buffer *buf,
 	if (num > buf->scroll_y)
 		num = buf->scroll_y;
 
+	kmscon_trace_point(KMSCON_TRACE_SCROLL, num, 0);
+
 	for (i = 0; i < num; ++i)
 		link_to_scrollback(buf, buf->scroll_buf[i]);
 
@@ -1041,14 +1114,21 @@ void kmscon_console_draw(struct kmscon_console *con, struct font_screen *fscr)
 
 void kmscon_console_write(struct kmscon_console *con, kmscon_symbol_t ch)
 {
-	unsigned int last;
+	unsigned int last, width;
 
 	if (!con)
 		return;
 
+	/* zero-width characters do not occupy a cell of their own */
+	width = kmscon_symbol_get_width(ch);
+	if (!width)
+		return;
+	if (width > con->cells->size_x)
+		width = 1;
+
 	last = con->cells->scroll_y + con->cells->mtop_y;
 
-	if (con->cursor_x >= con->cells->size_x) {
+	if (con->cursor_x + width > con->cells->size_x) {
 		if (con->auto_wrap) {
 			con->cursor_x = 0;
 			con->cursor_y++;
@@ -1057,12 +1137,37 @@ void kmscon_console_write(struct kmscon_console *con, kmscon_symbol_t ch)
 				kmscon_buffer_scroll_up(con->cells, 1);
 			}
 		} else {
-			con->cursor_x = con->cells->size_x - 1;
+			con->cursor_x = con->cells->size_x - width;
 		}
 	}
 
-	kmscon_buffer_write(con->cells, con->cursor_x, con->cursor_y, ch);
-	con->cursor_x++;
+	kmscon_buffer_write(con->cells, con->cursor_x, con->cursor_y, ch,
+				width);
+	con->last_x = con->cursor_x;
+	con->last_y = con->cursor_y;
+	con->cursor_x += width;
+}
+
+/*
+ * This appends the combining character \ucs4 to the symbol of the last
+ * character written with kmscon_console_write(). The caller must make sure
+ * that the console has not been modified in any other way since then.
+ * The cell keeps its width so the line layout does not change.
+ */
+void kmscon_console_combine(struct kmscon_console *con, uint32_t ucs4)
+{
+	struct line *line;
+	struct cell *cell;
+
+	if (!con)
+		return;
+
+	line = get_line(con->cells, con->last_y);
+	if (!line || con->last_x >= line->size)
+		return;
+
+	cell = &line->cells[con->last_x];
+	cell->ch = kmscon_symbol_append(cell->ch, ucs4);
 }
 
 void kmscon_console_newline(struct kmscon_console *con)
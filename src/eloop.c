@@ -39,6 +39,7 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/signalfd.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/timerfd.h>
 #include <sys/wait.h>
@@ -50,6 +51,11 @@
 
 #define LOG_SUBSYSTEM "eloop"
 
+/* pidfd_open(2) is available since linux-5.3 but libc headers may lack it */
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
 struct ev_signal_shared {
 	struct kmscon_dlist list;
 
@@ -67,6 +73,8 @@ struct ev_eloop {
 	struct ev_idle *cur_idle;
 
 	struct kmscon_dlist sig_list;
+	struct kmscon_dlist child_list;	/* children watched through SIGCHLD */
+	bool child_sig;
 
 	struct epoll_event *cur_fds;
 	size_t cur_fds_cnt;
@@ -100,6 +108,17 @@ struct ev_timer {
 	void *data;
 };
 
+struct ev_child {
+	unsigned long ref;
+	struct ev_eloop *loop;
+	struct kmscon_dlist list;
+
+	struct ev_fd *fd;
+	pid_t pid;
+	ev_child_cb cb;
+	void *data;
+};
+
 int ev_eloop_new_eloop(struct ev_eloop *loop, struct ev_eloop **out)
 {
 	struct ev_eloop *el;
@@ -739,6 +758,255 @@ int ev_eloop_update_timer(struct ev_timer *timer,
 	return 0;
 }
 
+int ev_child_new(struct ev_child **out)
+{
+	struct ev_child *child;
+	int ret;
+
+	if (!out)
+		return -EINVAL;
+
+	child = malloc(sizeof(*child));
+	if (!child)
+		return -ENOMEM;
+
+	memset(child, 0, sizeof(*child));
+	child->ref = 1;
+	child->pid = -1;
+
+	ret = ev_fd_new(&child->fd);
+	if (ret) {
+		free(child);
+		return ret;
+	}
+
+	*out = child;
+	return 0;
+}
+
+void ev_child_ref(struct ev_child *child)
+{
+	if (!child)
+		return;
+
+	++child->ref;
+}
+
+void ev_child_unref(struct ev_child *child)
+{
+	if (!child || !child->ref || --child->ref)
+		return;
+
+	ev_fd_unref(child->fd);
+	free(child);
+}
+
+int ev_eloop_new_child(struct ev_eloop *loop, struct ev_child **out,
+			pid_t pid, ev_child_cb cb, void *data)
+{
+	struct ev_child *child;
+	int ret;
+
+	if (!out || !loop || pid <= 0 || !cb)
+		return -EINVAL;
+
+	ret = ev_child_new(&child);
+	if (ret)
+		return ret;
+
+	ret = ev_eloop_add_child(loop, child, pid, cb, data);
+	if (ret) {
+		ev_child_unref(child);
+		return ret;
+	}
+
+	ev_child_unref(child);
+	*out = child;
+	return 0;
+}
+
+/*
+ * A pidfd becomes readable once the process it refers to has exited and stays
+ * readable afterwards. Hence, child sources are one-shot: we reap the child,
+ * remove the source from the loop and then call the user's callback. It is
+ * safe to call ev_eloop_rm_child() from inside the callback.
+ * If the child was already reaped by someone else (for instance the global
+ * SIGCHLD reaper of a shared signal source), we cannot retrieve the exit
+ * status anymore and report 0.
+ * Kernels before linux-5.3 lack pidfds. There, all children of a loop are
+ * watched through one shared SIGCHLD source instead and every SIGCHLD polls
+ * each of them with waitpid(WNOHANG), so coalesced signals cannot lose exits.
+ * Our hook runs before the global reaper of the shared source.
+ */
+
+/* returns 1 if the child was reaped, 0 if it is alive or a negative error */
+static int child_wait(struct ev_child *child, int *status)
+{
+	pid_t pid;
+
+	*status = 0;
+	pid = waitpid(child->pid, status, WNOHANG);
+	if (pid == 0)
+		return 0;
+	if (pid < 0) {
+		if (errno != ECHILD) {
+			log_warn("cannot wait on child %d: %m", child->pid);
+			return -errno;
+		}
+		log_debug("child %d already reaped", child->pid);
+		*status = 0;
+	}
+
+	return 1;
+}
+
+static void child_done(struct ev_child *child, int status)
+{
+	ev_child_cb cb;
+	void *cb_data;
+	pid_t pid;
+
+	pid = child->pid;
+	cb = child->cb;
+	cb_data = child->data;
+
+	ev_child_ref(child);
+	ev_eloop_rm_child(child);
+	cb(child, pid, status, cb_data);
+	ev_child_unref(child);
+}
+
+static void child_cb(struct ev_fd *fd, int mask, void *data)
+{
+	struct ev_child *child = data;
+	int status = 0;
+
+	if (mask & EV_READABLE) {
+		if (child_wait(child, &status) <= 0)
+			return;
+	} else if (mask & (EV_HUP | EV_ERR)) {
+		log_warn("HUP/ERR on child source");
+	} else {
+		return;
+	}
+
+	child_done(child, status);
+}
+
+static void child_sig_cb(struct ev_eloop *loop, struct signalfd_siginfo *info,
+				void *data)
+{
+	struct kmscon_dlist *iter;
+	struct ev_child *child;
+	int status;
+
+	/* callbacks may remove any child, so restart after each of them */
+again:
+	kmscon_dlist_for_each(iter, &loop->child_list) {
+		child = kmscon_dlist_entry(iter, struct ev_child, list);
+		if (child_wait(child, &status) > 0) {
+			child_done(child, status);
+			goto again;
+		}
+	}
+}
+
+static int child_add_sig(struct ev_eloop *loop, struct ev_child *child,
+				pid_t pid)
+{
+	siginfo_t info;
+	int ret;
+
+	/* the hook stays registered until the loop is destroyed */
+	if (!loop->child_sig) {
+		ret = ev_eloop_register_signal_cb(loop, SIGCHLD, child_sig_cb,
+							NULL);
+		if (ret) {
+			log_warn("cannot watch children through SIGCHLD");
+			return ret;
+		}
+
+		log_debug("no pidfd support, watching children through SIGCHLD");
+		loop->child_sig = true;
+	}
+
+	kmscon_dlist_link_tail(&loop->child_list, &child->list);
+
+	/*
+	 * SIGCHLD is blocked only once the shared source exists, so a child
+	 * that exited before may have been signaled in vain. Raise it again
+	 * so its exit is not missed.
+	 */
+	memset(&info, 0, sizeof(info));
+	if (!waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) &&
+	    info.si_pid == pid)
+		raise(SIGCHLD);
+
+	return 0;
+}
+
+int ev_eloop_add_child(struct ev_eloop *loop, struct ev_child *child,
+			pid_t pid, ev_child_cb cb, void *data)
+{
+	int ret, fd;
+
+	if (!loop || !child || pid <= 0 || !cb)
+		return -EINVAL;
+
+	if (child->loop)
+		return -EALREADY;
+
+	/* pidfds are always created with O_CLOEXEC set */
+	fd = syscall(SYS_pidfd_open, pid, 0);
+	if (fd < 0 && errno == ENOSYS) {
+		ret = child_add_sig(loop, child, pid);
+		if (ret)
+			return ret;
+	} else if (fd < 0) {
+		ret = -errno;
+		log_warn("cannot open pidfd for child %d: %m", pid);
+		return ret;
+	} else {
+		ret = ev_eloop_add_fd(loop, child->fd, fd, EV_READABLE,
+					child_cb, child);
+		if (ret)
+			goto err_fd;
+	}
+
+	child->loop = loop;
+	child->pid = pid;
+	child->cb = cb;
+	child->data = data;
+	ev_child_ref(child);
+
+	return 0;
+
+err_fd:
+	close(fd);
+	return ret;
+}
+
+void ev_eloop_rm_child(struct ev_child *child)
+{
+	int fd;
+
+	if (!child || !child->loop)
+		return;
+
+	if (child->fd->loop) {
+		fd = child->fd->fd;
+		ev_eloop_rm_fd(child->fd);
+		close(fd);
+	} else {
+		kmscon_dlist_unlink(&child->list);
+	}
+
+	child->loop = NULL;
+	child->cb = NULL;
+	child->data = NULL;
+	ev_child_unref(child);
+}
+
 int ev_eloop_new(struct ev_eloop **out)
 {
 	struct ev_eloop *loop;
@@ -754,6 +1022,7 @@ int ev_eloop_new(struct ev_eloop **out)
 	memset(loop, 0, sizeof(*loop));
 	loop->ref = 1;
 	kmscon_dlist_init(&loop->sig_list);
+	kmscon_dlist_init(&loop->child_list);
 
 	loop->efd = epoll_create1(EPOLL_CLOEXEC);
 	if (loop->efd < 0) {
@@ -37,12 +37,14 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <sys/signalfd.h>
+#include <sys/types.h>
 #include <time.h>
 
 struct ev_eloop;
 struct ev_idle;
 struct ev_fd;
 struct ev_timer;
+struct ev_child;
 
 typedef void (*ev_idle_cb) (struct ev_idle *idle, void *data);
 typedef void (*ev_fd_cb) (struct ev_fd *fd, int mask, void *data);
@@ -50,6 +52,8 @@ typedef void (*ev_signal_shared_cb)
 	(struct ev_eloop *eloop, struct signalfd_siginfo *info, void *data);
 typedef void (*ev_timer_cb)
 			(struct ev_timer *timer, uint64_t num, void *data);
+typedef void (*ev_child_cb)
+			(struct ev_child *child, pid_t pid, int status, void *data);
 
 enum ev_eloop_flags {
 	EV_READABLE = 0x01,
@@ -121,4 +125,16 @@ void ev_eloop_rm_timer(struct ev_timer *timer);
 int ev_eloop_update_timer(struct ev_timer *timer,
 				const struct itimerspec *spec);
 
+/* child sources */
+
+int ev_child_new(struct ev_child **out);
+void ev_child_ref(struct ev_child *child);
+void ev_child_unref(struct ev_child *child);
+
+int ev_eloop_new_child(struct ev_eloop *loop, struct ev_child **out,
+			pid_t pid, ev_child_cb cb, void *data);
+int ev_eloop_add_child(struct ev_eloop *loop, struct ev_child *child,
+			pid_t pid, ev_child_cb cb, void *data);
+void ev_eloop_rm_child(struct ev_child *child);
+
 #endif /* EV_ELOOP_H */
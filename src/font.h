@@ -59,6 +59,11 @@
  *   3: Perform the drawing operation. This instructs the font-layer to actually
  *      draw all the added characters to your surface.
  * You need to perform all 3 steps for every frame you render.
+ *
+ * Characters that are drawn for the first time are rasterized in the
+ * background and left blank until they are ready. The file descriptor returned
+ * by font_screen_get_fd() becomes readable when glyphs of the screen got ready.
+ * Call font_screen_dispatch() then and redraw the screen.
  */
 
 #ifndef FONT_FONT_H
@@ -136,6 +141,9 @@ int font_screen_new_fixed(struct font_screen **out, struct font_buffer *buf,
 			struct gl_shader *shader);
 void font_screen_free(struct font_screen *screen);
 
+int font_screen_get_fd(struct font_screen *screen);
+void font_screen_dispatch(struct font_screen *screen);
+
 unsigned int font_screen_columns(struct font_screen *screen);
 unsigned int font_screen_rows(struct font_screen *screen);
 unsigned int font_screen_points(struct font_screen *screen);
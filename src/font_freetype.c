@@ -27,14 +27,22 @@
 /*
  * Font Handling - FreeType2
  * This provides a font backend based on FreeType2 library. This is inferior to
- * the pango backend as it does not handle combined characters. However, it
+ * the pango backend as it does no shaping: combined characters are drawn by
+ * stacking the bitmaps of their code points (see kmscon_glyph_new()), which
+ * is fine for simple combining marks but not for complex scripts. However, it
  * pulls in a lot less dependencies so may be prefered on some systems.
+ *
+ * Each font keeps at most conf_global.glyph_budget KiB of glyphs including
+ * their textures. Glyphs are linked into a CLOCK list which evicts glyphs that
+ * were not drawn since the clock hand passed them last.
  */
 
 #include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include "conf.h"
 #include "font.h"
 #include "gl.h"
 #include "log.h"
@@ -59,9 +67,23 @@ struct kmscon_font {
 	unsigned int width;
 	unsigned int height;
 	struct kmscon_hashtable *glyphs;
+
+	/* CLOCK list of all glyphs; the head is the clock hand */
+	struct kmscon_dlist lru;
+	size_t lru_num;
+	size_t bytes;
+	size_t budget;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
 };
 
 struct kmscon_glyph {
+	kmscon_symbol_t ch;
+	struct kmscon_dlist lru;
+	bool used;
+	size_t size;
+
 	bool valid;
 	unsigned int tex;
 	unsigned int width;
@@ -71,18 +93,40 @@ struct kmscon_glyph {
 	unsigned int advance;
 };
 
+static int load_char(struct kmscon_font *font, uint32_t ucs4)
+{
+	FT_Error err;
+	FT_UInt idx;
+
+	idx = FT_Get_Char_Index(font->face, ucs4);
+	err = FT_Load_Glyph(font->face, idx, FT_LOAD_DEFAULT);
+	if (err)
+		return -EFAULT;
+
+	err = FT_Render_Glyph(font->face->glyph, FT_RENDER_MODE_NORMAL);
+	if (err)
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Composed symbols are rendered by drawing the base character and all
+ * combining marks on top of each other. Marks are positioned by their bearings
+ * relative to the origin of the base character. The first pass computes the
+ * bounding box, the second one blits each bitmap into the glyph texture.
+ */
 static int kmscon_glyph_new(struct kmscon_glyph **out, kmscon_symbol_t key,
 						struct kmscon_font *font)
 {
 	struct kmscon_glyph *glyph;
-	FT_Error err;
-	FT_UInt idx;
+	FT_GlyphSlot slot;
 	FT_Bitmap *bmap;
 	int ret;
 	const uint32_t *val;
-	size_t len;
-	unsigned char *data, d;
-	int i, j;
+	size_t len, k;
+	unsigned char *data, d, *dst;
+	int i, j, x0, y0, x1, y1, width, height, off_x, off_y;
 
 	if (!out)
 		return -EINVAL;
@@ -92,61 +136,87 @@ static int kmscon_glyph_new(struct kmscon_glyph **out, kmscon_symbol_t key,
 		return -ENOMEM;
 
 	memset(glyph, 0, sizeof(*glyph));
+	glyph->ch = key;
 
 	val = kmscon_symbol_get(&key, &len);
 
 	if (!val[0])
 		goto ready;
 
-	/* TODO: Add support for combining characters */
-	idx = FT_Get_Char_Index(font->face, val[0]);
-	err = FT_Load_Glyph(font->face, idx, FT_LOAD_DEFAULT);
-	if (err) {
-		ret = -EFAULT;
-		goto err_free;
-	}
+	slot = font->face->glyph;
+	bmap = &slot->bitmap;
+	x0 = y0 = INT_MAX;
+	x1 = y1 = INT_MIN;
 
-	err = FT_Render_Glyph(font->face->glyph, FT_RENDER_MODE_NORMAL);
-	if (err) {
-		ret = -EFAULT;
-		goto err_free;
+	for (k = 0; k < len; ++k) {
+		ret = load_char(font, val[k]);
+		if (ret)
+			goto err_free;
+
+		if (!k)
+			glyph->advance = slot->advance.x >> 6;
+		if (!bmap->width || !bmap->rows)
+			continue;
+
+		if (slot->bitmap_left < x0)
+			x0 = slot->bitmap_left;
+		if (slot->bitmap_left + (int)bmap->width > x1)
+			x1 = slot->bitmap_left + bmap->width;
+		if (slot->bitmap_top > y1)
+			y1 = slot->bitmap_top;
+		if (slot->bitmap_top - (int)bmap->rows < y0)
+			y0 = slot->bitmap_top - bmap->rows;
 	}
 
-	bmap = &font->face->glyph->bitmap;
-	if (!bmap->width || !bmap->rows)
+	if (x0 >= x1 || y0 >= y1)
 		goto ready;
 
+	width = x1 - x0;
+	height = y1 - y0;
+
 	glyph->tex = gl_tex_new();
-	data = malloc(sizeof(unsigned char) * bmap->width * bmap->rows * 4);
+	data = malloc(sizeof(unsigned char) * width * height);
 	if (!data) {
 		ret = -ENOMEM;
 		goto err_tex;
 	}
+	memset(data, 0, sizeof(unsigned char) * width * height);
+
+	for (k = 0; k < len; ++k) {
+		if (len > 1) {
+			ret = load_char(font, val[k]);
+			if (ret)
+				goto err_data;
+		}
 
-	for (j = 0; j < bmap->rows; ++j) {
-		for (i = 0; i < bmap->width; ++i) {
-			d = bmap->buffer[i + bmap->width * j];
-			data[4 * (i + j * bmap->width)] = d;
-			data[4 * (i + j * bmap->width) + 1] = d;
-			data[4 * (i + j * bmap->width) + 2] = d;
-			data[4 * (i + j * bmap->width) + 3] = d;
+		off_x = slot->bitmap_left - x0;
+		off_y = y1 - slot->bitmap_top;
+		for (j = 0; j < bmap->rows; ++j) {
+			for (i = 0; i < bmap->width; ++i) {
+				d = bmap->buffer[i + bmap->pitch * j];
+				dst = &data[off_x + i + (off_y + j) * width];
+				if (d > *dst)
+					*dst = d;
+			}
 		}
 	}
 
-	gl_tex_load(glyph->tex, bmap->width, 0, bmap->rows, data);
+	gl_tex_load_a8(glyph->tex, width, height, data);
 	free(data);
 
-	glyph->width = bmap->width;
-	glyph->height = bmap->rows;
-	glyph->left = font->face->glyph->bitmap_left;
-	glyph->top = font->face->glyph->bitmap_top;
-	glyph->advance = font->face->glyph->advance.x >> 6;
+	glyph->width = width;
+	glyph->height = height;
+	glyph->left = x0;
+	glyph->top = y1;
 	glyph->valid = true;
 
 ready:
+	glyph->size = sizeof(*glyph) + glyph->width * glyph->height;
 	*out = glyph;
 	return 0;
 
+err_data:
+	free(data);
 err_tex:
 	gl_tex_free(glyph->tex);
 err_free:
@@ -164,6 +234,19 @@ static void kmscon_glyph_destroy(struct kmscon_glyph *glyph)
 	free(glyph);
 }
 
+static void glyph_mark(void *key, void *value, void *data)
+{
+	kmscon_symbol_mark((kmscon_symbol_t)(long)key);
+}
+
+/* cached glyphs keep their symbols alive */
+static void font_mark(void *data)
+{
+	struct kmscon_font *font = data;
+
+	kmscon_hashtable_foreach(font->glyphs, glyph_mark, NULL);
+}
+
 int kmscon_font_factory_new(struct kmscon_font_factory **out)
 {
 	struct kmscon_font_factory *ff;
@@ -249,6 +332,8 @@ int kmscon_font_factory_load(struct kmscon_font_factory *ff,
 	font->ref = 1;
 	font->width = width;
 	font->height = height;
+	font->budget = conf_global.glyph_budget * 1024UL;
+	kmscon_dlist_init(&font->lru);
 
 	/* TODO: Use fontconfig to get font paths */
 	err = FT_New_Face(ff->lib, path, 0, &font->face);
@@ -280,12 +365,18 @@ int kmscon_font_factory_load(struct kmscon_font_factory *ff,
 	if (ret)
 		goto err_face;
 
+	ret = kmscon_symbol_add_marker(font_mark, font);
+	if (ret)
+		goto err_glyphs;
+
 	kmscon_font_factory_ref(ff);
 	font->ff = ff;
 	*out = font;
 
 	return 0;
 
+err_glyphs:
+	kmscon_hashtable_free(font->glyphs);
 err_face:
 	FT_Done_Face(font->face);
 err_free:
@@ -309,8 +400,10 @@ void kmscon_font_unref(struct kmscon_font *font)
 	if (--font->ref)
 		return;
 
-	log_debug("destroying font");
+	log_debug("destroying font; %lu glyph hits, %lu misses, %lu evictions",
+			font->hits, font->misses, font->evictions);
 
+	kmscon_symbol_rm_marker(font_mark, font);
 	kmscon_hashtable_free(font->glyphs);
 	FT_Done_Face(font->face);
 	kmscon_font_factory_unref(font->ff);
@@ -333,6 +426,31 @@ unsigned int kmscon_font_get_width(struct kmscon_font *font)
 	return font->width;
 }
 
+/* frees glyphs until the font fits into its budget; \keep is not evicted */
+static void font_evict(struct kmscon_font *font, struct kmscon_glyph *keep)
+{
+	struct kmscon_glyph *glyph;
+	size_t scan;
+
+	scan = 2 * font->lru_num;
+	while (font->bytes > font->budget && scan--) {
+		glyph = kmscon_dlist_entry(font->lru.next, struct kmscon_glyph,
+						lru);
+		kmscon_dlist_unlink(&glyph->lru);
+
+		if (glyph->used || glyph == keep) {
+			glyph->used = false;
+			kmscon_dlist_link_tail(&font->lru, &glyph->lru);
+			continue;
+		}
+
+		font->bytes -= glyph->size;
+		--font->lru_num;
+		++font->evictions;
+		kmscon_hashtable_remove(font->glyphs, (void*)(long)glyph->ch);
+	}
+}
+
 static int kmscon_font_lookup(struct kmscon_font *font,
 			kmscon_symbol_t key, struct kmscon_glyph **out)
 {
@@ -345,14 +463,30 @@ static int kmscon_font_lookup(struct kmscon_font *font,
 
 	res = kmscon_hashtable_find(font->glyphs, (void**)&glyph,
 					(void*)(long)key);
-	if (!res) {
-		ret = kmscon_glyph_new(&glyph, key, font);
-		if (ret)
-			return ret;
+	if (res) {
+		++font->hits;
+		glyph->used = true;
+		*out = glyph;
+		return 0;
+	}
 
-		kmscon_hashtable_insert(font->glyphs, (void*)(long)key, glyph);
+	ret = kmscon_glyph_new(&glyph, key, font);
+	if (ret)
+		return ret;
+
+	ret = kmscon_hashtable_insert(font->glyphs, (void*)(long)key, glyph);
+	if (ret) {
+		kmscon_glyph_destroy(glyph);
+		return ret;
 	}
 
+	++font->misses;
+	glyph->used = true;
+	kmscon_dlist_link_tail(&font->lru, &glyph->lru);
+	++font->lru_num;
+	font->bytes += glyph->size;
+	font_evict(font, glyph);
+
 	*out = glyph;
 	return 0;
 }
@@ -363,6 +497,7 @@ int kmscon_font_draw(struct kmscon_font *font, kmscon_symbol_t ch, float *m,
 	int ret;
 	struct kmscon_glyph *glyph;
 	static const float val[] = { 0, 0, 1, 0, 0, 1, 1, 0, 1, 1, 0, 1 };
+	static const float white[] = { 1, 1, 1, 1 };
 
 	if (!font)
 		return -EINVAL;
@@ -378,7 +513,7 @@ int kmscon_font_draw(struct kmscon_font *font, kmscon_symbol_t ch, float *m,
 	gl_m4_translate(m, glyph->left, font->height - glyph->top, 0);
 	gl_m4_scale(m, glyph->width, glyph->height, 1);
 
-	gl_shader_draw_tex(shader, val, val, 6, glyph->tex, m);
+	gl_shader_draw_mask(shader, val, val, 6, glyph->tex, m, white);
 
 	return 0;
 }
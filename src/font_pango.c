@@ -28,17 +28,44 @@
  * Font Handling - Pango
  * This provides a font backend based on Pango library. It can draw any kind of
  * text we want so it is perfect for our console.
+ *
+ * Shaping glyphs through pango is slow, so the metrics of each face and masks
+ * of the most common glyphs are stored in a glyph cache file. See the "Glyph
+ * Cache Files" section below. Glyphs that are missing while drawing are shaped
+ * by a pool of worker threads, see "Rasterization Workers".
+ *
+ * Locking: \manager_mutex protects the list of faces. All faces share one
+ * pango font map, and pango, cairo-ft and HarfBuzz objects of that font map
+ * (contexts, layouts, fonts) are not thread-safe. \font_mutex therefore
+ * serializes every pango call, including the draw calls and the final unref
+ * of shaped glyphs. It is held for one glyph at a time so the draw path waits
+ * at most for a single glyph a worker is shaping. Each face has its own \lock
+ * which protects its list of screens to notify. The glyph table of a face is
+ * only accessed by the drawing thread; workers only fill in glyphs that are
+ * already in it.
  */
 
 #include <cairo.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <glib.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <pango/pango.h>
 #include <pango/pangocairo.h>
+#include <pango/pangofc-font.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "conf.h"
 #include "font.h"
 #include "gl.h"
 #include "log.h"
@@ -51,11 +78,13 @@ enum glyph_type {
 	GLYPH_INVALID,
 	GLYPH_LAYOUT,
 	GLYPH_STRING,
+	GLYPH_MASK,
+	GLYPH_PENDING,
 };
 
 struct font_glyph {
 	kmscon_symbol_t ch;
-	unsigned int type;
+	unsigned int type;		/* atomic while GLYPH_PENDING */
 	unsigned int width;
 	unsigned int ascent;
 	unsigned int descent;
@@ -66,7 +95,17 @@ struct font_glyph {
 			PangoFont *font;
 			PangoGlyphString *str;
 		} string;
+		struct glyph_mask {
+			cairo_surface_t *surface;	/* NULL if empty */
+			int x;
+			int y;
+		} mask;
 	};
+
+	/* glyph budget; glyphs of the cache file are not linked */
+	struct kmscon_dlist lru;
+	bool used;
+	size_t size;			/* 0 until charged to the face */
 };
 
 struct font_face {
@@ -75,16 +114,48 @@ struct font_face {
 
 	struct font_attr attr;
 
+	bool absolute;
 	unsigned int width;
 	unsigned int height;
+	pthread_mutex_t lock;
 	PangoContext *ctx;
 	struct kmscon_hashtable *glyphs;
+
+	/* CLOCK list of evictable glyphs; the head is the clock hand */
+	struct kmscon_dlist lru;
+	size_t lru_num;
+	size_t bytes;
+	size_t budget;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+
+	/* eventfds of the screens using this face; protected by \lock */
+	int *notify_fds;
+	size_t notify_num;
+
+	/* mapped glyph cache file; backs all GLYPH_MASK glyphs */
+	void *cache_map;
+	size_t cache_size;
 };
 
 static pthread_mutex_t manager_mutex = PTHREAD_MUTEX_INITIALIZER;
 static struct font_face *manager__faces;
 static PangoFontMap *manager__lib;
 
+/* serializes all calls into pango; only logging may lock inside of it */
+static pthread_mutex_t font_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void font_lock()
+{
+	pthread_mutex_lock(&font_mutex);
+}
+
+static void font_unlock()
+{
+	pthread_mutex_unlock(&font_mutex);
+}
+
 static void manager_lock()
 {
 	pthread_mutex_lock(&manager_mutex);
@@ -95,55 +166,55 @@ static void manager_unlock()
 	pthread_mutex_unlock(&manager_mutex);
 }
 
+/* the last unref of a font or layout touches the shared font map */
 static void glyph_free(struct font_glyph *glyph)
 {
-	manager_lock();
-
 	if (glyph->type == GLYPH_STRING) {
+		font_lock();
 		g_object_unref(glyph->string.font);
 		pango_glyph_string_free(glyph->string.str);
+		font_unlock();
 	} else if (glyph->type == GLYPH_LAYOUT) {
+		font_lock();
 		g_object_unref(glyph->layout);
+		font_unlock();
+	} else if (glyph->type == GLYPH_MASK) {
+		if (glyph->mask.surface)
+			cairo_surface_destroy(glyph->mask.surface);
 	}
 
-	manager_unlock();
-
 	free(glyph);
 }
 
-static int face_lookup(struct font_face *face, struct font_glyph **out,
-			kmscon_symbol_t ch)
+static void glyph_mark(void *key, void *value, void *data)
+{
+	kmscon_symbol_mark((kmscon_symbol_t)(long)key);
+}
+
+/* cached glyphs keep their symbols alive */
+static void face_mark(void *data)
+{
+	struct font_face *face = data;
+
+	kmscon_hashtable_foreach(face->glyphs, glyph_mark, NULL);
+}
+
+/* shapes glyph->ch and fills in \glyph except for its type, which is returned */
+static unsigned int face_shape(struct font_face *face, struct font_glyph *glyph)
 {
-	struct font_glyph *glyph;
 	PangoLayout *layout;
 	PangoLayoutLine *line;
 	PangoGlyphItem *tmp;
-	PangoGlyphString *str;
 	PangoRectangle rec;
 	size_t len;
-	const char *val;
-	bool res;
-	int ret;
-
-	res = kmscon_hashtable_find(face->glyphs, (void**)&glyph,
-					(void*)(long)ch);
-	if (res) {
-		*out = glyph;
-		return 0;
-	}
-
-	glyph = malloc(sizeof(*glyph));
-	if (!glyph)
-		return -ENOMEM;
-	memset(glyph, 0, sizeof(*glyph));
-	glyph->ch = ch;
+	char val[KMSCON_SYMBOL_U8_MAX];
+	unsigned int type;
 
-	manager_lock();
+	font_lock();
 
 	layout = pango_layout_new(face->ctx);
-	val = kmscon_symbol_get_u8(ch, &len);
+	len = kmscon_symbol_to_u8(glyph->ch, val, sizeof(val));
 	pango_layout_set_text(layout, val, len);
-	kmscon_symbol_free_u8(val);
 
 	pango_layout_get_pixel_extents(layout, NULL, &rec);
 	glyph->ascent = PANGO_PIXELS_CEIL(pango_layout_get_baseline(layout));
@@ -151,33 +222,419 @@ static int face_lookup(struct font_face *face, struct font_glyph **out,
 	glyph->width = rec.width;
 
 	if (pango_layout_get_line_count(layout) != 1 || !glyph->width) {
-		glyph->type = GLYPH_INVALID;
+		type = GLYPH_INVALID;
 		g_object_unref(layout);
 		goto unlock;
 	}
 
 	line = pango_layout_get_line_readonly(layout, 0);
 	if (!line->runs || line->runs->next) {
-		glyph->type = GLYPH_LAYOUT;
+		type = GLYPH_LAYOUT;
 		glyph->layout = layout;
 	} else {
 		tmp = line->runs->data;
-		str = pango_glyph_string_copy(tmp->glyphs);
-		glyph->type = GLYPH_STRING;
-		glyph->string.str = str;
+		type = GLYPH_STRING;
+		glyph->string.str = pango_glyph_string_copy(tmp->glyphs);
 		glyph->string.font = g_object_ref(tmp->item->analysis.font);
 		g_object_unref(layout);
 	}
 
 unlock:
-	manager_unlock();
+	font_unlock();
+	return type;
+}
+
+/* wakes up all screens using \face */
+static void face_notify(struct font_face *face)
+{
+	uint64_t val = 1;
+	size_t i;
+
+	pthread_mutex_lock(&face->lock);
+	for (i = 0; i < face->notify_num; ++i) {
+		if (write(face->notify_fds[i], &val, sizeof(val)) < 0 &&
+		    errno != EAGAIN)
+			log_warn("cannot notify screen (%d): %m", errno);
+	}
+	pthread_mutex_unlock(&face->lock);
+}
+
+static int face_add_notify(struct font_face *face, int fd)
+{
+	int *tmp;
+
+	pthread_mutex_lock(&face->lock);
+	tmp = realloc(face->notify_fds,
+			sizeof(*tmp) * (face->notify_num + 1));
+	if (tmp) {
+		face->notify_fds = tmp;
+		face->notify_fds[face->notify_num++] = fd;
+	}
+	pthread_mutex_unlock(&face->lock);
+
+	return tmp ? 0 : -ENOMEM;
+}
+
+static void face_rm_notify(struct font_face *face, int fd)
+{
+	size_t i;
+
+	pthread_mutex_lock(&face->lock);
+	for (i = 0; i < face->notify_num; ++i) {
+		if (face->notify_fds[i] == fd) {
+			face->notify_fds[i] =
+				face->notify_fds[--face->notify_num];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&face->lock);
+}
+
+/*
+ * Rasterization Workers
+ * face_lookup_async() does not shape missing glyphs itself. Instead it adds a
+ * GLYPH_PENDING glyph to the face and queues a job. One of the worker threads
+ * shapes the glyph, publishes its type with release semantics and notifies all
+ * screens of the face. The screens draw nothing for pending glyphs and their
+ * owner redraws once notified.
+ * Before a face is freed, its queued jobs are dropped and we wait for workers
+ * that are still busy with it. The workers are started with the first job and
+ * stopped when the last face is gone.
+ */
+
+#define POOL_MAX 4
+
+struct glyph_job {
+	struct kmscon_dlist list;
+	struct font_face *face;
+	struct font_glyph *glyph;
+};
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static struct kmscon_dlist pool_jobs = KMSCON_DLIST_INIT(pool_jobs);
+static pthread_t pool_threads[POOL_MAX];
+static struct font_face *pool_busy[POOL_MAX];
+static unsigned int pool_num;
+static bool pool_started;
+static bool pool_exit;
+
+static void *pool_worker(void *data)
+{
+	unsigned int idx = (unsigned long)data;
+	struct glyph_job *job;
+	unsigned int type;
+
+	pthread_mutex_lock(&pool_mutex);
+
+	while (true) {
+		while (!pool_exit && kmscon_dlist_empty(&pool_jobs))
+			pthread_cond_wait(&pool_cond, &pool_mutex);
+		if (pool_exit)
+			break;
+
+		job = kmscon_dlist_entry(pool_jobs.next, struct glyph_job,
+						list);
+		kmscon_dlist_unlink(&job->list);
+		pool_busy[idx] = job->face;
+		pthread_mutex_unlock(&pool_mutex);
+
+		type = face_shape(job->face, job->glyph);
+		__atomic_store_n(&job->glyph->type, type, __ATOMIC_RELEASE);
+		face_notify(job->face);
+		free(job);
+
+		pthread_mutex_lock(&pool_mutex);
+		pool_busy[idx] = NULL;
+		pthread_cond_broadcast(&pool_done);
+	}
+
+	pthread_mutex_unlock(&pool_mutex);
+	return NULL;
+}
+
+/* starts the workers; signals stay blocked in them */
+static void pool__start()
+{
+	sigset_t mask, old;
+	long num;
+	int ret;
+
+	pool_started = true;
+
+	num = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	if (num < 1)
+		num = 1;
+	else if (num > POOL_MAX)
+		num = POOL_MAX;
+
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &old);
+
+	for (pool_num = 0; pool_num < num; ++pool_num) {
+		ret = pthread_create(&pool_threads[pool_num], NULL,
+					pool_worker,
+					(void*)(unsigned long)pool_num);
+		if (ret) {
+			log_warn("cannot start glyph worker (%d)", ret);
+			break;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	log_debug("started %u glyph workers", pool_num);
+}
+
+static void pool_stop()
+{
+	unsigned int i, num;
+
+	pthread_mutex_lock(&pool_mutex);
+	pool_exit = true;
+	pthread_cond_broadcast(&pool_cond);
+	num = pool_num;
+	pthread_mutex_unlock(&pool_mutex);
+
+	for (i = 0; i < num; ++i)
+		pthread_join(pool_threads[i], NULL);
+
+	pthread_mutex_lock(&pool_mutex);
+	pool_num = 0;
+	pool_started = false;
+	pool_exit = false;
+	pthread_mutex_unlock(&pool_mutex);
+}
 
-	ret = kmscon_hashtable_insert(face->glyphs, (void*)(long)ch, glyph);
+/* queues \glyph; returns -EAGAIN if no worker is available */
+static int pool_add(struct font_face *face, struct font_glyph *glyph)
+{
+	struct glyph_job *job;
+	int ret = 0;
+
+	job = malloc(sizeof(*job));
+	if (!job)
+		return -ENOMEM;
+	memset(job, 0, sizeof(*job));
+	job->face = face;
+	job->glyph = glyph;
+
+	pthread_mutex_lock(&pool_mutex);
+
+	if (!pool_started)
+		pool__start();
+
+	if (pool_num) {
+		kmscon_dlist_link_tail(&pool_jobs, &job->list);
+		pthread_cond_signal(&pool_cond);
+	} else {
+		free(job);
+		ret = -EAGAIN;
+	}
+
+	pthread_mutex_unlock(&pool_mutex);
+	return ret;
+}
+
+/* drops all jobs of \face and waits until no worker uses it anymore */
+static void pool_cancel(struct font_face *face)
+{
+	struct kmscon_dlist *iter, *tmp;
+	struct glyph_job *job;
+	unsigned int i;
+
+	pthread_mutex_lock(&pool_mutex);
+
+	for (iter = pool_jobs.next; iter != &pool_jobs; iter = tmp) {
+		tmp = iter->next;
+		job = kmscon_dlist_entry(iter, struct glyph_job, list);
+		if (job->face == face) {
+			kmscon_dlist_unlink(&job->list);
+			__atomic_store_n(&job->glyph->type, GLYPH_INVALID,
+						__ATOMIC_RELEASE);
+			free(job);
+		}
+	}
+
+	for (i = 0; i < pool_num; ) {
+		if (pool_busy[i] == face) {
+			pthread_cond_wait(&pool_done, &pool_mutex);
+			i = 0;
+		} else {
+			++i;
+		}
+	}
+
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+/* waits for a queued glyph to be shaped */
+static void pool_wait(struct font_glyph *glyph)
+{
+	pthread_mutex_lock(&pool_mutex);
+	while (__atomic_load_n(&glyph->type, __ATOMIC_ACQUIRE) ==
+								GLYPH_PENDING)
+		pthread_cond_wait(&pool_done, &pool_mutex);
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+/*
+ * Glyph Budget
+ * Every face keeps at most conf_global.glyph_budget KiB of shaped glyphs. All
+ * glyphs that were shaped at runtime are linked into a CLOCK list. Lookups set
+ * their \used bit. If the face exceeds its budget, the clock hand at the list
+ * head evicts glyphs that were not used since it passed them last, and clears
+ * the bit of all others. Pending glyphs are owned by a worker and are never
+ * evicted. Glyphs from the cache file live in the shared mapping and are not
+ * accounted.
+ * Pango does not tell us the size of its objects, so layouts are charged with
+ * a fixed estimate.
+ */
+
+#define GLYPH_LAYOUT_COST 2048
+
+static size_t glyph_size(struct font_glyph *glyph)
+{
+	size_t size = sizeof(*glyph);
+
+	if (glyph->type == GLYPH_STRING)
+		size += glyph->string.str->num_glyphs *
+				(sizeof(PangoGlyphInfo) + sizeof(int));
+	else if (glyph->type == GLYPH_LAYOUT)
+		size += GLYPH_LAYOUT_COST;
+
+	return size;
+}
+
+/* evicts glyphs until the face fits into its budget; \keep is not evicted */
+static void face_evict(struct font_face *face, struct font_glyph *keep)
+{
+	struct font_glyph *glyph;
+	size_t scan;
+	unsigned int type;
+
+	/* two rounds clear all bits and evict everything that is allowed */
+	scan = 2 * face->lru_num;
+	while (face->bytes > face->budget && scan--) {
+		glyph = kmscon_dlist_entry(face->lru.next, struct font_glyph,
+						lru);
+		kmscon_dlist_unlink(&glyph->lru);
+
+		type = __atomic_load_n(&glyph->type, __ATOMIC_ACQUIRE);
+		if (glyph->used || glyph == keep || type == GLYPH_PENDING) {
+			glyph->used = false;
+			kmscon_dlist_link_tail(&face->lru, &glyph->lru);
+			continue;
+		}
+
+		face->bytes -= glyph->size;
+		--face->lru_num;
+		++face->evictions;
+		kmscon_hashtable_remove(face->glyphs, (void*)(long)glyph->ch);
+	}
+}
+
+/* marks \glyph as used and charges it to the face once it is shaped */
+static void face_touch(struct font_face *face, struct font_glyph *glyph)
+{
+	glyph->used = true;
+
+	if (glyph->size || !glyph->lru.next ||
+	    __atomic_load_n(&glyph->type, __ATOMIC_ACQUIRE) == GLYPH_PENDING)
+		return;
+
+	glyph->size = glyph_size(glyph);
+	face->bytes += glyph->size;
+	face_evict(face, glyph);
+}
+
+static int face_insert(struct font_face *face, struct font_glyph *glyph)
+{
+	int ret;
+
+	ret = kmscon_hashtable_insert(face->glyphs, (void*)(long)glyph->ch,
+					glyph);
 	if (ret) {
 		glyph_free(glyph);
 		return ret;
 	}
 
+	++face->misses;
+	kmscon_dlist_link_tail(&face->lru, &glyph->lru);
+	++face->lru_num;
+	return 0;
+}
+
+/*
+ * Returns the glyph of \ch, shaping it right away if it is missing. Glyphs
+ * that are still queued are waited for.
+ */
+static int face_lookup(struct font_face *face, struct font_glyph **out,
+			kmscon_symbol_t ch)
+{
+	struct font_glyph *glyph;
+	int ret;
+
+	if (kmscon_hashtable_find(face->glyphs, (void**)&glyph,
+					(void*)(long)ch)) {
+		pool_wait(glyph);
+		++face->hits;
+		face_touch(face, glyph);
+		*out = glyph;
+		return 0;
+	}
+
+	glyph = malloc(sizeof(*glyph));
+	if (!glyph)
+		return -ENOMEM;
+	memset(glyph, 0, sizeof(*glyph));
+	glyph->ch = ch;
+	glyph->type = face_shape(face, glyph);
+
+	ret = face_insert(face, glyph);
+	if (ret)
+		return ret;
+
+	face_touch(face, glyph);
+	*out = glyph;
+	return 0;
+}
+
+/*
+ * Like face_lookup() but missing glyphs are queued for the workers and returned
+ * as GLYPH_PENDING. This is used by the draw path so it never shapes glyphs.
+ */
+static int face_lookup_async(struct font_face *face, struct font_glyph **out,
+				kmscon_symbol_t ch)
+{
+	struct font_glyph *glyph;
+	int ret;
+
+	if (kmscon_hashtable_find(face->glyphs, (void**)&glyph,
+					(void*)(long)ch)) {
+		++face->hits;
+		face_touch(face, glyph);
+		*out = glyph;
+		return 0;
+	}
+
+	glyph = malloc(sizeof(*glyph));
+	if (!glyph)
+		return -ENOMEM;
+	memset(glyph, 0, sizeof(*glyph));
+	glyph->ch = ch;
+	glyph->type = GLYPH_PENDING;
+
+	ret = face_insert(face, glyph);
+	if (ret)
+		return ret;
+
+	ret = pool_add(face, glyph);
+	if (ret)
+		glyph->type = face_shape(face, glyph);
+
+	face_touch(face, glyph);
 	*out = glyph;
 	return 0;
 }
@@ -241,6 +698,10 @@ static int face__new(struct font_face **out, const struct font_attr *attr,
 		return -ENOMEM;
 	memset(face, 0, sizeof(*face));
 	face->ref = 1;
+	face->absolute = absolute;
+	face->budget = conf_global.glyph_budget * 1024UL;
+	kmscon_dlist_init(&face->lru);
+	pthread_mutex_init(&face->lock, NULL);
 
 	ret = attr_cpy(&face->attr, attr, true);
 	if (ret)
@@ -264,8 +725,13 @@ static int face__new(struct font_face **out, const struct font_attr *attr,
 	if (ret)
 		goto err_attr;
 
+	ret = kmscon_symbol_add_marker(face_mark, face);
+	if (ret)
+		goto err_glyphs;
+
 	log_info("loading new font: %s", face->attr.name);
 
+	font_lock();
 	face->ctx = pango_font_map_create_context(manager__lib);
 	pango_context_set_base_dir(face->ctx, PANGO_DIRECTION_LTR);
 	pango_context_set_language(face->ctx, pango_language_get_default());
@@ -296,27 +762,44 @@ static int face__new(struct font_face **out, const struct font_attr *attr,
 		pango_cairo_context_set_font_options(face->ctx, opt);
 		cairo_font_options_destroy(opt);
 	}
+	font_unlock();
 
 	*out = face;
 	return 0;
 
 err_ctx:
 	g_object_unref(face->ctx);
+	font_unlock();
+	kmscon_symbol_rm_marker(face_mark, face);
+err_glyphs:
 	kmscon_hashtable_free(face->glyphs);
 err_attr:
 	attr_clean(&face->attr);
 err_free:
+	pthread_mutex_destroy(&face->lock);
 	free(face);
 	return ret;
 }
 
 static void face__free(struct font_face *face)
 {
+	log_debug("font %s: %lu glyph hits, %lu misses, %lu evictions",
+			face->attr.name, face->hits, face->misses,
+			face->evictions);
+
 	manager_unlock();
+	pool_cancel(face);
+	kmscon_symbol_rm_marker(face_mark, face);
 	kmscon_hashtable_free(face->glyphs);
+	if (face->cache_map)
+		munmap(face->cache_map, face->cache_size);
 	manager_lock();
+	font_lock();
 	g_object_unref(face->ctx);
+	font_unlock();
 	attr_clean(&face->attr);
+	free(face->notify_fds);
+	pthread_mutex_destroy(&face->lock);
 	free(face);
 }
 
@@ -366,6 +849,8 @@ static void face_unref(struct font_face *face)
 	if (!--face->ref) {
 		manager__remove(face);
 		face__free(face);
+		if (!manager__faces)
+			pool_stop();
 	}
 	manager_unlock();
 }
@@ -413,6 +898,532 @@ static int face_measure(struct font_face *face)
 	return 0;
 }
 
+/*
+ * Glyph Cache Files
+ * A cache file contains the metrics of a single face and pre-rasterized A8
+ * masks of the glyphs listed in cache_ranges. Files live in the directory
+ * given by --glyph-cache and are named after a hash of the cache key. The key
+ * describes the face (resolved font file with its size and mtime, point size,
+ * DPI, style and the pango version) and is stored in the header so hash
+ * collisions and stale files are detected. Faces whose key does not fit into
+ * the header, e.g. due to very long font paths, are not cached.
+ *
+ * The file is mapped read-only and the masks are used in place as cairo
+ * surfaces, so loading a face from the cache does not touch pango at all. All
+ * other glyphs are still shaped on demand.
+ * The format uses native byte order; files from other machines are rejected
+ * by the byte-order field and rebuilt.
+ *
+ * Layout:
+ *   struct cache_header
+ *   struct cache_glyph[num]
+ *   mask data, each mask CACHE_ALIGN aligned with cairo A8 stride
+ */
+
+#define CACHE_MAGIC "KMSCONGC"
+#define CACHE_VERSION 1
+#define CACHE_BYTE_ORDER 0x01020304
+#define CACHE_KEY_LEN 256
+#define CACHE_ALIGN 16
+
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	char key[CACHE_KEY_LEN];
+	uint32_t width;
+	uint32_t height;
+	uint32_t num;
+	uint32_t reserved;
+	uint64_t size;
+};
+
+struct cache_glyph {
+	uint32_t ch;
+	uint32_t width;
+	uint32_t ascent;
+	uint32_t descent;
+	int32_t x;		/* mask origin relative to the cell */
+	int32_t y;
+	uint32_t mask_width;
+	uint32_t mask_height;
+	uint32_t stride;
+	uint32_t reserved;
+	uint64_t offset;	/* offset of the mask; 0 if empty */
+};
+
+/* printable ASCII, Latin-1, box drawing and block elements */
+static const uint32_t cache_ranges[][2] = {
+	{ 0x20, 0x7e },
+	{ 0xa0, 0xff },
+	{ 0x2500, 0x259f },
+};
+
+static uint64_t face_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Resolves the font file that fontconfig picked for \face. Returns the path,
+ * face index, size and mtime of the file or -ENOENT if the font does not come
+ * from a file.
+ */
+static int cache_font_file(struct font_face *face, char *path, size_t len,
+				int *index, struct stat *st)
+{
+	PangoFont *font;
+	FcPattern *pattern;
+	FcChar8 *file;
+	int ret = -ENOENT;
+
+	font_lock();
+
+	font = pango_context_load_font(face->ctx,
+			pango_context_get_font_description(face->ctx));
+	if (!font)
+		goto out_unlock;
+
+	if (!PANGO_IS_FC_FONT(font))
+		goto out;
+
+#if PANGO_VERSION_CHECK(1, 48, 0)
+	pattern = pango_fc_font_get_pattern(PANGO_FC_FONT(font));
+#else
+	pattern = PANGO_FC_FONT(font)->font_pattern;
+#endif
+	if (FcPatternGetString(pattern, FC_FILE, 0, &file) != FcResultMatch)
+		goto out;
+	if (FcPatternGetInteger(pattern, FC_INDEX, 0, index) != FcResultMatch)
+		*index = 0;
+	if (stat((const char*)file, st))
+		goto out;
+
+	snprintf(path, len, "%s", (const char*)file);
+	ret = 0;
+
+out:
+	g_object_unref(font);
+out_unlock:
+	font_unlock();
+	return ret;
+}
+
+/*
+ * The key names the font file that is actually rendered together with its
+ * size and mtime, so a font update or a changed fontconfig match invalidates
+ * the cache. Faces that are not backed by a file fall back to the name.
+ * Returns -E2BIG if the key does not fit into CACHE_KEY_LEN. A truncated key
+ * could match the file of another face.
+ */
+static int cache_key(struct font_face *face, char *key)
+{
+	char file[PATH_MAX];
+	struct stat st;
+	int index, len;
+
+	if (cache_font_file(face, file, sizeof(file), &index, &st)) {
+		snprintf(file, sizeof(file), "%s", face->attr.name);
+		index = 0;
+		memset(&st, 0, sizeof(st));
+	}
+
+	memset(key, 0, CACHE_KEY_LEN);
+	len = snprintf(key, CACHE_KEY_LEN,
+			"%lld:%lld:%u:%u:%d:%d:%d:pango-%s:%s:%d",
+			(long long)st.st_size, (long long)st.st_mtime,
+			face->attr.points, face->attr.dpi, face->attr.bold,
+			face->attr.style, face->absolute,
+			pango_version_string(), file, index);
+	if (len < 0 || len >= CACHE_KEY_LEN) {
+		log_debug("glyph cache key of font %s too long, not caching",
+				face->attr.name);
+		return -E2BIG;
+	}
+
+	return 0;
+}
+
+/* returns a newly allocated path or NULL if the cache is disabled */
+static char *cache_path(const char *key)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	const char *dir = conf_global.glyph_cache;
+	char *path;
+	size_t i;
+
+	if (!dir || !*dir)
+		return NULL;
+
+	for (i = 0; key[i]; ++i) {
+		hash ^= (unsigned char)key[i];
+		hash *= 1099511628211ULL;
+	}
+
+	if (asprintf(&path, "%s/%016" PRIx64 ".glyphs", dir, hash) < 0)
+		return NULL;
+
+	return path;
+}
+
+static int cache_add_glyph(struct font_face *face, const struct cache_glyph *rec)
+{
+	struct font_glyph *glyph;
+	unsigned char *data;
+	uint64_t end;
+	int ret;
+
+	if (rec->ch > KMSCON_UCS4_MAX)
+		return -EINVAL;
+
+	glyph = malloc(sizeof(*glyph));
+	if (!glyph)
+		return -ENOMEM;
+	memset(glyph, 0, sizeof(*glyph));
+	glyph->ch = rec->ch;
+	glyph->type = GLYPH_MASK;
+	glyph->width = rec->width;
+	glyph->ascent = rec->ascent;
+	glyph->descent = rec->descent;
+	glyph->mask.x = rec->x;
+	glyph->mask.y = rec->y;
+
+	if (rec->offset) {
+		end = rec->offset + (uint64_t)rec->stride * rec->mask_height;
+		if (rec->offset % CACHE_ALIGN || end > face->cache_size ||
+		    rec->stride != (uint32_t)cairo_format_stride_for_width(
+					CAIRO_FORMAT_A8, rec->mask_width)) {
+			ret = -EINVAL;
+			goto err_free;
+		}
+
+		data = (unsigned char*)face->cache_map + rec->offset;
+		glyph->mask.surface = cairo_image_surface_create_for_data(data,
+					CAIRO_FORMAT_A8, rec->mask_width,
+					rec->mask_height, rec->stride);
+		if (cairo_surface_status(glyph->mask.surface) !=
+						CAIRO_STATUS_SUCCESS) {
+			cairo_surface_destroy(glyph->mask.surface);
+			ret = -EFAULT;
+			goto err_free;
+		}
+	}
+
+	ret = kmscon_hashtable_insert(face->glyphs, (void*)(long)rec->ch,
+					glyph);
+	if (ret)
+		goto err_surface;
+
+	return 0;
+
+err_surface:
+	if (glyph->mask.surface)
+		cairo_surface_destroy(glyph->mask.surface);
+err_free:
+	free(glyph);
+	return ret;
+}
+
+/* loads metrics and glyphs of \face from its cache file if there is one */
+static int cache_load(struct font_face *face)
+{
+	char key[CACHE_KEY_LEN], *path;
+	const struct cache_header *hdr;
+	const struct cache_glyph *recs;
+	struct stat st;
+	void *map;
+	unsigned int i;
+	int fd, ret;
+
+	if (cache_key(face, key))
+		return -ENOENT;
+	path = cache_path(key);
+	if (!path)
+		return -ENOENT;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd < 0)
+		return -errno;
+
+	ret = fstat(fd, &st);
+	if (ret || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	hdr = map;
+	recs = (const void*)&hdr[1];
+	if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != CACHE_VERSION ||
+	    hdr->byte_order != CACHE_BYTE_ORDER ||
+	    memcmp(hdr->key, key, CACHE_KEY_LEN) ||
+	    hdr->size != (uint64_t)st.st_size ||
+	    !hdr->width || !hdr->height ||
+	    hdr->num > (st.st_size - sizeof(*hdr)) / sizeof(*recs)) {
+		log_info("ignoring outdated glyph cache for %s",
+				face->attr.name);
+		munmap(map, st.st_size);
+		return -EINVAL;
+	}
+
+	face->cache_map = map;
+	face->cache_size = st.st_size;
+
+	for (i = 0; i < hdr->num; ++i) {
+		ret = cache_add_glyph(face, &recs[i]);
+		if (ret)
+			log_warn("invalid glyph %u in glyph cache (%d)",
+					recs[i].ch, ret);
+	}
+
+	face->width = hdr->width;
+	face->height = hdr->height;
+	return 0;
+}
+
+/* rasterizes \ch of \face into a newly allocated A8 mask */
+static int cache_render(struct font_face *face, const struct font_glyph *glyph,
+			struct cache_glyph *rec, unsigned char **out)
+{
+	PangoLayout *layout;
+	PangoRectangle ink;
+	cairo_surface_t *surface;
+	cairo_t *cr;
+	unsigned char *data;
+	char val[KMSCON_SYMBOL_U8_MAX];
+	size_t len;
+	int stride, height, ret = 0;
+	double base;
+
+	*out = NULL;
+
+	font_lock();
+
+	layout = pango_layout_new(face->ctx);
+	len = kmscon_symbol_to_u8(glyph->ch, val, sizeof(val));
+	pango_layout_set_text(layout, val, len);
+	pango_layout_get_pixel_extents(layout, &ink, NULL);
+	if (ink.width <= 0 || ink.height <= 0)
+		goto out_layout;
+
+	/* the draw path puts the baseline on a pixel boundary; so do we */
+	base = (double)pango_layout_get_baseline(layout) / PANGO_SCALE;
+	height = ink.height + 1;
+	stride = cairo_format_stride_for_width(CAIRO_FORMAT_A8, ink.width);
+	data = calloc(stride, height);
+	if (!data) {
+		ret = -ENOMEM;
+		goto out_layout;
+	}
+
+	surface = cairo_image_surface_create_for_data(data, CAIRO_FORMAT_A8,
+						ink.width, height, stride);
+	cr = cairo_create(surface);
+	cairo_move_to(cr, -ink.x, glyph->ascent - base - ink.y);
+	pango_cairo_show_layout(cr, layout);
+	cairo_destroy(cr);
+	cairo_surface_flush(surface);
+	if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+		free(data);
+		ret = -EFAULT;
+	} else {
+		rec->x = ink.x;
+		rec->y = ink.y;
+		rec->mask_width = ink.width;
+		rec->mask_height = height;
+		rec->stride = stride;
+		*out = data;
+	}
+	cairo_surface_destroy(surface);
+
+out_layout:
+	g_object_unref(layout);
+	font_unlock();
+	return ret;
+}
+
+static int cache_write(int fd, const void *data, size_t len)
+{
+	const char *buf = data;
+	ssize_t l;
+
+	while (len) {
+		l = write(fd, buf, len);
+		if (l < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += l;
+		len -= l;
+	}
+
+	return 0;
+}
+
+/*
+ * Rasterizes the glyphs of cache_ranges and writes them together with the
+ * metrics of \face into its cache file. The file is written to a temporary
+ * file first and then renamed so readers never see partial files.
+ */
+static int cache_save(struct font_face *face)
+{
+	struct cache_header hdr;
+	struct cache_glyph *recs;
+	struct font_glyph *glyph;
+	unsigned char **masks;
+	char *path, *tmp;
+	unsigned int i, num, max;
+	uint32_t ch;
+	uint64_t off;
+	size_t size;
+	int fd, ret;
+	static const char pad[CACHE_ALIGN];
+
+	memset(&hdr, 0, sizeof(hdr));
+	if (cache_key(face, hdr.key))
+		return 0;
+	path = cache_path(hdr.key);
+	if (!path)
+		return 0;
+
+	max = 0;
+	for (i = 0; i < sizeof(cache_ranges) / sizeof(*cache_ranges); ++i)
+		max += cache_ranges[i][1] - cache_ranges[i][0] + 1;
+
+	recs = calloc(max, sizeof(*recs));
+	masks = calloc(max, sizeof(*masks));
+	if (!recs || !masks) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	num = 0;
+	for (i = 0; i < sizeof(cache_ranges) / sizeof(*cache_ranges); ++i) {
+		for (ch = cache_ranges[i][0]; ch <= cache_ranges[i][1]; ++ch) {
+			ret = face_lookup(face, &glyph, ch);
+			if (ret || glyph->type == GLYPH_INVALID)
+				continue;
+
+			recs[num].ch = ch;
+			recs[num].width = glyph->width;
+			recs[num].ascent = glyph->ascent;
+			recs[num].descent = glyph->descent;
+			ret = cache_render(face, glyph, &recs[num],
+						&masks[num]);
+			if (ret)
+				goto out_free;
+			++num;
+		}
+	}
+
+	off = sizeof(hdr) + sizeof(*recs) * num;
+	off = (off + CACHE_ALIGN - 1) & ~(uint64_t)(CACHE_ALIGN - 1);
+	for (i = 0; i < num; ++i) {
+		if (!masks[i])
+			continue;
+		recs[i].offset = off;
+		size = (size_t)recs[i].stride * recs[i].mask_height;
+		off += (size + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1);
+	}
+
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CACHE_VERSION;
+	hdr.byte_order = CACHE_BYTE_ORDER;
+	hdr.width = face->width;
+	hdr.height = face->height;
+	hdr.num = num;
+	hdr.size = off;
+
+	if (asprintf(&tmp, "%s.%d", path, (int)getpid()) < 0) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	mkdir(conf_global.glyph_cache, 0755);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		goto out_tmp;
+	}
+
+	ret = cache_write(fd, &hdr, sizeof(hdr));
+	if (!ret)
+		ret = cache_write(fd, recs, sizeof(*recs) * num);
+	off = sizeof(hdr) + sizeof(*recs) * num;
+	for (i = 0; !ret && i < num; ++i) {
+		if (!masks[i])
+			continue;
+		ret = cache_write(fd, pad, recs[i].offset - off);
+		if (ret)
+			break;
+		size = (size_t)recs[i].stride * recs[i].mask_height;
+		ret = cache_write(fd, masks[i], size);
+		off = recs[i].offset + size;
+	}
+	if (!ret)
+		ret = cache_write(fd, pad, hdr.size - off);
+
+	close(fd);
+	if (!ret && rename(tmp, path))
+		ret = -errno;
+	if (ret)
+		unlink(tmp);
+	else
+		log_info("wrote glyph cache %s with %u glyphs", path, num);
+
+out_tmp:
+	free(tmp);
+out_free:
+	if (masks) {
+		for (i = 0; i < max; ++i)
+			free(masks[i]);
+	}
+	free(masks);
+	free(recs);
+	free(path);
+	return ret;
+}
+
+/* loads the face from its cache file or measures it and writes the cache */
+static int face_load(struct font_face *face)
+{
+	uint64_t start;
+	int ret;
+
+	start = face_now();
+
+	ret = cache_load(face);
+	if (!ret) {
+		log_info("loaded font %s from glyph cache in %" PRIu64 "us",
+				face->attr.name, face_now() - start);
+		return 0;
+	}
+
+	ret = face_measure(face);
+	if (ret)
+		return ret;
+
+	log_info("measured font %s in %" PRIu64 "us", face->attr.name,
+			face_now() - start);
+
+	ret = cache_save(face);
+	if (ret)
+		log_warn("cannot write glyph cache (%d): %s", ret,
+				strerror(-ret));
+
+	return 0;
+}
+
 static int manager_get(struct font_face **out, const struct font_attr *attr,
 			bool absolute)
 {
@@ -438,7 +1449,7 @@ static int manager_get(struct font_face **out, const struct font_attr *attr,
 			goto unlock;
 
 		manager_unlock();
-		ret = face_measure(iter);
+		ret = face_load(iter);
 		manager_lock();
 		if (ret) {
 			face__free(iter);
@@ -522,6 +1533,8 @@ struct font_screen {
 
 	cairo_surface_t *surface;
 	cairo_t *cr;
+
+	int efd;
 };
 
 static int screen_new(struct font_screen **out, struct font_buffer *buf,
@@ -608,11 +1621,31 @@ static int screen_new(struct font_screen **out, struct font_buffer *buf,
 	screen->advance_x = screen->faces.normal->width;
 	screen->advance_y = screen->faces.normal->height;
 
+	screen->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (screen->efd < 0) {
+		log_err("cannot create eventfd (%d): %m", errno);
+		ret = -EFAULT;
+		goto err_bold;
+	}
+
+	ret = face_add_notify(screen->faces.normal, screen->efd);
+	if (ret)
+		goto err_efd;
+	ret = face_add_notify(screen->faces.bold, screen->efd);
+	if (ret)
+		goto err_notify;
+
 	screen->tex = gl_tex_new();
 	gl_shader_ref(screen->shader);
 	*out = screen;
 	return 0;
 
+err_notify:
+	face_rm_notify(screen->faces.normal, screen->efd);
+err_efd:
+	close(screen->efd);
+err_bold:
+	face_unref(screen->faces.bold);
 err_normal:
 	face_unref(screen->faces.normal);
 err_cr:
@@ -644,8 +1677,11 @@ void font_screen_free(struct font_screen *screen)
 		return;
 
 	log_debug("free screen");
+	face_rm_notify(screen->faces.bold, screen->efd);
+	face_rm_notify(screen->faces.normal, screen->efd);
 	face_unref(screen->faces.bold);
 	face_unref(screen->faces.normal);
+	close(screen->efd);
 	cairo_destroy(screen->cr);
 	cairo_surface_destroy(screen->surface);
 	gl_tex_free(screen->tex);
@@ -653,6 +1689,22 @@ void font_screen_free(struct font_screen *screen)
 	free(screen);
 }
 
+int font_screen_get_fd(struct font_screen *screen)
+{
+	return screen ? screen->efd : -1;
+}
+
+void font_screen_dispatch(struct font_screen *screen)
+{
+	uint64_t val;
+
+	if (!screen)
+		return;
+
+	if (read(screen->efd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		log_warn("cannot read eventfd (%d): %m", errno);
+}
+
 unsigned int font_screen_columns(struct font_screen *screen)
 {
 	return screen ? screen->cols : 0;
@@ -703,25 +1755,37 @@ int font_screen_draw_char(struct font_screen *screen, kmscon_symbol_t ch,
 				unsigned int width, unsigned int height)
 {
 	struct font_glyph *glyph;
+	unsigned int type;
 	int ret;
 
 	if (!screen || !width || !height)
 		return -EINVAL;
 
-	ret = face_lookup(screen->faces.normal, &glyph, ch);
+	ret = face_lookup_async(screen->faces.normal, &glyph, ch);
 	if (ret)
 		return ret;
 
-	if (glyph->type == GLYPH_STRING) {
+	/* pending glyphs are left blank until the screen is notified */
+	type = __atomic_load_n(&glyph->type, __ATOMIC_ACQUIRE);
+	if (type == GLYPH_STRING) {
 		cairo_move_to(screen->cr, cellx * screen->advance_x,
 				celly * screen->advance_y + glyph->ascent);
+		font_lock();
 		pango_cairo_show_glyph_string(screen->cr, glyph->string.font,
 						glyph->string.str);
-	} else if (glyph->type == GLYPH_LAYOUT) {
+		font_unlock();
+	} else if (type == GLYPH_LAYOUT) {
 		cairo_move_to(screen->cr, cellx * screen->advance_x,
 					celly * screen->advance_y);
+		font_lock();
 		pango_cairo_update_layout(screen->cr, glyph->layout);
 		pango_cairo_show_layout(screen->cr, glyph->layout);
+		font_unlock();
+	} else if (type == GLYPH_MASK && glyph->mask.surface) {
+		/* masks are pixel aligned; keep them on pixel boundaries */
+		cairo_mask_surface(screen->cr, glyph->mask.surface,
+			(int)(cellx * screen->advance_x + 0.5) + glyph->mask.x,
+			(int)(celly * screen->advance_y + 0.5) + glyph->mask.y);
 	}
 
 	return 0;
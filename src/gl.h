@@ -75,9 +75,14 @@ unsigned int gl_tex_new();
 void gl_tex_free(unsigned int tex);
 void gl_tex_load(unsigned int tex, unsigned int width, unsigned int stride,
 			unsigned int height, void *buf);
+void gl_tex_load_a8(unsigned int tex, unsigned int width, unsigned int height,
+			void *buf);
 
 /*
  * Shader API
+ * gl_shader_draw_tex() draws BGRA textures as they are. gl_shader_draw_mask()
+ * draws single-channel textures loaded with gl_tex_load_a8() as coverage of
+ * the RGBA color \color.
  */
 
 struct gl_shader;
@@ -91,5 +96,8 @@ void gl_shader_draw_def(struct gl_shader *shader, float *vertices,
 void gl_shader_draw_tex(struct gl_shader *shader, const float *vertices,
 			const float *texcoords, size_t num,
 			unsigned int tex, const float *m);
+void gl_shader_draw_mask(struct gl_shader *shader, const float *vertices,
+			const float *texcoords, size_t num,
+			unsigned int tex, const float *m, const float *color);
 
 #endif /* GL_GL_H */
@@ -121,6 +121,20 @@ void gl_tex_load(unsigned int tex, unsigned int width, unsigned int stride,
 	/* glPixelStorei(GL_UNPACK_ROW_LENGTH, 0); */
 }
 
+/* loads a tightly packed 8-bit coverage bitmap into the alpha channel */
+void gl_tex_load_a8(unsigned int tex, unsigned int width, unsigned int height,
+			void *buf)
+{
+	if (!buf || !width || !height)
+		return;
+
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, width, height, 0,
+			GL_ALPHA, GL_UNSIGNED_BYTE, buf);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
 struct gl_shader {
 	unsigned long ref;
 
@@ -134,6 +148,12 @@ struct gl_shader {
 	GLuint tex_fshader;
 	GLuint tex_uni_projection;
 	GLuint tex_uni_texture;
+
+	GLuint mask_program;
+	GLuint mask_fshader;
+	GLuint mask_uni_projection;
+	GLuint mask_uni_texture;
+	GLuint mask_uni_color;
 };
 
 /* external shader sources; generated during build */
@@ -141,6 +161,7 @@ extern const char *kmscon_vert_def;
 extern const char *kmscon_frag_def;
 extern const char *kmscon_vert_tex;
 extern const char *kmscon_frag_tex;
+extern const char *kmscon_frag_mask;
 
 static int compile_shader(GLenum type, const char *source)
 {
@@ -280,6 +301,51 @@ static void free_tex_shader(struct gl_shader *shader)
 	glDeleteShader(shader->tex_vshader);
 }
 
+/* the mask shader shares the vertex shader of the texture shader */
+static int init_mask_shader(struct gl_shader *shader)
+{
+	char msg[512];
+	GLint status = 1;
+
+	shader->mask_fshader = compile_shader(GL_FRAGMENT_SHADER,
+						kmscon_frag_mask);
+	if (shader->mask_fshader == GL_NONE)
+		return -EFAULT;
+
+	shader->mask_program = glCreateProgram();
+	glAttachShader(shader->mask_program, shader->tex_vshader);
+	glAttachShader(shader->mask_program, shader->mask_fshader);
+	glBindAttribLocation(shader->mask_program, 0, "position");
+	glBindAttribLocation(shader->mask_program, 1, "texture_position");
+
+	glLinkProgram(shader->mask_program);
+	glGetProgramiv(shader->mask_program, GL_LINK_STATUS, &status);
+	if (status == GL_FALSE) {
+		msg[0] = 0;
+		glGetProgramInfoLog(shader->mask_program, sizeof(msg),
+					NULL, msg);
+		log_warn("cannot link shader: %s", msg);
+		glDeleteProgram(shader->mask_program);
+		glDeleteShader(shader->mask_fshader);
+		return -EFAULT;
+	}
+
+	shader->mask_uni_projection =
+		glGetUniformLocation(shader->mask_program, "projection");
+	shader->mask_uni_texture =
+		glGetUniformLocation(shader->mask_program, "texture");
+	shader->mask_uni_color =
+		glGetUniformLocation(shader->mask_program, "color");
+
+	return 0;
+}
+
+static void free_mask_shader(struct gl_shader *shader)
+{
+	glDeleteProgram(shader->mask_program);
+	glDeleteShader(shader->mask_fshader);
+}
+
 int gl_shader_new(struct gl_shader **out)
 {
 	struct gl_shader *shader;
@@ -302,6 +368,10 @@ int gl_shader_new(struct gl_shader **out)
 	if (ret)
 		goto err_def;
 
+	ret = init_mask_shader(shader);
+	if (ret)
+		goto err_tex;
+
 	glEnable(GL_BLEND);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
@@ -309,6 +379,8 @@ int gl_shader_new(struct gl_shader **out)
 	*out = shader;
 	return 0;
 
+err_tex:
+	free_tex_shader(shader);
 err_def:
 	free_def_shader(shader);
 err_free:
@@ -330,6 +402,7 @@ void gl_shader_unref(struct gl_shader *shader)
 		return;
 
 	log_debug("free shader object %p", shader);
+	free_mask_shader(shader);
 	free_tex_shader(shader);
 	free_def_shader(shader);
 	free(shader);
@@ -379,3 +452,28 @@ void gl_shader_draw_tex(struct gl_shader *shader, const float *vertices,
 	glEnableVertexAttribArray(1);
 	glDrawArrays(GL_TRIANGLES, 0, num);
 }
+
+void gl_shader_draw_mask(struct gl_shader *shader, const float *vertices,
+			const float *texcoords, size_t num,
+			unsigned int tex, const float *m, const float *color)
+{
+	float mat[16];
+
+	if (!shader || !vertices || !texcoords || !num || !m || !color)
+		return;
+
+	gl_m4_transpose_dest(mat, m);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, tex);
+
+	glUseProgram(shader->mask_program);
+	glUniformMatrix4fv(shader->mask_uni_projection, 1, GL_FALSE, mat);
+	glUniform1i(shader->mask_uni_texture, 0);
+	glUniform4fv(shader->mask_uni_color, 1, color);
+
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, vertices);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, texcoords);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glDrawArrays(GL_TRIANGLES, 0, num);
+}
@@ -37,6 +37,18 @@
  * sleep, all fd's are closed. When woken up, they are opened. There should be
  * not spurious events delivered. The initial state depends on the
  * kmscon_input's state.
+ *
+ * Key repeat is done in userspace. Kernel repeat events are dropped; instead,
+ * the last pressed key that produced an event arms a timer of the input
+ * object, so all devices of a seat share a single repeating key. The timer
+ * fires after --repeat-delay and then --repeat-rate times per second. If the
+ * loop was busy and several periods passed, we still send a single repeat:
+ * a late burst of repeats only makes held keys overshoot.
+ *
+ * Events are delivered per evdev frame. Key events run through the keyboard
+ * state as they are read, but the resulting input events are queued until the
+ * SYN_REPORT that ends the frame. Listeners can handle a chord or a burst of
+ * injected keys as a whole; the last event of a frame has ev->more unset.
  */
 
 #include <errno.h>
@@ -46,6 +58,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "conf.h"
 #include "eloop.h"
@@ -53,12 +66,16 @@
 #include "kbd.h"
 #include "log.h"
 #include "misc.h"
+#include "trace.h"
 
 #define LOG_SUBSYSTEM "input"
 
 /* How many longs are needed to hold \n bits. */
 #define NLONGS(n) (((n) + LONG_BIT - 1) / LONG_BIT)
 
+#define INPUT_READ_MAX 64
+#define INPUT_FRAME_MAX 32
+
 enum input_state {
 	INPUT_ASLEEP,
 	INPUT_AWAKE,
@@ -77,10 +94,14 @@ struct kmscon_input_device {
 	unsigned int features;
 
 	int rfd;
+	bool mono_time;
 	char *devnode;
 	struct ev_fd *fd;
 
 	struct kmscon_kbd *kbd;
+
+	struct kmscon_input_event frame[INPUT_FRAME_MAX];
+	unsigned int frame_num;
 };
 
 struct kmscon_input {
@@ -96,28 +117,127 @@ struct kmscon_input {
 	struct ev_fd *monitor_fd;
 
 	struct kmscon_kbd_desc *desc;
+
+	struct ev_timer *repeat_timer;
+	struct kmscon_input_device *repeat_dev;
+	uint16_t repeat_code;
 };
 
 static void remove_device(struct kmscon_input *input, const char *node);
 
+static void repeat_stop(struct kmscon_input *input)
+{
+	struct itimerspec spec;
+
+	if (!input->repeat_dev)
+		return;
+
+	memset(&spec, 0, sizeof(spec));
+	ev_eloop_update_timer(input->repeat_timer, &spec);
+	input->repeat_dev = NULL;
+}
+
+static void repeat_start(struct kmscon_input_device *device, uint16_t code)
+{
+	struct kmscon_input *input = device->input;
+	struct itimerspec spec;
+	unsigned int delay = conf_global.repeat_delay;
+	unsigned int rate = conf_global.repeat_rate;
+
+	if (!input->repeat_timer || !rate)
+		return;
+
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = delay / 1000;
+	spec.it_value.tv_nsec = (delay % 1000) * 1000000;
+	/* conf.c limits \rate to 1000 Hz, so the interval is never zero */
+	spec.it_interval.tv_sec = 1 / rate;
+	spec.it_interval.tv_nsec = (1000000000ULL / rate) % 1000000000;
+	if (!spec.it_value.tv_sec && !spec.it_value.tv_nsec)
+		spec.it_value = spec.it_interval;
+
+	if (ev_eloop_update_timer(input->repeat_timer, &spec))
+		return;
+
+	input->repeat_dev = device;
+	input->repeat_code = code;
+}
+
+/* \num periods passed but we deliver only one repeat, see above */
+static void repeat_fire(struct ev_timer *timer, uint64_t num, void *data)
+{
+	struct kmscon_input *input = data;
+	struct kmscon_input_device *device = input->repeat_dev;
+	struct kmscon_input_event ev;
+	struct timespec ts;
+	int ret;
+
+	if (!device)
+		return;
+
+	ret = kmscon_kbd_process_key(device->kbd, KMSCON_KEY_REPEATED,
+					input->repeat_code, &ev);
+	if (ret) {
+		repeat_stop(input);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ev.time = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+	ev.more = false;
+	kmscon_hook_call(input->hook, input, &ev);
+}
+
+/* delivers the queued events; \end is set if the frame is complete */
+static void flush_frame(struct kmscon_input_device *device, bool end)
+{
+	struct kmscon_input *input = device->input;
+	unsigned int i, num = device->frame_num;
+
+	device->frame_num = 0;
+	for (i = 0; i < num; ++i) {
+		device->frame[i].more = !end || i + 1 < num;
+		kmscon_hook_call(input->hook, input, &device->frame[i]);
+	}
+}
+
 static void notify_key(struct kmscon_input_device *device,
-				uint16_t type, uint16_t code, int32_t value)
+				const struct input_event *kev)
 {
 	int ret;
 	struct kmscon_input_event ev;
 	struct kmscon_input *input;
 
-	if (type != EV_KEY)
+	if (kev->type != EV_KEY || kev->value == KMSCON_KEY_REPEATED)
 		return;
 
+	kmscon_trace_point(KMSCON_TRACE_KEY, kev->code, kev->value);
+
 	input = device->input;
-	ret = kmscon_kbd_process_key(device->kbd, value, code, &ev);
+	ret = kmscon_kbd_process_key(device->kbd, kev->value, kev->code, &ev);
+
+	if (kev->value == KMSCON_KEY_RELEASED) {
+		if (input->repeat_dev == device &&
+		    input->repeat_code == kev->code)
+			repeat_stop(input);
+	} else if (!ret) {
+		repeat_start(device, kev->code);
+	}
 
 	if (ret && ret != -ENOKEY)
 		return;
 
-	if (ret != -ENOKEY)
-		kmscon_hook_call(input->hook, input, &ev);
+	if (device->mono_time)
+		ev.time = kev->time.tv_sec * 1000000ULL + kev->time.tv_usec;
+	else
+		ev.time = 0;
+
+	if (ret == -ENOKEY)
+		return;
+
+	if (device->frame_num == INPUT_FRAME_MAX)
+		flush_frame(device, false);
+	device->frame[device->frame_num++] = ev;
 }
 
 static void device_data_arrived(struct ev_fd *fd, int mask, void *data)
@@ -126,7 +246,7 @@ static void device_data_arrived(struct ev_fd *fd, int mask, void *data)
 	ssize_t len, n;
 	struct kmscon_input_device *device = data;
 	struct kmscon_input *input = device->input;
-	struct input_event ev[16];
+	struct input_event ev[INPUT_READ_MAX];
 
 	len = sizeof(ev);
 	while (len == sizeof(ev)) {
@@ -145,16 +265,20 @@ static void device_data_arrived(struct ev_fd *fd, int mask, void *data)
 			log_warn("read invalid input_event");
 		} else {
 			n = len / sizeof(*ev);
-			for (i = 0; i < n; i++)
-				notify_key(device, ev[i].type, ev[i].code,
-								ev[i].value);
+			for (i = 0; i < n; i++) {
+				if (ev[i].type == EV_SYN &&
+				    ev[i].code == SYN_REPORT)
+					flush_frame(device, true);
+				else
+					notify_key(device, &ev[i]);
+			}
 		}
 	}
 }
 
 int kmscon_input_device_wake_up(struct kmscon_input_device *device)
 {
-	int ret;
+	int ret, clk;
 	unsigned long ledbits[NLONGS(LED_CNT)] = { 0 };
 
 	if (!device || !device->input || !device->input->eloop)
@@ -171,6 +295,10 @@ int kmscon_input_device_wake_up(struct kmscon_input_device *device)
 	}
 
 	if (device->features & FEATURE_HAS_KEYS) {
+		/* event timestamps are compared to our own monotonic clock */
+		clk = CLOCK_MONOTONIC;
+		device->mono_time = !ioctl(device->rfd, EVIOCSCLOCKID, &clk);
+
 		if (device->features & FEATURE_HAS_LEDS) {
 			errno = 0;
 			ioctl(device->rfd, EVIOCGLED(sizeof(ledbits)),
@@ -204,6 +332,10 @@ void kmscon_input_device_sleep(struct kmscon_input_device *device)
 	if (device->rfd < 0)
 		return;
 
+	if (device->input->repeat_dev == device)
+		repeat_stop(device->input);
+	device->frame_num = 0;
+
 	ev_eloop_rm_fd(device->fd);
 	device->fd = NULL;
 	close(device->rfd);
@@ -582,6 +714,7 @@ int kmscon_input_connect_eloop(struct kmscon_input *input,
 {
 	int ret;
 	int fd;
+	struct itimerspec spec;
 
 	if (!input || !eloop)
 		return -EINVAL;
@@ -595,6 +728,15 @@ int kmscon_input_connect_eloop(struct kmscon_input *input,
 	if (ret)
 		return ret;
 
+	memset(&spec, 0, sizeof(spec));
+	ret = ev_eloop_new_timer(eloop, &input->repeat_timer, &spec,
+					repeat_fire, input);
+	if (ret) {
+		ev_eloop_rm_fd(input->monitor_fd);
+		input->monitor_fd = NULL;
+		return ret;
+	}
+
 	ev_eloop_ref(eloop);
 	input->eloop = eloop;
 
@@ -616,6 +758,8 @@ void kmscon_input_disconnect_eloop(struct kmscon_input *input)
 		kmscon_input_device_free(tmp);
 	}
 
+	ev_eloop_rm_timer(input->repeat_timer);
+	input->repeat_timer = NULL;
 	ev_eloop_rm_fd(input->monitor_fd);
 	input->monitor_fd = NULL;
 	ev_eloop_unref(input->eloop);
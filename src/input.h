@@ -73,6 +73,8 @@ struct kmscon_input_event {
 	uint32_t keysym;   /* X keysym - XK_* - X11/keysym.h */
 	unsigned int mods; /* active modifiers - kmscon_modifier mask */
 	uint32_t unicode;  /* UCS-4 unicode value or KMSCON_INPUT_INVALID */
+	uint64_t time;     /* kernel timestamp in usecs on CLOCK_MONOTONIC or 0 */
+	bool more;         /* more events of the same evdev frame follow */
 };
 
 typedef void (*kmscon_input_cb) (struct kmscon_input *input,
@@ -0,0 +1,1558 @@
+/*
+ * kmscon - XKB Key Maps
+ *
+ * Copyright (c) 2011 Ran Benita <ran234@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * XKB Key Maps
+ * This module has no dependency on the configuration or on the input layer of
+ * kmscon or uterm. Both keyboard backends, kbd_xkb.c and uterm_input_xkb.c,
+ * wrap it and pass the key map cache directory in.
+ *
+ * This mostly involves things the X server does normally and libxkbcommon
+ * doesn't provide us for free.
+ * This implements a minimal subset of XKB, mostly ignoring stuff like:
+ * - The protocol itself - we don't allow changing/querying and do everything
+ *   at init.
+ * - Everything to do with pointing devices, buttons..
+ * - Indicators
+ * - Controls
+ * - Bells
+ * - Dead keys
+ * - All actions beside group- and modifier-related.
+ * - Behaviours
+ * - Geometries
+ * - And various tweaks to what we do support.
+ *
+ * Some references to understand what's going on:
+ *
+ * [Lib] The X Keyboard Extension: Library Specification
+ *	http://www.x.org/releases/current/doc/libX11/specs/XKB/xkblib.html
+ * [Proto] The X Keyboard Extension: Protocol Specification
+ *	http://www.x.org/releases/current/doc/kbproto/xkbproto.html
+ * [xserver] The X server source code dealing with xkb
+ *	<xserver source root>/xkb/
+ * [xlib] The Xlib source code dealing with xkb and input methods
+ *	<libX11 source root>/xkb/
+ *	<libX11 source root>/modules/im/ximcp/
+ * [Pascal] Some XKB documentation by its maintainer (not the best english)
+ *	http://pascal.tsu.ru/en/xkb/
+ * [Headers] Some XKB-related headers
+ *	/usr/include/X11/extensions/XKBcommon.h
+ *	/usr/include/X11/extensions/XKB.h
+ *	/usr/include/X11/keysymdef.h
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <xkbcommon/xkbcommon.h>
+
+#include "imKStoUCS.h"
+#include "keymap.h"
+#include "log.h"
+
+#define LOG_SUBSYSTEM "keymap"
+
+/*
+ * Key Maps
+ * Resolving a key through the xkb_desc takes a group wrap, a scan of the map
+ * entries of the key type and a table search to convert the keysym to
+ * Unicode. We do all of this once when loading the description and compile it
+ * into a key map: every key type gets a level map which maps all modifier
+ * combinations to a shift level, and every key gets a flat [group][level]
+ * array of its entries. A key event then costs a few loads.
+ * The key map is a single position-independent blob which contains everything
+ * needed to process keys, so the xkb_desc is freed right after compiling it.
+ * See "Key Map Files" below for how it is cached.
+ *
+ * Layout:
+ *   struct kbd_map
+ *   struct kbd_level_map[num_types]
+ *   struct kbd_key[num_keys]
+ *   struct kbd_entry[num_entries]
+ * Each array starts KBD_ALIGN aligned.
+ */
+
+#define KBD_MAGIC "KMSCONKM"
+#define KBD_VERSION 1
+#define KBD_BYTE_ORDER 0x01020304
+#define KBD_KEY_LEN 256
+#define KBD_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+/* keep in sync with led_names in kmscon_keymap_reset() */
+#define KBD_LED_NUM 4
+
+struct kbd_map {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	char key[KBD_KEY_LEN];
+	uint32_t action_size;
+	uint32_t min_key_code;
+	uint32_t max_key_code;
+	uint32_t num_types;
+	uint32_t num_keys;
+	uint32_t num_entries;
+	uint8_t num_groups;
+	uint8_t groups_wrap;
+	uint8_t led_mods[KBD_LED_NUM];	/* locked mods shown by each LED */
+	uint8_t reserved[2];
+	uint64_t size;
+};
+
+struct kbd_level_map {
+	uint8_t level[256];
+};
+
+struct kbd_key {
+	uint32_t entries;		/* index of the first entry */
+	uint16_t types[XkbNumKbdGroups];
+	uint8_t num_groups;		/* 0 for inactive keys */
+	uint8_t group_info;
+	uint8_t width;
+	uint8_t modmap;
+	uint8_t repeat;
+	uint8_t reserved[3];
+};
+
+struct kbd_entry {
+	uint32_t keysym;
+	uint32_t ucs4;
+	union xkb_action action;
+};
+
+struct kmscon_keymap {
+	unsigned long ref;
+	struct kmscon_keymap *next;
+	char *layout;
+	char *variant;
+	char *options;
+
+	struct kbd_map *map;
+	bool mapped;			/* map is a file mapping */
+	struct kbd_level_map *level_maps;
+	struct kbd_key *keys;
+	struct kbd_entry *entries;
+};
+
+struct kmscon_keymap_state {
+	unsigned long ref;
+	struct kmscon_keymap *keymap;
+
+	struct xkb_state state;
+};
+
+int kmscon_keymap_state_new(struct kmscon_keymap_state **out,
+				struct kmscon_keymap *keymap)
+{
+	struct kmscon_keymap_state *kbd;
+
+	kbd = malloc(sizeof(*kbd));
+	if (!kbd)
+		return -ENOMEM;
+
+	memset(kbd, 0, sizeof(*kbd));
+	kbd->ref = 1;
+
+	kbd->keymap = keymap;
+	kmscon_keymap_ref(keymap);
+
+	*out = kbd;
+	return 0;
+}
+
+void kmscon_keymap_state_ref(struct kmscon_keymap_state *kbd)
+{
+	if (!kbd)
+		return;
+
+	++kbd->ref;
+}
+
+void kmscon_keymap_state_unref(struct kmscon_keymap_state *kbd)
+{
+	if (!kbd || !kbd->ref)
+		return;
+
+	if (--kbd->ref)
+		return;
+
+	kmscon_keymap_unref(kbd->keymap);
+	free(kbd);
+}
+
+static inline bool keymap_bit_is_set(const unsigned long *array, int bit)
+{
+	return !!(array[bit / LONG_BIT] & (1LL << (bit % LONG_BIT)));
+}
+
+static uint8_t virtual_to_real_mods(struct xkb_desc *desc, uint16_t vmods)
+{
+	int i;
+	uint32_t bit;
+	uint8_t mods;
+
+	mods = 0x00;
+
+	for (i=0, bit=0x01; i < XkbNumVirtualMods; i++, bit<<=1)
+		if (vmods & bit)
+			mods |= desc->server->vmods[i];
+
+	return mods;
+}
+
+static uint8_t virtual_and_real_to_mask(struct xkb_desc *desc,
+					uint16_t vmods, uint8_t real_mods)
+{
+	uint8_t mods = 0x00;
+
+	mods |= real_mods;
+	mods |= virtual_to_real_mods(desc, vmods);
+
+	return mods;
+}
+
+/*
+ * Helper function for the wrap_group_* functions.
+ * See [Lib] 11.7.1 for the rules.
+ */
+static uint8_t wrap_group(int16_t group, int num_groups, uint8_t group_info)
+{
+	/* No need for wrapping. */
+	if (XkbIsLegalGroup(group) && group < num_groups)
+		return group;
+
+	switch (XkbOutOfRangeGroupAction(group_info)) {
+	case XkbWrapIntoRange:
+		/*
+		 * C99 says a negative dividend in a modulo operation
+		 * will always give a negative result.
+		 */
+		if (group < 0)
+			return num_groups + (group % num_groups);
+		else
+			return group % num_groups;
+
+	case XkbClampIntoRange:
+		/* This one seems to be unused. */
+		return num_groups - 1;
+
+	case XkbRedirectIntoRange:
+		/* This one seems to be unused. */
+		group = XkbOutOfRangeGroupNumber(group_info);
+		/* If it's _still_ out of range, use the first group. */
+		if (group >= num_groups)
+			return 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Wrap an arbitrary group into a legal effective global group according to
+ * the GroupsWrap control.
+ * (Group actions mostly act on the group number in a relative manner [e.g.
+ * +1, -1]. So if we have N groups, the effective group is N-1, and we get a
+ * SetGroup +1, this tells us what to do.)
+ */
+static uint8_t wrap_group_control(struct kbd_map *map, int16_t group)
+{
+	return wrap_group(group, map->num_groups, map->groups_wrap);
+}
+
+/*
+ * Need to update the effective mods after any changes to the base, latched or
+ * locked mods.
+ */
+static void update_effective_mods(struct kbd_map *map,
+						struct xkb_state *state)
+{
+	state->mods = state->base_mods | state->latched_mods |
+							state->locked_mods;
+}
+
+/*
+ * Need to update the effective group after any changes to the base, latched or
+ * locked group.
+ */
+static void update_effective_group(struct kbd_map *map,
+						struct xkb_state *state)
+{
+	int16_t group;
+
+	/* Update the effective group. */
+	group = state->base_group + state->locked_group + state->latched_group;
+	state->group = wrap_group_control(map, group);
+}
+
+/*
+ * Updates the group state.
+ * See [Lib] Table 17.4 for logic.
+ */
+static bool process_group_action(struct kbd_map *map, struct xkb_state *state,
+					enum kmscon_keymap_key_state key_state,
+					struct xkb_group_action *action)
+{
+	int16_t group = action->group;
+	uint8_t flags = action->flags;
+
+	/*
+	 * action->group is signed and may be negative if GroupAbsolute
+	 * is not set. A group itself cannot be negative and is unsigend.
+	 * Therefore we extend these to int16 to avoid underflow and
+	 * signedness issues. Be careful!
+	 */
+	int16_t base_group = state->base_group;
+	int16_t latched_group = state->latched_group;
+	int16_t locked_group = state->locked_group;
+
+	/*
+	 * FIXME: Some actions here should be conditioned "and no keys are
+	 * physically depressed when this key is released".
+	 */
+
+	switch (action->type) {
+	case XkbSA_SetGroup:
+		if (key_state == KMSCON_KEYMAP_PRESSED) {
+			if (flags & XkbSA_GroupAbsolute)
+				base_group = group;
+			else
+				base_group += group;
+		} else if (key_state == KMSCON_KEYMAP_RELEASED) {
+			if (flags & XkbSA_ClearLocks)
+				locked_group = 0;
+		}
+
+		break;
+	case XkbSA_LatchGroup:
+		if (key_state == KMSCON_KEYMAP_PRESSED) {
+			if (flags & XkbSA_GroupAbsolute)
+				base_group = group;
+			else
+				base_group += group;
+		} else if (key_state == KMSCON_KEYMAP_RELEASED) {
+			if ((flags & XkbSA_LatchToLock) && latched_group) {
+				locked_group += group;
+				latched_group -= group;
+			} else {
+				latched_group += group;
+			}
+		}
+
+		break;
+	case XkbSA_LockGroup:
+		if (key_state == KMSCON_KEYMAP_PRESSED) {
+			if (flags & XkbSA_GroupAbsolute)
+				locked_group = group;
+			else
+				locked_group += group;
+		}
+
+		break;
+	}
+
+	/* Bring what was changed back into range. */
+	state->base_group = wrap_group_control(map, base_group);
+	state->locked_group = wrap_group_control(map, locked_group);
+	state->latched_group = wrap_group_control(map, latched_group);
+	update_effective_group(map, state);
+	return true;
+}
+
+/*
+ * Updates the modifiers state.
+ * See [Lib] Table 17.1 for logic.
+ * */
+static bool process_mod_action(struct kbd_map *map, struct kbd_key *key,
+			struct xkb_state *state, enum kmscon_keymap_key_state key_state,
+						struct xkb_mod_action *action)
+{
+	uint8_t mods;
+	uint8_t saved_mods;
+	uint8_t flags = action->flags;
+
+	if (flags & XkbSA_UseModMapMods)
+		mods = key->modmap;
+	else
+		mods = action->mask;
+
+	/*
+	 * FIXME: Some actions here should be conditioned "and no keys are
+	 * physically depressed when this key is released".
+	 */
+
+	switch (action->type) {
+	case XkbSA_SetMods:
+		if (key_state == KMSCON_KEYMAP_PRESSED) {
+			state->base_mods |= mods;
+		} else if (key_state == KMSCON_KEYMAP_RELEASED) {
+			state->base_mods &= ~mods;
+			if (flags & XkbSA_ClearLocks)
+				state->locked_mods &= ~mods;
+		}
+
+		break;
+	case XkbSA_LatchMods:
+		if (key_state == KMSCON_KEYMAP_PRESSED) {
+			state->base_mods |= mods;
+		} else if (key_state == KMSCON_KEYMAP_RELEASED) {
+			if (flags & XkbSA_ClearLocks) {
+				saved_mods = state->locked_mods;
+				state->locked_mods &= ~mods;
+				mods &= ~(mods & saved_mods);
+			}
+			if (flags & XkbSA_LatchToLock) {
+				saved_mods = mods;
+				mods = (mods & state->latched_mods);
+				state->locked_mods |= mods;
+				state->latched_mods &= ~mods;
+				mods = saved_mods & (~mods);
+			}
+			state->latched_mods |= mods;
+		}
+
+		break;
+	case XkbSA_LockMods:
+		/* We fake a little here and toggle both on and off on keypress. */
+		if (key_state == KMSCON_KEYMAP_PRESSED) {
+			state->base_mods |= mods;
+			state->locked_mods ^= mods;
+		} else if (key_state == KMSCON_KEYMAP_RELEASED) {
+			state->base_mods &= ~mods;
+		}
+
+		break;
+	}
+
+	update_effective_mods(map, state);
+	return true;
+}
+
+/*
+ * An action dispatcher. The return value indicates whether the keyboard state
+ * was changed.
+ */
+static bool process_action(struct kbd_map *map, struct kbd_key *key,
+			struct xkb_state *state, enum kmscon_keymap_key_state key_state,
+						union xkb_action *action)
+{
+	switch (action->type) {
+	case XkbSA_NoAction:
+		break;
+	case XkbSA_SetMods:
+	case XkbSA_LatchMods:
+	case XkbSA_LockMods:
+		return process_mod_action(map, key, state, key_state,
+							&action->mods);
+		break;
+	case XkbSA_SetGroup:
+	case XkbSA_LatchGroup:
+	case XkbSA_LockGroup:
+		return process_group_action(map, state, key_state,
+							&action->group);
+		break;
+	default:
+		/*
+		 * Don't handle other actions.
+		 * Note: There may be useful stuff here, like TerminateServer
+		 * or SwitchScreen.
+		 */
+		break;
+	}
+
+	return false;
+}
+
+/*
+ * The shift level to use for the keycode (together with the group) is
+ * determined by the modifier state. There are various "types" of ways to use
+ * the modifiers to shift the keycode; this is determined by the key_type
+ * object mapped to the (keycode, group) pair.
+ */
+static uint16_t find_shift_level(struct xkb_key_type *type, uint8_t mods)
+{
+	int i;
+	struct xkb_kt_map_entry *entry;
+	uint8_t masked_mods;
+
+	masked_mods = type->mods.mask & mods;
+
+	for (i=0; i < type->map_count; i++) {
+		entry = &type->map[i];
+
+		if (!entry->active)
+			continue;
+
+		/*
+		 * Must match exactly after we masked it with the key_type's
+		 * mask.
+		 */
+		if (entry->mods.mask == masked_mods)
+			return entry->level;
+	}
+
+	/* The default is LevelOne. */
+	return 0;
+}
+
+/* Whether to send out a repeat event for the key. */
+static bool should_key_repeat(struct xkb_desc *desc, xkb_keycode_t keycode)
+{
+	unsigned const char *pkr;
+
+	/* Repeats globally disabled. */
+	if (!(desc->ctrls->enabled_ctrls & XkbRepeatKeysMask))
+		return false;
+
+	/* Repeats disabled for the specific key. */
+	pkr = desc->ctrls->per_key_repeat;
+	if (!(pkr[keycode / 8] & (0x01 << (keycode % 8))))
+		return false;
+
+	/* Don't repeat modifiers. */
+	if (desc->map->modmap[keycode] != 0)
+		return false;
+
+	return true;
+}
+
+int kmscon_keymap_process_key(struct kmscon_keymap_state *kbd,
+					enum kmscon_keymap_key_state key_state,
+					uint16_t code,
+					struct kmscon_keymap_event *out)
+{
+	struct kbd_map *map;
+	struct xkb_state *state;
+	uint8_t group, level;
+	struct kbd_key *key;
+	struct kbd_entry *entry;
+	bool state_changed, event_filled;
+
+	if (!kbd)
+		return -EINVAL;
+
+	map = kbd->keymap->map;
+	state = &kbd->state;
+
+	/* Valid keycode. */
+	if (code >= map->num_keys)
+		return -ENOKEY;
+	key = &kbd->keymap->keys[code];
+	/* Active keycode. */
+	if (!key->num_groups)
+		return -ENOKEY;
+	/* Unwanted repeat. */
+	if (key_state == KMSCON_KEYMAP_REPEATED && !key->repeat)
+		return -ENOKEY;
+
+	/* Wrap the effective group to a legal group for the keycode. */
+	group = state->group;
+	if (group >= key->num_groups)
+		group = wrap_group(group, key->num_groups, key->group_info);
+	level = kbd->keymap->level_maps[key->types[group]].level[state->mods];
+	if (level >= key->width)
+		level = 0;
+	entry = &kbd->keymap->entries[key->entries + group * key->width + level];
+
+	state_changed = false;
+	if (key_state != KMSCON_KEYMAP_REPEATED)
+		state_changed = process_action(map, key, state, key_state,
+						&entry->action);
+
+	event_filled = false;
+	if (key_state != KMSCON_KEYMAP_RELEASED && !state_changed) {
+		out->keycode = code;
+		out->keysym = entry->keysym;
+		/* 1-to-1 match - this might change. */
+		out->mods = state->mods;
+		out->unicode = entry->ucs4;
+
+		event_filled = true;
+	}
+
+	if (state_changed) {
+		/* Release latches. */
+		state->latched_mods = 0;
+		update_effective_mods(map, state);
+		state->latched_group = 0;
+		update_effective_group(map, state);
+	}
+
+	return event_filled ? 0 : -ENOKEY;
+}
+
+static struct xkb_indicator_map *find_indicator_map(struct xkb_desc *desc,
+						const char *indicator_name)
+{
+	int i;
+
+	for (i=0; i < XkbNumIndicators; i++)
+		if (!strcmp(desc->names->indicators[i], indicator_name))
+			return &desc->indicators->maps[i];
+
+	return NULL;
+}
+
+/*
+ * Call this when we regain control of the keyboard after losing it.
+ * We don't reset the locked group, this should survive a VT switch, etc. The
+ * locked modifiers are reset according to the keyboard LEDs.
+ */
+void kmscon_keymap_reset(struct kmscon_keymap_state *kbd,
+				const unsigned long *ledbits)
+{
+	unsigned int i;
+	struct kbd_map *map;
+	struct xkb_state *state;
+	static const int leds[KBD_LED_NUM] = {
+		LED_NUML, LED_CAPSL, LED_SCROLLL, LED_COMPOSE,
+	};
+
+	if (!kbd)
+		return;
+
+	map = kbd->keymap->map;
+	state = &kbd->state;
+
+	state->group = 0;
+	state->base_group = 0;
+	state->latched_group = 0;
+
+	state->mods = 0;
+	state->base_mods = 0;
+	state->latched_mods = 0;
+	state->locked_mods = 0;
+
+	for (i = 0; i < KBD_LED_NUM; i++) {
+		if (keymap_bit_is_set(ledbits, leds[i]))
+			state->locked_mods |= map->led_mods[i];
+	}
+
+	update_effective_mods(map, state);
+	update_effective_group(map, state);
+}
+
+/*
+ * Key repeat is done in userspace by the repeat timer of the input layer,
+ * which feeds KMSCON_KEYMAP_REPEATED events back into
+ * kmscon_keymap_process_key(). The per-key repeat controls set up here decide
+ * which keys repeat; keys with repeat disabled (e.g. modifiers) drop these
+ * events, which also stops the timer.
+ */
+static void init_autorepeat(struct xkb_desc *desc)
+{
+	/*
+	 * This is taken from <xserver>/include/site.h
+	 * If a bit is off for a keycode, it should not repeat.
+	 */
+	static const char DEFAULT_AUTOREPEATS[XkbPerKeyBitArraySize] = {
+		0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+	memcpy(desc->ctrls->per_key_repeat,
+				DEFAULT_AUTOREPEATS, XkbPerKeyBitArraySize);
+
+	desc->ctrls->enabled_ctrls |= XkbRepeatKeysMask;
+}
+
+/*
+ * Update to the effective modifier mask of the indicator objects. We use them
+ * to dicover which modifiers to match with which leds.
+ */
+static void init_indicators(struct xkb_desc *desc)
+{
+	int i;
+	struct xkb_indicator_map *im;
+	struct xkb_mods *mods;
+
+	for (i=0; i < XkbNumIndicators; i++) {
+		im = &desc->indicators->maps[i];
+		mods = &im->mods;
+
+		mods->mask = virtual_and_real_to_mask(desc, mods->vmods,
+								mods->real_mods);
+	}
+}
+
+static void init_action(struct xkb_desc *desc, union xkb_action *action)
+{
+	struct xkb_mod_action *mod_act;
+
+	switch (action->type) {
+	case XkbSA_SetMods:
+	case XkbSA_LatchMods:
+	case XkbSA_LockMods:
+		mod_act = &action->mods;
+
+		mod_act->mask = virtual_and_real_to_mask(desc, mod_act->vmods,
+							mod_act->real_mods);
+		break;
+	}
+}
+
+/*
+ * Update the effective modifer mask of the various action objects after we
+ * initialized the virtual modifiers from compat. The only actions we change
+ * here are the mod_action types.
+ */
+static void init_actions(struct xkb_desc *desc)
+{
+	int i;
+	union xkb_action *action;
+	struct xkb_sym_interpret *si;
+
+	for (i=0; i < desc->server->num_acts; i++) {
+		action = &desc->server->acts[i];
+		init_action(desc, action);
+	}
+
+	for (i=0; i < desc->compat->num_si; i++) {
+		si = &desc->compat->sym_interpret[i];
+		action = (union xkb_action *)&si->act;
+		init_action(desc, action);
+	}
+}
+
+/*
+ * After we figured out the virtual mods from the compat component, we update
+ * the effective modifiers in the key_types component accordingly, because we
+ * use it extensively to find the correct shift level.
+ */
+static void init_key_types(struct xkb_desc *desc)
+{
+	int i, j;
+	struct xkb_key_type *type;
+	struct xkb_kt_map_entry *entry;
+	struct xkb_mods *mods;
+
+	for (i=0; i < desc->map->num_types; i++) {
+		type = &desc->map->types[i];
+		mods = &type->mods;
+
+		mods->mask = virtual_and_real_to_mask(desc, mods->vmods,
+							mods->real_mods);
+
+		for (j=0; j < type->map_count; j++) {
+			entry = &type->map[j];
+			mods = &entry->mods;
+
+			mods->mask = virtual_and_real_to_mask(desc,
+						mods->vmods, mods->real_mods);
+
+			/*
+			 * If the entry's vmods are bound to something, it
+			 * should be active.
+			 */
+			if (virtual_to_real_mods(desc, mods->vmods))
+				entry->active = true;
+		}
+	}
+}
+
+/*
+ * Check a sym interpret match condition.
+ * See [Lib] Table 18.1 for the logic.
+ */
+static bool are_modifiers_matching(uint8_t mods, unsigned char match,
+							uint8_t to_mods)
+{
+	switch (match & XkbSI_OpMask) {
+	case XkbSI_NoneOf:
+		return (mods & to_mods) == 0;
+	case XkbSI_AnyOfOrNone:
+		return true;
+	case XkbSI_AnyOf:
+		return (mods & to_mods) != 0;
+	case XkbSI_AllOf:
+		return (mods & to_mods) == mods;
+	case XkbSI_Exactly:
+		return mods == to_mods;
+	}
+
+	return false;
+}
+
+/*
+ * Look for the most specific symbol interpretation for the keysym.
+ * See [xserver] XKBMisc.c:_XkbFindMatchingInterp() for the equivalent.
+ */
+static struct xkb_sym_interpret *find_sym_interpret(struct xkb_desc *desc,
+			uint32_t sym, uint16_t level, uint8_t key_modmap)
+{
+	int i;
+	struct xkb_sym_interpret *si;
+	struct xkb_sym_interpret *all_syms_si;
+
+	all_syms_si = NULL;
+
+	/*
+	 * If we find a matching interpret specific to our symbol, we return
+	 * it immediatly.
+	 * If we didn't find any, we return the first matching all-catching
+	 * interpret.
+	 */
+
+	for (i=0; i < desc->compat->num_si; i++) {
+		si = &desc->compat->sym_interpret[i];
+
+		if (si->sym != sym && si->sym != 0)
+			continue;
+
+		/*
+		 * If the interpret specified UseModMapMods=level1, the sym
+		 * must be in the first level of its group.
+		 * Note: [xserver] and [Lib] do different things here, and it
+		 * doesn't seem to matter much. So it's commented for now.
+		 */
+		/* if (si->match&XkbSI_LevelOneOnly && level != 0) */
+		/* 	continue; */
+
+		if (!are_modifiers_matching(si->mods, si->match, key_modmap))
+			continue;
+
+		if (si->sym != 0)
+			return si;
+		else if (all_syms_si == NULL)
+			all_syms_si = si;
+	}
+
+	return all_syms_si;
+}
+
+/*
+ * Allocate slots for a keycode in the key-action mapping array. xkbcommon
+ * doesn't do this by itself for actions from compat (that is, almost all of
+ * them).
+ * See [xserver] XKBMAlloc.c:XkbResizeKeyActions() for the equivalent.
+ */
+static int allocate_key_acts(struct xkb_desc *desc, uint8_t keycode)
+{
+	struct xkb_server_map *server;
+	int sym_count;
+	unsigned short index, new_size_acts;
+	union xkb_action *acts;
+
+	server = desc->server;
+	sym_count = XkbKeyNumSyms(desc, keycode);
+
+	if (XkbKeyHasActions(desc, keycode))
+		return 0;
+
+	index = server->num_acts;
+
+	/* num_acts is the occupied slots, size_acts is the capacity. */
+	if (server->num_acts + sym_count > server->size_acts) {
+		/*
+		 * Don't have enough space, need to allocate. We add some
+		 * extra to avoid repeated reallocs.
+		 */
+		new_size_acts = server->num_acts + sym_count + 8;
+		acts = realloc(server->acts, new_size_acts * sizeof (*acts));
+		if (!acts)
+			return -ENOMEM;
+		server->acts = acts;
+		server->size_acts = new_size_acts;
+	}
+
+	/* XkbSA_NoAction is 0x00 so we're good. */
+	memset(&server->acts[index], 0, sym_count * sizeof(*server->acts));
+	server->key_acts[keycode] = index;
+	server->num_acts += sym_count;
+
+	return 0;
+}
+
+static int init_compat_for_keysym(struct xkb_desc *desc, xkb_keycode_t keycode,
+						uint8_t group, uint16_t level)
+{
+	int ret;
+	uint8_t key_modmap;
+	uint32_t sym;
+	struct xkb_sym_interpret *si;
+	union xkb_action *action;
+
+	key_modmap = desc->map->modmap[keycode];
+	sym = XkbKeySymEntry(desc, keycode, level, group);
+	si = find_sym_interpret(desc, sym, level, key_modmap);
+
+	if (!si)
+		return 0;
+
+	/* Set the key action mapping. */
+	if (si->act.type != XkbSA_NoAction) {
+		ret = allocate_key_acts(desc, keycode);
+		if (ret)
+			return ret;
+
+		action = XkbKeyActionEntry(desc, keycode, level, group);
+		*action = (union xkb_action)si->act;
+	}
+
+	/* Set the key virtual modifier mapping. */
+	if (si->virtual_mod != XkbNoModifier)
+		desc->server->vmodmap[keycode] |= 0x01 << si->virtual_mod;
+
+	return 0;
+}
+
+static int init_compat_for_keycode(struct xkb_desc *desc, xkb_keycode_t keycode)
+{
+	int ret;
+	int i, bit;
+
+	uint8_t group;
+	uint16_t level;
+	int num_groups;
+	int num_levels;
+
+	/*
+	 * It's possible that someone had set some actions for the keycode
+	 * through the symbols file, and so we shouldn't override with the
+	 * compat. This is very uncommon though, only used by the breaks_caps
+	 * option here.
+	 */
+	if (XkbKeyHasActions(desc, keycode))
+		return 0;
+
+	num_groups = XkbKeyNumGroups(desc, keycode);
+
+	/*
+	 * We need to track the sym level in order to support LevelOneOnly,
+	 * which is used in some symbol interpretations.
+	 */
+
+	for (group=0, i=0; group < num_groups; group++) {
+		num_levels = XkbKeyGroupWidth(desc, keycode, group);
+
+		for (level=0; level < num_levels; level++) {
+			ret = init_compat_for_keysym(desc, keycode,
+								group, level);
+			if (ret)
+				return ret;
+		}
+	}
+
+	/*
+	 * Translate the virtual modifiers bound to this key to the real
+	 * modifiers bound to this key.
+	 * See [Lib] 17.4 for vmodmap and friends.
+	 */
+	for (i=0, bit=0x01; i < XkbNumVirtualMods; i++, bit<<=1)
+		if (bit&desc->server->vmodmap[keycode])
+			desc->server->vmods[i] |= desc->map->modmap[keycode];
+
+	return 0;
+}
+
+/*
+ * This mostly fills out the keycode-action mapping and puts the virtual
+ * modifier mappings in the right place.
+ */
+static void init_compat(struct xkb_desc *desc)
+{
+	/* If we use KeyCode it overflows. */
+	unsigned int keycode;
+
+	for (keycode = desc->min_key_code; keycode <= desc->max_key_code; keycode++)
+		init_compat_for_keycode(desc, keycode);
+}
+
+/* returns the locked mods the LED \name shows or 0 */
+static uint8_t find_led_mods(struct xkb_desc *desc, const char *name)
+{
+	struct xkb_indicator_map *im;
+
+	im = find_indicator_map(desc, name);
+
+	/* Only locked modifiers really matter here. */
+	if (im && im->which_mods == XkbIM_UseLocked)
+		return im->mods.mask;
+
+	return 0;
+}
+
+/* attaches the arrays of the blob \map to \kdesc */
+static void map_attach(struct kmscon_keymap *kdesc, struct kbd_map *map)
+{
+	size_t off;
+
+	kdesc->map = map;
+
+	off = KBD_ALIGN(sizeof(*map));
+	kdesc->level_maps = (void*)((char*)map + off);
+	off += KBD_ALIGN(sizeof(*kdesc->level_maps) * map->num_types);
+	kdesc->keys = (void*)((char*)map + off);
+	off += KBD_ALIGN(sizeof(*kdesc->keys) * map->num_keys);
+	kdesc->entries = (void*)((char*)map + off);
+}
+
+static size_t map_size(uint32_t num_types, uint32_t num_keys,
+			uint32_t num_entries)
+{
+	return KBD_ALIGN(sizeof(struct kbd_map)) +
+		KBD_ALIGN(sizeof(struct kbd_level_map) * (size_t)num_types) +
+		KBD_ALIGN(sizeof(struct kbd_key) * (size_t)num_keys) +
+		KBD_ALIGN(sizeof(struct kbd_entry) * (size_t)num_entries);
+}
+
+/*
+ * Compiles the key map of \desc. This must run after all init_* functions as
+ * they modify the key types, actions and repeat controls. \key is NULL if the
+ * key map is not cached.
+ */
+static int map_build(struct kmscon_keymap *kdesc, struct xkb_desc *desc,
+			const char *key)
+{
+	struct kbd_map *map;
+	struct xkb_key_type *type;
+	struct kbd_key *k;
+	struct kbd_entry *entry;
+	unsigned int keycode, mods;
+	uint32_t num_keys, num_entries;
+	size_t size;
+	int i, group, level;
+	union xkb_action *action;
+
+	num_keys = desc->max_key_code - desc->min_key_code + 1;
+	num_entries = 0;
+	for (keycode = desc->min_key_code; keycode <= desc->max_key_code;
+								keycode++) {
+		if (XkbKeyNumSyms(desc, keycode))
+			num_entries += XkbKeyNumGroups(desc, keycode) *
+					XkbKeyGroupsWidth(desc, keycode);
+	}
+
+	size = map_size(desc->map->num_types, num_keys, num_entries);
+	map = malloc(size);
+	if (!map)
+		return -ENOMEM;
+	memset(map, 0, size);
+
+	memcpy(map->magic, KBD_MAGIC, sizeof(map->magic));
+	map->version = KBD_VERSION;
+	map->byte_order = KBD_BYTE_ORDER;
+	if (key)
+		memcpy(map->key, key, KBD_KEY_LEN);
+	map->action_size = sizeof(union xkb_action);
+	map->min_key_code = desc->min_key_code;
+	map->max_key_code = desc->max_key_code;
+	map->num_types = desc->map->num_types;
+	map->num_keys = num_keys;
+	map->num_entries = num_entries;
+	map->num_groups = desc->ctrls->num_groups;
+	map->groups_wrap = desc->ctrls->groups_wrap;
+	map->led_mods[0] = find_led_mods(desc, "Num Lock");
+	map->led_mods[1] = find_led_mods(desc, "Caps Lock");
+	map->led_mods[2] = find_led_mods(desc, "Scroll Lock");
+	map->led_mods[3] = find_led_mods(desc, "Compose");
+	map->size = size;
+	map_attach(kdesc, map);
+
+	for (i = 0; i < desc->map->num_types; i++) {
+		type = &desc->map->types[i];
+		for (mods = 0; mods < 256; mods++)
+			kdesc->level_maps[i].level[mods] =
+					find_shift_level(type, mods);
+	}
+
+	entry = kdesc->entries;
+	for (keycode = desc->min_key_code; keycode <= desc->max_key_code;
+								keycode++) {
+		if (!XkbKeyNumSyms(desc, keycode))
+			continue;
+
+		k = &kdesc->keys[keycode - desc->min_key_code];
+		k->entries = entry - kdesc->entries;
+		k->num_groups = XkbKeyNumGroups(desc, keycode);
+		k->group_info = XkbKeyGroupInfo(desc, keycode);
+		k->width = XkbKeyGroupsWidth(desc, keycode);
+		k->modmap = desc->map->modmap[keycode];
+		k->repeat = should_key_repeat(desc, keycode);
+
+		for (group = 0; group < k->num_groups; group++) {
+			type = XkbKeyType(desc, keycode, group);
+			k->types[group] = type - desc->map->types;
+
+			for (level = 0; level < k->width; level++) {
+				entry->keysym = XkbKeySymEntry(desc, keycode,
+								level, group);
+				entry->ucs4 = KeysymToUcs4(entry->keysym);
+				if (!entry->ucs4)
+					entry->ucs4 = KMSCON_KEYMAP_INVALID;
+				action = XkbKeyActionEntry(desc, keycode,
+								level, group);
+				if (action)
+					entry->action = *action;
+				entry++;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Key Map Files
+ * Compiling a keymap with xkbcommon is expensive, so compiled key maps are
+ * written to the cache directory passed to kmscon_keymap_new() and mapped on
+ * the next start. Files are named after a hash of the key. The key contains
+ * the RMLVO names, the XKB data root and a stamp of the data files. The key is
+ * stored in the file so collisions and stale files are detected. Names which
+ * do not fit into the key are not cached at all. Files from other machines or
+ * builds are rejected by the byte-order and action-size fields.
+ * Within a process, key maps with the same RMLVO names are shared and the
+ * data files are stamped only once, so hotplugging a keyboard neither walks
+ * the data root nor touches the disk cache. Data files changed while we run
+ * are picked up by the next process.
+ */
+
+#ifndef XKB_CONFIG_ROOT
+	#define XKB_CONFIG_ROOT "/usr/share/X11/xkb"
+#endif
+
+struct kbd_stamp {
+	long long mtime;
+	unsigned long files;
+};
+
+static struct kmscon_keymap *keymaps;
+static char *stamp_root;
+static struct kbd_stamp stamp;
+
+/*
+ * Collects the newest modification time and the number of files below a
+ * directory.
+ * Editing, adding or removing any file the compiler may include changes the
+ * stamp. Directory mtimes alone miss in-place edits.
+ */
+static void map_stamp(int dfd, const char *dir, unsigned int depth,
+			struct kbd_stamp *stamp)
+{
+	struct dirent *e;
+	struct stat st;
+	DIR *d;
+	int fd;
+
+	fd = openat(dfd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	d = fdopendir(fd);
+	if (!d) {
+		close(fd);
+		return;
+	}
+
+	while ((e = readdir(d))) {
+		if (e->d_name[0] == '.')
+			continue;
+		if (fstatat(fd, e->d_name, &st, 0))
+			continue;
+
+		if (st.st_mtime > stamp->mtime)
+			stamp->mtime = st.st_mtime;
+		if (S_ISDIR(st.st_mode)) {
+			if (depth)
+				map_stamp(fd, e->d_name, depth - 1, stamp);
+		} else {
+			++stamp->files;
+		}
+	}
+
+	closedir(d);
+}
+
+/* returns -E2BIG if the names do not fit into the key */
+static int map_key(char *key, const char *layout, const char *variant,
+			const char *options)
+{
+	static const char *dirs[] = {
+		"rules", "keycodes", "symbols", "types", "compat",
+	};
+	const char *root;
+	unsigned int i;
+	int len;
+
+	/* xkbcommon honours XKB_CONFIG_ROOT in the environment, so do we */
+	root = getenv("XKB_CONFIG_ROOT");
+	if (!root || !*root)
+		root = XKB_CONFIG_ROOT;
+
+	if (!stamp_root || strcmp(stamp_root, root)) {
+		free(stamp_root);
+		stamp_root = strdup(root);
+		if (!stamp_root)
+			return -ENOMEM;
+
+		memset(&stamp, 0, sizeof(stamp));
+		for (i = 0; i < sizeof(dirs) / sizeof(*dirs); ++i) {
+			char path[PATH_MAX];
+
+			snprintf(path, sizeof(path), "%s/%s", root, dirs[i]);
+			map_stamp(AT_FDCWD, path, 4, &stamp);
+		}
+	}
+
+	memset(key, 0, KBD_KEY_LEN);
+	len = snprintf(key, KBD_KEY_LEN, "%lld:%lu:%s:evdev:evdev:%s:%s:%s",
+			stamp.mtime, stamp.files, root,
+			layout ? : "", variant ? : "", options ? : "");
+	if (len < 0 || len >= KBD_KEY_LEN)
+		return -E2BIG;
+
+	return 0;
+}
+
+/* returns a newly allocated path or NULL on failure */
+static char *map_path(const char *dir, const char *key)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	char *path;
+	size_t i;
+
+	for (i = 0; key[i]; ++i) {
+		hash ^= (unsigned char)key[i];
+		hash *= 1099511628211ULL;
+	}
+
+	if (asprintf(&path, "%s/%016" PRIx64 ".keymap", dir, hash) < 0)
+		return NULL;
+
+	return path;
+}
+
+/* checks that all indices of the mapped key map are in range */
+static bool map_valid(struct kmscon_keymap *kdesc)
+{
+	struct kbd_map *map = kdesc->map;
+	struct kbd_key *k;
+	uint32_t i, g;
+
+	if (!map->num_groups || map->num_keys !=
+				map->max_key_code - map->min_key_code + 1)
+		return false;
+
+	for (i = 0; i < map->num_keys; ++i) {
+		k = &kdesc->keys[i];
+		if (!k->num_groups)
+			continue;
+		if (k->num_groups > XkbNumKbdGroups || !k->width)
+			return false;
+		if (k->entries > map->num_entries ||
+		    map->num_entries - k->entries <
+					(uint32_t)k->num_groups * k->width)
+			return false;
+		for (g = 0; g < k->num_groups; ++g) {
+			if (k->types[g] >= map->num_types)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static int map_load(struct kmscon_keymap *kdesc, const char *dir,
+			const char *key)
+{
+	struct kbd_map *map;
+	struct stat st;
+	char *path;
+	int fd, ret;
+
+	path = map_path(dir, key);
+	if (!path)
+		return -ENOMEM;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		goto out_path;
+	}
+
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*map)) {
+		ret = -EINVAL;
+		goto out_fd;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -errno;
+		goto out_fd;
+	}
+
+	if (memcmp(map->magic, KBD_MAGIC, sizeof(map->magic)) ||
+	    map->version != KBD_VERSION ||
+	    map->byte_order != KBD_BYTE_ORDER ||
+	    map->action_size != sizeof(union xkb_action) ||
+	    strncmp(map->key, key, KBD_KEY_LEN) ||
+	    map->size != (uint64_t)st.st_size ||
+	    map->size != map_size(map->num_types, map->num_keys,
+					map->num_entries)) {
+		log_info("ignoring stale key map %s", path);
+		munmap(map, st.st_size);
+		ret = -EINVAL;
+		goto out_fd;
+	}
+
+	map_attach(kdesc, map);
+	if (!map_valid(kdesc)) {
+		log_warn("ignoring corrupt key map %s", path);
+		munmap(map, st.st_size);
+		kdesc->map = NULL;
+		ret = -EINVAL;
+		goto out_fd;
+	}
+
+	kdesc->mapped = true;
+	ret = 0;
+
+out_fd:
+	close(fd);
+out_path:
+	free(path);
+	return ret;
+}
+
+/* writes the key map to a temporary file and renames it into place */
+static void map_save(struct kmscon_keymap *kdesc, const char *dir)
+{
+	const char *buf = (const char*)kdesc->map;
+	size_t len = kdesc->map->size;
+	char *path, *tmp;
+	ssize_t l;
+	int fd;
+
+	path = map_path(dir, kdesc->map->key);
+	if (!path)
+		return;
+
+	if (asprintf(&tmp, "%s.%d", path, (int)getpid()) < 0)
+		goto out_path;
+
+	mkdir(dir, 0755);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		goto err_tmp;
+
+	while (len) {
+		l = write(fd, buf, len);
+		if (l < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		buf += l;
+		len -= l;
+	}
+
+	close(fd);
+	if (len || rename(tmp, path)) {
+		unlink(tmp);
+		goto err_tmp;
+	}
+
+	log_debug("wrote key map %s", path);
+	free(tmp);
+	free(path);
+	return;
+
+err_tmp:
+	log_warn("cannot write key map %s", path);
+	free(tmp);
+out_path:
+	free(path);
+}
+
+/* \dir and \key are NULL if the key map is not cached */
+static int map_compile(struct kmscon_keymap *kdesc, const char *dir,
+			const char *key, const char *layout,
+			const char *variant, const char *options)
+{
+	struct xkb_desc *desc;
+	int ret;
+	struct xkb_rule_names rmlvo = {
+		.rules = "evdev",
+		.model = "evdev",
+		.layout = layout,
+		.variant = variant,
+		.options = options,
+	};
+
+	desc = xkb_compile_keymap_from_rules(&rmlvo);
+	if (!desc) {
+		log_err("cannot compile keymap from rules");
+		return -EFAULT;
+	}
+
+	/* The order of these is important! */
+	init_compat(desc);
+	init_key_types(desc);
+	init_actions(desc);
+	init_indicators(desc);
+	init_autorepeat(desc);
+
+	ret = map_build(kdesc, desc, key);
+	xkb_free_keymap(desc);
+	if (ret) {
+		log_err("cannot allocate key map");
+		return ret;
+	}
+
+	if (dir)
+		map_save(kdesc, dir);
+	return 0;
+}
+
+static bool names_equal(const char *a, const char *b)
+{
+	return !strcmp(a ? : "", b ? : "");
+}
+
+/*
+ * Create a ready-to-use key map. \cache_dir is the directory compiled key maps
+ * are cached in, or NULL to disable the cache.
+ */
+int kmscon_keymap_new(struct kmscon_keymap **out, const char *cache_dir,
+			const char *layout, const char *variant,
+			const char *options)
+{
+	struct kmscon_keymap *keymap;
+	char key[KBD_KEY_LEN];
+	int ret;
+
+	if (!out)
+		return -EINVAL;
+
+	for (keymap = keymaps; keymap; keymap = keymap->next) {
+		if (names_equal(keymap->layout, layout) &&
+		    names_equal(keymap->variant, variant) &&
+		    names_equal(keymap->options, options)) {
+			++keymap->ref;
+			*out = keymap;
+			return 0;
+		}
+	}
+
+	keymap = malloc(sizeof(*keymap));
+	if (!keymap)
+		return -ENOMEM;
+
+	memset(keymap, 0, sizeof(*keymap));
+	keymap->ref = 1;
+
+	keymap->layout = strdup(layout ? : "");
+	keymap->variant = strdup(variant ? : "");
+	keymap->options = strdup(options ? : "");
+	if (!keymap->layout || !keymap->variant || !keymap->options) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	if (cache_dir && *cache_dir) {
+		ret = map_key(key, layout, variant, options);
+		if (ret == -E2BIG)
+			log_debug("key map names too long, not caching");
+		if (ret)
+			cache_dir = NULL;
+	} else {
+		cache_dir = NULL;
+	}
+
+	ret = -ENOENT;
+	if (cache_dir)
+		ret = map_load(keymap, cache_dir, key);
+	if (ret) {
+		ret = map_compile(keymap, cache_dir, cache_dir ? key : NULL,
+					layout, variant, options);
+		if (ret)
+			goto err_free;
+	}
+
+	keymap->next = keymaps;
+	keymaps = keymap;
+
+	log_debug("new key map (%s, %s, %s)", layout, variant, options);
+	*out = keymap;
+	return 0;
+
+err_free:
+	free(keymap->options);
+	free(keymap->variant);
+	free(keymap->layout);
+	free(keymap);
+	return ret;
+}
+
+void kmscon_keymap_ref(struct kmscon_keymap *keymap)
+{
+	if (!keymap)
+		return;
+
+	++keymap->ref;
+}
+
+void kmscon_keymap_unref(struct kmscon_keymap *keymap)
+{
+	struct kmscon_keymap **iter;
+
+	if (!keymap || !keymap->ref)
+		return;
+
+	if (--keymap->ref)
+		return;
+
+	for (iter = &keymaps; *iter; iter = &(*iter)->next) {
+		if (*iter == keymap) {
+			*iter = keymap->next;
+			break;
+		}
+	}
+
+	log_debug("destroying key map");
+	if (keymap->mapped)
+		munmap(keymap->map, keymap->map->size);
+	else
+		free(keymap->map);
+	free(keymap->options);
+	free(keymap->variant);
+	free(keymap->layout);
+	free(keymap);
+}
+
+void kmscon_keymap_keysym_to_string(uint32_t keysym, char *str, size_t size)
+{
+	xkb_keysym_to_string(keysym, str, size);
+}
@@ -0,0 +1,92 @@
+/*
+ * kmscon - XKB Key Maps
+ *
+ * Copyright (c) 2011 Ran Benita <ran234@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * XKB Key Maps
+ * A key map is compiled from RMLVO names and holds the global keyboard
+ * information. A key map state holds the per-device state (e.g. active
+ * groups, modifiers). Key maps are shared within the process and optionally
+ * cached on disk.
+ * This does not depend on the configuration or input layer of kmscon or uterm
+ * so both keyboard backends can use it. The event and modifier values match
+ * the kmscon_input_event and uterm_input_event ones.
+ */
+
+#ifndef KMSCON_KEYMAP_H
+#define KMSCON_KEYMAP_H
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+struct kmscon_keymap;
+struct kmscon_keymap_state;
+
+/* values of the /value/ field of evdev key events */
+enum kmscon_keymap_key_state {
+	KMSCON_KEYMAP_RELEASED = 0,
+	KMSCON_KEYMAP_PRESSED = 1,
+	KMSCON_KEYMAP_REPEATED = 2,
+};
+
+#define KMSCON_KEYMAP_INVALID 0xffffffff
+
+struct kmscon_keymap_event {
+	uint16_t keycode;  /* linux keycode - KEY_* - linux/input.h */
+	uint32_t keysym;   /* X keysym - XK_* - X11/keysym.h */
+	unsigned int mods; /* active modifiers - real X modifier mask */
+	uint32_t unicode;  /* UCS-4 unicode value or KMSCON_KEYMAP_INVALID */
+};
+
+/*
+ * \cache_dir is the directory compiled key maps are cached in or NULL to
+ * disable the cache.
+ */
+int kmscon_keymap_new(struct kmscon_keymap **out, const char *cache_dir,
+			const char *layout, const char *variant,
+			const char *options);
+void kmscon_keymap_ref(struct kmscon_keymap *keymap);
+void kmscon_keymap_unref(struct kmscon_keymap *keymap);
+
+int kmscon_keymap_state_new(struct kmscon_keymap_state **out,
+				struct kmscon_keymap *keymap);
+void kmscon_keymap_state_ref(struct kmscon_keymap_state *kbd);
+void kmscon_keymap_state_unref(struct kmscon_keymap_state *kbd);
+
+/* resets the state and sets the locked modifiers from the keyboard LEDs */
+void kmscon_keymap_reset(struct kmscon_keymap_state *kbd,
+				const unsigned long *ledbits);
+
+/*
+ * Returns 0 if \out was filled out and -ENOKEY if the key press doesn't result
+ * in an input event (e.g. a key release).
+ */
+int kmscon_keymap_process_key(struct kmscon_keymap_state *kbd,
+				enum kmscon_keymap_key_state key_state,
+				uint16_t code,
+				struct kmscon_keymap_event *out);
+
+void kmscon_keymap_keysym_to_string(uint32_t keysym, char *str, size_t size);
+
+#endif /* KMSCON_KEYMAP_H */
@@ -0,0 +1,276 @@
+/*
+ * kmscon - Input Latency Tracing
+ *
+ * Copyright (c) 2012 David Herrmann <dh.herrmann@googlemail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Input Latency Tracing
+ * Open traces are kept in a small ring in the order their keys were written.
+ * Echoes are matched by order: the first read from the pty after a key was
+ * written is taken as its echo, so a single read completes the ECHO stage of
+ * all keys written before it. The same holds for the following stages, which
+ * keeps the ring sorted by stage and lets traces complete only at its tail.
+ * Keys that never produce output (modifiers in raw-mode applications,
+ * password prompts) are dropped after LAT_TIMEOUT.
+ *
+ * Completed traces are stored as per-stage deltas in a ring of the last
+ * LAT_SAMPLES traces. Percentiles are computed from this ring on request and
+ * logged every LAT_SAMPLES traces. The hot path costs a clock_gettime() per
+ * stage and nothing at all while no trace is open.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "latency.h"
+#include "log.h"
+
+#define LOG_SUBSYSTEM "latency"
+
+#define LAT_PENDING 64
+#define LAT_SAMPLES 1024
+#define LAT_TIMEOUT (1000 * 1000)
+
+struct lat_trace {
+	uint64_t time[KMSCON_LATENCY_STAGE_NUM];
+	unsigned int next;		/* next stage to stamp */
+};
+
+struct kmscon_latency {
+	struct lat_trace traces[LAT_PENDING];
+	unsigned int first;
+	unsigned int num;
+
+	/* [i][0] is the total latency, [i][s] the time spent in stage s */
+	uint32_t samples[LAT_SAMPLES][KMSCON_LATENCY_STAGE_NUM];
+	unsigned int sample_pos;
+	unsigned int sample_num;
+	unsigned long completed;
+	unsigned long dropped;
+};
+
+static const char *stage_names[] = {
+	[KMSCON_LATENCY_KEY] = "total",
+	[KMSCON_LATENCY_WRITE] = "input",
+	[KMSCON_LATENCY_ECHO] = "child",
+	[KMSCON_LATENCY_PARSE] = "parse",
+	[KMSCON_LATENCY_DRAW] = "draw",
+	[KMSCON_LATENCY_FLIP] = "flip",
+};
+
+static uint64_t lat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+int kmscon_latency_new(struct kmscon_latency **out)
+{
+	struct kmscon_latency *lat;
+
+	if (!out)
+		return -EINVAL;
+
+	lat = malloc(sizeof(*lat));
+	if (!lat)
+		return -ENOMEM;
+	memset(lat, 0, sizeof(*lat));
+
+	*out = lat;
+	return 0;
+}
+
+void kmscon_latency_free(struct kmscon_latency *lat)
+{
+	if (!lat)
+		return;
+
+	if (lat->completed)
+		kmscon_latency_report(lat);
+	free(lat);
+}
+
+static struct lat_trace *lat_get(struct kmscon_latency *lat, unsigned int i)
+{
+	return &lat->traces[(lat->first + i) % LAT_PENDING];
+}
+
+static void lat_drop_first(struct kmscon_latency *lat)
+{
+	lat->first = (lat->first + 1) % LAT_PENDING;
+	--lat->num;
+}
+
+static void lat_complete(struct kmscon_latency *lat, struct lat_trace *t)
+{
+	uint32_t *s;
+	unsigned int i;
+
+	s = lat->samples[lat->sample_pos];
+	s[0] = t->time[KMSCON_LATENCY_FLIP] - t->time[KMSCON_LATENCY_KEY];
+	for (i = 1; i < KMSCON_LATENCY_STAGE_NUM; ++i)
+		s[i] = t->time[i] - t->time[i - 1];
+
+	lat->sample_pos = (lat->sample_pos + 1) % LAT_SAMPLES;
+	if (lat->sample_num < LAT_SAMPLES)
+		++lat->sample_num;
+
+	if (!(++lat->completed % LAT_SAMPLES))
+		kmscon_latency_report(lat);
+}
+
+void kmscon_latency_write(struct kmscon_latency *lat, uint64_t key_time)
+{
+	struct lat_trace *t;
+	uint64_t now;
+
+	if (!lat)
+		return;
+
+	now = lat_now();
+
+	/* keys without echo never leave the ring on their own */
+	while (lat->num && (lat->num == LAT_PENDING ||
+		now - lat_get(lat, 0)->time[KMSCON_LATENCY_WRITE] >
+							LAT_TIMEOUT)) {
+		lat_drop_first(lat);
+		++lat->dropped;
+	}
+
+	t = lat_get(lat, lat->num++);
+	memset(t, 0, sizeof(*t));
+
+	/* fall back to the write time if the kernel time is not comparable */
+	if (!key_time || key_time > now || now - key_time > LAT_TIMEOUT)
+		key_time = now;
+
+	t->time[KMSCON_LATENCY_KEY] = key_time;
+	t->time[KMSCON_LATENCY_WRITE] = now;
+	t->next = KMSCON_LATENCY_ECHO;
+}
+
+void kmscon_latency_stamp(struct kmscon_latency *lat,
+				enum kmscon_latency_stage stage)
+{
+	struct lat_trace *t;
+	unsigned int i;
+	uint64_t now;
+
+	if (!lat || !lat->num || stage <= KMSCON_LATENCY_WRITE ||
+	    stage >= KMSCON_LATENCY_STAGE_NUM)
+		return;
+
+	now = 0;
+	for (i = 0; i < lat->num; ++i) {
+		t = lat_get(lat, i);
+		/* the ring is sorted by stage, newer traces are behind */
+		if (t->next < stage)
+			break;
+		if (t->next > stage)
+			continue;
+
+		if (!now)
+			now = lat_now();
+		t->time[stage] = now;
+		++t->next;
+	}
+
+	while (lat->num) {
+		t = lat_get(lat, 0);
+		if (t->next < KMSCON_LATENCY_STAGE_NUM)
+			break;
+
+		lat_complete(lat, t);
+		lat_drop_first(lat);
+	}
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+	return (x > y) - (x < y);
+}
+
+int kmscon_latency_get(struct kmscon_latency *lat,
+			enum kmscon_latency_stage stage,
+			struct kmscon_latency_stats *out)
+{
+	uint32_t *vals;
+	unsigned int i, num;
+
+	if (!lat || !out || stage >= KMSCON_LATENCY_STAGE_NUM)
+		return -EINVAL;
+
+	memset(out, 0, sizeof(*out));
+	num = lat->sample_num;
+	if (!num)
+		return 0;
+
+	vals = malloc(sizeof(*vals) * num);
+	if (!vals)
+		return -ENOMEM;
+
+	for (i = 0; i < num; ++i)
+		vals[i] = lat->samples[i][stage];
+	qsort(vals, num, sizeof(*vals), cmp_u32);
+
+	out->count = num;
+	out->p50 = vals[num * 50 / 100];
+	out->p90 = vals[num * 90 / 100];
+	out->p99 = vals[num * 99 / 100];
+	out->max = vals[num - 1];
+
+	free(vals);
+	return 0;
+}
+
+void kmscon_latency_report(struct kmscon_latency *lat)
+{
+	struct kmscon_latency_stats st;
+	unsigned int i;
+
+	if (!lat)
+		return;
+
+	/*
+	 * The report was requested with --latency, so it is neither compiled
+	 * out by LOG_MIN_SEVERITY nor rate-limited.
+	 */
+	log_printf(LOG_NOTICE, "%lu keys traced, %lu without echo",
+			lat->completed, lat->dropped);
+
+	for (i = 0; i < KMSCON_LATENCY_STAGE_NUM; ++i) {
+		if (kmscon_latency_get(lat, i, &st) || !st.count)
+			continue;
+
+		log_printf(LOG_NOTICE, "%-5s p50 %" PRIu64 "us p90 %" PRIu64
+				"us p99 %" PRIu64 "us max %" PRIu64 "us",
+				stage_names[i], st.p50, st.p90, st.p99,
+				st.max);
+	}
+}
@@ -0,0 +1,78 @@
+/*
+ * kmscon - Input Latency Tracing
+ *
+ * Copyright (c) 2012 David Herrmann <dh.herrmann@googlemail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Input Latency Tracing
+ * This measures the time from a key press until its echo is visible on screen.
+ * Every key that is written to the pty starts a trace which is stamped when it
+ * passes each stage of the pipeline. The terminal calls
+ * kmscon_latency_write() after writing a key to the pty and
+ * kmscon_latency_stamp() whenever a later stage is reached. Once a trace
+ * passes KMSCON_LATENCY_FLIP it is added to the statistics.
+ *
+ * All functions accept a NULL object and do nothing in that case, so callers
+ * do not need to check whether tracing is enabled.
+ */
+
+#ifndef KMSCON_LATENCY_H
+#define KMSCON_LATENCY_H
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+struct kmscon_latency;
+
+enum kmscon_latency_stage {
+	KMSCON_LATENCY_KEY,	/* kernel timestamp of the input event */
+	KMSCON_LATENCY_WRITE,	/* key written to the pty */
+	KMSCON_LATENCY_ECHO,	/* echo read from the pty */
+	KMSCON_LATENCY_PARSE,	/* echo parsed by the VTE */
+	KMSCON_LATENCY_DRAW,	/* frame containing the echo drawn */
+	KMSCON_LATENCY_FLIP,	/* page flip of that frame completed */
+	KMSCON_LATENCY_STAGE_NUM,
+};
+
+/* latencies in usecs of the most recent traces */
+struct kmscon_latency_stats {
+	unsigned int count;
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t max;
+};
+
+int kmscon_latency_new(struct kmscon_latency **out);
+void kmscon_latency_free(struct kmscon_latency *lat);
+
+void kmscon_latency_write(struct kmscon_latency *lat, uint64_t key_time);
+void kmscon_latency_stamp(struct kmscon_latency *lat,
+				enum kmscon_latency_stage stage);
+
+int kmscon_latency_get(struct kmscon_latency *lat,
+			enum kmscon_latency_stage stage,
+			struct kmscon_latency_stats *out);
+void kmscon_latency_report(struct kmscon_latency *lat);
+
+#endif /* KMSCON_LATENCY_H */
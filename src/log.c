@@ -9,6 +9,9 @@
  * We provide thread-safety so we need a global lock. Function which
  * are prefixed with log__* need the lock to be held. All other functions must
  * be called without the lock held.
+ * Messages are either written synchronously or, after log_set_async(), queued
+ * in per-thread rings and written by a background thread. See "Asynchronous
+ * Logging" below.
  */
 
 #include <errno.h>
@@ -48,6 +51,18 @@ static inline void log_unlock()
 
 static struct timeval log__ftime;
 
+/* converts the absolute time \t into the offset since application start */
+static void log__reltime(const struct timeval *t, long long *sec,
+				long long *usec)
+{
+	*sec = t->tv_sec - log__ftime.tv_sec;
+	*usec = (long long)t->tv_usec - (long long)log__ftime.tv_usec;
+	if (*usec < 0) {
+		*sec -= 1;
+		*usec = 1000000 + *usec;
+	}
+}
+
 static void log__time(long long *sec, long long *usec)
 {
 	struct timeval t;
@@ -58,12 +73,7 @@ static void log__time(long long *sec, long long *usec)
 		*usec = 0;
 	} else {
 		gettimeofday(&t, NULL);
-		*sec = t.tv_sec - log__ftime.tv_sec;
-		*usec = (long long)t.tv_usec - (long long)log__ftime.tv_usec;
-		if (*usec < 0) {
-			*sec -= 1;
-			*usec = 1000000 + *usec;
-		}
+		log__reltime(&t, sec, usec);
 	}
 }
 
@@ -149,11 +159,16 @@ static struct log_dynconf *log__dconfig = NULL;
 
 void log_set_config(const struct log_config *config)
 {
+	int i;
+
 	if (!config)
 		return;
 
+	/* asynchronous loggers read the global config without the lock */
 	log_lock();
-	log__gconfig = *config;
+	for (i = 0; i < LOG_SEV_NUM; ++i)
+		__atomic_store_n(&log__gconfig.sev[i], config->sev[i],
+						__ATOMIC_RELAXED);
 	log_unlock();
 }
 
@@ -178,7 +193,7 @@ int log_add_filter(const struct log_filter *filter,
 	if (log__dconfig)
 		dconf->handle = log__dconfig->handle + 1;
 	dconf->next = log__dconfig;
-	log__dconfig = dconf;
+	__atomic_store_n(&log__dconfig, dconf, __ATOMIC_RELEASE);
 	ret = dconf->handle;
 	log_unlock();
 
@@ -265,7 +280,8 @@ static bool log__omit(const char *file,
 			return false;
 	}
 
-	for (dconf = log__dconfig; dconf; dconf = dconf->next) {
+	dconf = __atomic_load_n(&log__dconfig, __ATOMIC_ACQUIRE);
+	for (; dconf; dconf = dconf->next) {
 		if (log__matches(&dconf->filter, file, line, func, subs)) {
 			val = dconf->config.sev[sev];
 			if (val == 0)
@@ -275,7 +291,7 @@ static bool log__omit(const char *file,
 		}
 	}
 
-	val = log__gconfig.sev[sev];
+	val = __atomic_load_n(&log__gconfig.sev[sev], __ATOMIC_RELAXED);
 	if (val == 0)
 		return true;
 	if (val == 1)
@@ -284,6 +300,27 @@ static bool log__omit(const char *file,
 	return false;
 }
 
+/* same as log__omit() but called without the lock held */
+static bool log_omit(const char *file,
+			int line,
+			const char *func,
+			const struct log_config *config,
+			const char *subs,
+			enum log_severity sev)
+{
+	bool omit;
+
+	/* dynamic filters are rare; only they need the lock */
+	if (!__atomic_load_n(&log__dconfig, __ATOMIC_ACQUIRE))
+		return log__omit(file, line, func, config, subs, sev);
+
+	log_lock();
+	omit = log__omit(file, line, func, config, subs, sev);
+	log_unlock();
+
+	return omit;
+}
+
 /*
  * Forward declaration so we can use the locked-versions in other functions
  * here. Be careful to avoid deadlocks, though.
@@ -322,6 +359,9 @@ static void log__format(const char *file,
 
 static FILE *log__file = NULL;
 
+/* serializes writes to the log-file; nests inside log__mutex */
+static pthread_mutex_t log__out_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 int log_set_file(const char *file)
 {
 	FILE *f, *old;
@@ -344,8 +384,10 @@ int log_set_file(const char *file)
 	if (log__file != f) {
 		log__format(LOG_DEFAULT, LOG_NOTICE,
 				"set log-file to %s", file);
+		pthread_mutex_lock(&log__out_mutex);
 		old = log__file;
 		log__file = f;
+		pthread_mutex_unlock(&log__out_mutex);
 		f = NULL;
 	}
 	log_unlock();
@@ -370,8 +412,13 @@ int log_set_file(const char *file)
  * The subsystem, if not NULL, is prepended as "SUBS: " to the message and a
  * newline is always appended by default. Multiline-messages are not allowed and
  * do not make sense here.
+ * Each message is assembled in a buffer of LOG_LINE_MAX bytes and written with
+ * a single fwrite() so the synchronous and the asynchronous logger share the
+ * output format and lines never interleave.
  */
 
+#define LOG_LINE_MAX 2048
+
 static const char *log__sev2str[] = {
 	"DEBUG",		/* LOG_DEBUG */
 	"INFO",			/* LOG_INFO */
@@ -382,48 +429,58 @@ static const char *log__sev2str[] = {
 	"FATAL", 		/* LOG_FATAL */
 };
 
-static void log__submit(const char *file,
-			int line,
-			const char *func,
-			const struct log_config *config,
-			const char *subs,
-			enum log_severity sev,
-			const char *format,
-			va_list args)
+/* appends to \buf at offset \pos; the result is always NUL-terminated */
+static void log__vappend(char *buf, size_t *pos, const char *format,
+				va_list args)
 {
-	const char *prefix = NULL;
-	FILE *out;
-	long long sec, usec;
+	int ret;
 
-	if (log__omit(file, line, func, config, subs, sev))
+	if (*pos >= LOG_LINE_MAX - 1)
 		return;
 
-	if (log__file)
-		out = log__file;
-	else
-		out = stderr;
+	ret = vsnprintf(&buf[*pos], LOG_LINE_MAX - *pos, format, args);
+	if (ret > 0)
+		*pos += ret;
+	if (*pos > LOG_LINE_MAX - 1)
+		*pos = LOG_LINE_MAX - 1;
+}
 
-	log__time(&sec, &usec);
+static void log__append(char *buf, size_t *pos, const char *format, ...)
+{
+	va_list list;
+
+	va_start(list, format);
+	log__vappend(buf, pos, format, list);
+	va_end(list);
+}
+
+static void log__prefix(char *buf, size_t *pos, long long sec, long long usec,
+			const char *subs, enum log_severity sev)
+{
+	const char *prefix = NULL;
 
 	if (sev < LOG_SEV_NUM)
 		prefix = log__sev2str[sev];
 
 	if (prefix) {
 		if (subs)
-			fprintf(out, "[%.4lld.%.6lld] %s: %s: ",
-				sec, usec, prefix, subs);
+			log__append(buf, pos, "[%.4lld.%.6lld] %s: %s: ",
+					sec, usec, prefix, subs);
 		else
-			fprintf(out, "[%.4lld.%.6lld] %s: ",
-				sec, usec, prefix);
+			log__append(buf, pos, "[%.4lld.%.6lld] %s: ",
+					sec, usec, prefix);
 	} else {
 		if (subs)
-			fprintf(out, "[%.4lld.%.6lld] %s: ", sec, usec, subs);
+			log__append(buf, pos, "[%.4lld.%.6lld] %s: ",
+					sec, usec, subs);
 		else
-			fprintf(out, "[%.4lld.%.6lld] ", sec, usec);
+			log__append(buf, pos, "[%.4lld.%.6lld] ", sec, usec);
 	}
+}
 
-	vfprintf(out, format, args);
-
+static void log__suffix(char *buf, size_t *pos, const char *file, int line,
+			const char *func, enum log_severity sev)
+{
 	if (sev == LOG_DEBUG) {
 		if (!func)
 			func = "<unknown>";
@@ -431,10 +488,44 @@ static void log__submit(const char *file,
 			file = "<unknown>";
 		if (line < 0)
 			line = 0;
-		fprintf(out, " (%s() in %s:%d)\n", func, file, line);
+		log__append(buf, pos, " (%s() in %s:%d)\n", func, file, line);
 	} else {
-		fprintf(out, "\n");
+		log__append(buf, pos, "\n");
 	}
+
+	/* keep the newline of truncated messages */
+	buf[*pos - 1] = '\n';
+}
+
+static void log__write(const char *buf, size_t len)
+{
+	pthread_mutex_lock(&log__out_mutex);
+	fwrite(buf, 1, len, log__file ? log__file : stderr);
+	pthread_mutex_unlock(&log__out_mutex);
+}
+
+static void log__submit(const char *file,
+			int line,
+			const char *func,
+			const struct log_config *config,
+			const char *subs,
+			enum log_severity sev,
+			const char *format,
+			va_list args)
+{
+	char buf[LOG_LINE_MAX];
+	size_t pos = 0;
+	long long sec, usec;
+
+	if (log__omit(file, line, func, config, subs, sev))
+		return;
+
+	log__time(&sec, &usec);
+
+	log__prefix(buf, &pos, sec, usec, subs, sev);
+	log__vappend(buf, &pos, format, args);
+	log__suffix(buf, &pos, file, line, func, sev);
+	log__write(buf, pos);
 }
 
 static void log__format(const char *file,
@@ -453,6 +544,745 @@ static void log__format(const char *file,
 	va_end(list);
 }
 
+/*
+ * Asynchronous Logging
+ * After log_set_async(true), log_submit() neither formats nor writes the
+ * message. It records the format pointer and the raw arguments in a ring of
+ * the calling thread and returns; a background thread formats and writes the
+ * records. This relies on format, file, func and subsystem being static
+ * strings, which holds for all log_*() helpers. Strings passed as %s arguments
+ * are copied and %m is resolved with the errno of the caller.
+ * Every thread has its own single-producer/single-consumer ring so logging
+ * takes no lock unless dynamic filters are installed. If a ring is full the
+ * message is dropped and counted instead of blocking the caller. Formats the
+ * recorder does not understand (%n, long double, wide strings, more than
+ * LOG_ARGS_MAX arguments) are formatted by the caller into the record instead.
+ * Messages of severity LOG_ERROR and above wake the writer immediately, others
+ * are written within LOG_FLUSH_MSEC. Messages of severity LOG_CRITICAL and
+ * above usually precede an abort, so they are not queued: the caller waits up
+ * to LOG_SYNC_MSEC until the writer has flushed all rings and then writes and
+ * flushes the message itself.
+ *
+ * Each record is a struct log_record followed by 8-byte argument slots: first
+ * '*' widths and precisions, then the value. A %s argument is its length
+ * followed by the bytes padded to 8. The writer walks the format string again
+ * to interpret the slots.
+ */
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define LOG_RING_SIZE (64 * 1024)
+#define LOG_ARGS_MAX 16
+#define LOG_SLOTS_MAX (LOG_ARGS_MAX * 3)
+#define LOG_SPEC_MAX 32
+#define LOG_STR_MAX 512
+#define LOG_FLUSH_MSEC 10
+#define LOG_SYNC_MSEC 100
+#define LOG_RECORD_WRAP 0xffffffff
+#define LOG_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+enum log_arg_type {
+	LOG_ARG_NONE,		/* %% and %m */
+	LOG_ARG_INT,
+	LOG_ARG_LONG,
+	LOG_ARG_LLONG,
+	LOG_ARG_INTMAX,
+	LOG_ARG_SIZE,
+	LOG_ARG_PTRDIFF,
+	LOG_ARG_DOUBLE,
+	LOG_ARG_PTR,
+	LOG_ARG_STR,
+	LOG_ARG_INVALID,
+};
+
+struct log_spec {
+	size_t len;		/* length including the '%' */
+	char conv;
+	bool width_arg;		/* width given as '*' */
+	bool prec_arg;		/* precision given as '*' */
+	int prec;		/* -1 if none */
+	enum log_arg_type type;
+};
+
+struct log_record {
+	uint32_t size;		/* LOG_RECORD_WRAP: continue at ring start */
+	int line;
+	int err;
+	enum log_severity sev;
+	bool text;		/* preformatted by the caller */
+	const char *file;
+	const char *func;
+	const char *subs;
+	const char *format;
+	struct timeval time;
+};
+
+union log_slot {
+	long long i;
+	double d;
+	const void *p;
+	uint64_t len;
+};
+
+struct log_ring {
+	struct log_ring *next;
+	unsigned long head;	/* written by the owning thread */
+	unsigned long tail;	/* written by the writer thread */
+	unsigned long dropped;
+	bool dead;		/* owning thread exited */
+	char buf[LOG_RING_SIZE];
+};
+
+static bool log__async;
+static bool log__async_init;
+static pthread_key_t log__ring_key;
+static __thread struct log_ring *log__ring;
+
+/* log__wmutex protects the ring list and the writer state */
+static pthread_mutex_t log__wmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log__wcond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log__fcond = PTHREAD_COND_INITIALIZER;
+static unsigned long log__flushed;	/* number of completed flushes */
+static struct log_ring *log__rings;
+static pthread_t log__thread;
+static bool log__wexit;
+static bool log__wake;
+
+static void log__parse_spec(const char *p, struct log_spec *spec)
+{
+	const char *s = p + 1;
+	char lmod = 0;
+
+	memset(spec, 0, sizeof(*spec));
+	spec->prec = -1;
+
+	while (*s && strchr("#0- +'", *s))
+		++s;
+
+	if (*s == '*') {
+		spec->width_arg = true;
+		++s;
+	} else {
+		while (*s >= '0' && *s <= '9')
+			++s;
+	}
+
+	if (*s == '.') {
+		++s;
+		if (*s == '*') {
+			spec->prec_arg = true;
+			++s;
+		} else {
+			spec->prec = 0;
+			while (*s >= '0' && *s <= '9')
+				spec->prec = spec->prec * 10 + *s++ - '0';
+		}
+	}
+
+	switch (*s) {
+	case 'h':
+		lmod = *s++;
+		if (*s == 'h')
+			++s;
+		break;
+	case 'l':
+		lmod = *s++;
+		if (*s == 'l') {
+			lmod = 'q';
+			++s;
+		}
+		break;
+	case 'q':
+	case 'L':
+	case 'j':
+	case 'z':
+	case 't':
+		lmod = *s++;
+		break;
+	}
+
+	spec->conv = *s;
+	spec->len = *s ? s + 1 - p : s - p;
+
+	switch (*s) {
+	case 'd':
+	case 'i':
+	case 'o':
+	case 'u':
+	case 'x':
+	case 'X':
+	case 'c':
+		if (!lmod || lmod == 'h' || (lmod == 'l' && *s == 'c'))
+			spec->type = LOG_ARG_INT;
+		else if (lmod == 'l')
+			spec->type = LOG_ARG_LONG;
+		else if (lmod == 'q')
+			spec->type = LOG_ARG_LLONG;
+		else if (lmod == 'j')
+			spec->type = LOG_ARG_INTMAX;
+		else if (lmod == 'z')
+			spec->type = LOG_ARG_SIZE;
+		else if (lmod == 't')
+			spec->type = LOG_ARG_PTRDIFF;
+		else
+			spec->type = LOG_ARG_INVALID;
+		break;
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'F':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		if (!lmod || lmod == 'l')
+			spec->type = LOG_ARG_DOUBLE;
+		else
+			spec->type = LOG_ARG_INVALID;
+		break;
+	case 's':
+		spec->type = lmod ? LOG_ARG_INVALID : LOG_ARG_STR;
+		break;
+	case 'p':
+		spec->type = lmod ? LOG_ARG_INVALID : LOG_ARG_PTR;
+		break;
+	case 'm':
+	case '%':
+		spec->type = LOG_ARG_NONE;
+		break;
+	default:
+		spec->type = LOG_ARG_INVALID;
+		break;
+	}
+
+	if (spec->len >= LOG_SPEC_MAX)
+		spec->type = LOG_ARG_INVALID;
+}
+
+/*
+ * Copies the arguments of \format into \slots. \strs[i] is the string that
+ * follows slot i or NULL. Returns false if the format is not supported.
+ */
+static bool log__capture(const char *format, va_list args,
+				union log_slot *slots, const char **strs,
+				size_t *num, size_t *size)
+{
+	struct log_spec spec;
+	const char *p, *s;
+	size_t n = 0, len, bytes = 0;
+
+	for (p = format; (p = strchr(p, '%')); p += spec.len) {
+		log__parse_spec(p, &spec);
+		if (spec.type == LOG_ARG_INVALID || n + 3 > LOG_SLOTS_MAX)
+			return false;
+
+		if (spec.width_arg) {
+			strs[n] = NULL;
+			slots[n++].i = va_arg(args, int);
+		}
+		if (spec.prec_arg) {
+			strs[n] = NULL;
+			slots[n].i = va_arg(args, int);
+			spec.prec = slots[n++].i;
+		}
+
+		strs[n] = NULL;
+		switch (spec.type) {
+		case LOG_ARG_NONE:
+			continue;
+		case LOG_ARG_INT:
+			slots[n].i = va_arg(args, int);
+			break;
+		case LOG_ARG_LONG:
+			slots[n].i = va_arg(args, long);
+			break;
+		case LOG_ARG_LLONG:
+			slots[n].i = va_arg(args, long long);
+			break;
+		case LOG_ARG_INTMAX:
+			slots[n].i = va_arg(args, intmax_t);
+			break;
+		case LOG_ARG_SIZE:
+			slots[n].i = va_arg(args, size_t);
+			break;
+		case LOG_ARG_PTRDIFF:
+			slots[n].i = va_arg(args, ptrdiff_t);
+			break;
+		case LOG_ARG_DOUBLE:
+			slots[n].d = va_arg(args, double);
+			break;
+		case LOG_ARG_PTR:
+			slots[n].p = va_arg(args, void*);
+			break;
+		case LOG_ARG_STR:
+			s = va_arg(args, const char*);
+			if (!s)
+				s = "(null)";
+			len = LOG_STR_MAX;
+			if (spec.prec >= 0 && spec.prec < LOG_STR_MAX)
+				len = spec.prec;
+			len = strnlen(s, len);
+			slots[n].len = len;
+			strs[n] = s;
+			bytes += LOG_ALIGN(len);
+			break;
+		default:
+			return false;
+		}
+		++n;
+	}
+
+	*num = n;
+	*size = LOG_ALIGN(sizeof(struct log_record)) + n * sizeof(*slots) +
+		bytes;
+	return true;
+}
+
+#define LOG_APPEND_SPEC(val) \
+	(spec.width_arg && spec.prec_arg ? \
+		log__append(buf, pos, fmt, width, prec, (val)) : \
+	spec.width_arg ? log__append(buf, pos, fmt, width, (val)) : \
+	spec.prec_arg ? log__append(buf, pos, fmt, prec, (val)) : \
+		log__append(buf, pos, fmt, (val)))
+
+/* formats the message of \rec; the counterpart of log__capture() */
+static void log__render(const struct log_record *rec, char *buf, size_t *pos)
+{
+	const union log_slot *slot;
+	const char *p, *next;
+	struct log_spec spec;
+	char fmt[LOG_SPEC_MAX], str[LOG_STR_MAX + 1];
+	int width = 0, prec = 0;
+	size_t len;
+
+	slot = (const void*)((const char*)rec +
+				LOG_ALIGN(sizeof(struct log_record)));
+
+	if (rec->text) {
+		log__append(buf, pos, "%.*s", (int)slot->len,
+				(const char*)&slot[1]);
+		return;
+	}
+
+	for (p = rec->format; *p; p = next + spec.len) {
+		next = strchr(p, '%');
+		if (!next) {
+			log__append(buf, pos, "%s", p);
+			break;
+		}
+		if (next > p)
+			log__append(buf, pos, "%.*s", (int)(next - p), p);
+
+		log__parse_spec(next, &spec);
+		memcpy(fmt, next, spec.len);
+		fmt[spec.len] = 0;
+
+		if (spec.width_arg)
+			width = (slot++)->i;
+		if (spec.prec_arg)
+			prec = (slot++)->i;
+
+		switch (spec.type) {
+		case LOG_ARG_NONE:
+			if (spec.conv == 'm')
+				log__append(buf, pos, "%s", strerror(rec->err));
+			else
+				log__append(buf, pos, "%%");
+			continue;
+		case LOG_ARG_INT:
+			LOG_APPEND_SPEC((int)slot->i);
+			break;
+		case LOG_ARG_LONG:
+			LOG_APPEND_SPEC((long)slot->i);
+			break;
+		case LOG_ARG_LLONG:
+			LOG_APPEND_SPEC(slot->i);
+			break;
+		case LOG_ARG_INTMAX:
+			LOG_APPEND_SPEC((intmax_t)slot->i);
+			break;
+		case LOG_ARG_SIZE:
+			LOG_APPEND_SPEC((size_t)slot->i);
+			break;
+		case LOG_ARG_PTRDIFF:
+			LOG_APPEND_SPEC((ptrdiff_t)slot->i);
+			break;
+		case LOG_ARG_DOUBLE:
+			LOG_APPEND_SPEC(slot->d);
+			break;
+		case LOG_ARG_PTR:
+			LOG_APPEND_SPEC(slot->p);
+			break;
+		case LOG_ARG_STR:
+			len = slot->len;
+			memcpy(str, &slot[1], len);
+			str[len] = 0;
+			LOG_APPEND_SPEC(str);
+			slot += LOG_ALIGN(len) / sizeof(*slot);
+			break;
+		default:
+			return;
+		}
+		++slot;
+	}
+}
+
+/* returns the record for \size bytes and the new head or NULL if full */
+static struct log_record *log__reserve(struct log_ring *ring, size_t size,
+					unsigned long *head)
+{
+	unsigned long tail;
+	size_t off, skip = 0;
+	struct log_record *wrap;
+
+	if (size > LOG_RING_SIZE / 4)
+		return NULL;
+
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	off = ring->head % LOG_RING_SIZE;
+	if (off + size > LOG_RING_SIZE)
+		skip = LOG_RING_SIZE - off;
+
+	if (ring->head + skip + size - tail > LOG_RING_SIZE)
+		return NULL;
+
+	if (skip) {
+		wrap = (void*)&ring->buf[off];
+		wrap->size = LOG_RECORD_WRAP;
+		off = 0;
+	}
+
+	*head = ring->head + skip + size;
+	return (void*)&ring->buf[off];
+}
+
+static void log__ring_dead(void *data)
+{
+	struct log_ring *ring = data;
+
+	__atomic_store_n(&ring->dead, true, __ATOMIC_RELEASE);
+}
+
+static struct log_ring *log__get_ring(void)
+{
+	struct log_ring *ring = log__ring;
+
+	if (ring)
+		return ring;
+
+	ring = malloc(sizeof(*ring));
+	if (!ring)
+		return NULL;
+	memset(ring, 0, sizeof(*ring));
+
+	pthread_setspecific(log__ring_key, ring);
+	pthread_mutex_lock(&log__wmutex);
+	ring->next = log__rings;
+	log__rings = ring;
+	pthread_mutex_unlock(&log__wmutex);
+
+	log__ring = ring;
+	return ring;
+}
+
+static void log__async_submit(const char *file,
+				int line,
+				const char *func,
+				const struct log_config *config,
+				const char *subs,
+				enum log_severity sev,
+				const char *format,
+				va_list args,
+				int err)
+{
+	union log_slot slots[LOG_SLOTS_MAX];
+	const char *strs[LOG_SLOTS_MAX];
+	char text[LOG_LINE_MAX];
+	struct log_record *rec;
+	struct log_ring *ring;
+	unsigned long head;
+	size_t i, num, size;
+	va_list copy;
+	char *dst;
+	bool ok;
+	int len;
+
+	if (log_omit(file, line, func, config, subs, sev))
+		return;
+
+	ring = log__get_ring();
+	if (!ring)
+		return;
+
+	va_copy(copy, args);
+	ok = log__capture(format, copy, slots, strs, &num, &size);
+	va_end(copy);
+
+	if (!ok) {
+		errno = err;
+		len = vsnprintf(text, sizeof(text), format, args);
+		if (len < 0)
+			len = 0;
+		else if (len >= (int)sizeof(text))
+			len = sizeof(text) - 1;
+
+		slots[0].len = len;
+		strs[0] = text;
+		num = 1;
+		size = LOG_ALIGN(sizeof(*rec)) + sizeof(*slots) +
+			LOG_ALIGN(len);
+	}
+
+	rec = log__reserve(ring, size, &head);
+	if (!rec) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec->size = size;
+	rec->line = line;
+	rec->err = err;
+	rec->sev = sev;
+	rec->text = !ok;
+	rec->file = file;
+	rec->func = func;
+	rec->subs = subs;
+	rec->format = format;
+	gettimeofday(&rec->time, NULL);
+
+	dst = (char*)rec + LOG_ALIGN(sizeof(*rec));
+	for (i = 0; i < num; ++i) {
+		memcpy(dst, &slots[i], sizeof(*slots));
+		dst += sizeof(*slots);
+		if (strs[i]) {
+			memcpy(dst, strs[i], slots[i].len);
+			dst += LOG_ALIGN(slots[i].len);
+		}
+	}
+
+	__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+	if (sev >= LOG_ERROR) {
+		pthread_mutex_lock(&log__wmutex);
+		log__wake = true;
+		pthread_cond_signal(&log__wcond);
+		pthread_mutex_unlock(&log__wmutex);
+	}
+}
+
+static void log__write_record(const struct log_record *rec, char *buf)
+{
+	long long sec, usec;
+	size_t pos = 0;
+
+	log__reltime(&rec->time, &sec, &usec);
+	log__prefix(buf, &pos, sec, usec, rec->subs, rec->sev);
+	log__render(rec, buf, &pos);
+	log__suffix(buf, &pos, rec->file, rec->line, rec->func, rec->sev);
+	log__write(buf, pos);
+}
+
+static bool log__drain(struct log_ring *ring, char *buf)
+{
+	struct log_record *rec;
+	unsigned long head, tail, dropped;
+	struct timeval t;
+	long long sec, usec;
+	size_t off, pos;
+	bool busy = false;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	tail = ring->tail;
+
+	while (tail != head) {
+		off = tail % LOG_RING_SIZE;
+		rec = (void*)&ring->buf[off];
+		if (rec->size == LOG_RECORD_WRAP) {
+			tail += LOG_RING_SIZE - off;
+			continue;
+		}
+
+		log__write_record(rec, buf);
+		tail += rec->size;
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+		busy = true;
+	}
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+	dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+	if (dropped) {
+		gettimeofday(&t, NULL);
+		log__reltime(&t, &sec, &usec);
+		pos = 0;
+		log__prefix(buf, &pos, sec, usec, "log", LOG_WARNING);
+		log__append(buf, &pos, "log buffer full, dropped %lu messages",
+				dropped);
+		log__suffix(buf, &pos, NULL, 0, NULL, LOG_WARNING);
+		log__write(buf, pos);
+		busy = true;
+	}
+
+	return busy;
+}
+
+/* writes all queued records; must only be called by the writer */
+static bool log__flush(char *buf)
+{
+	struct log_ring *ring, **iter;
+	bool busy = false;
+
+	pthread_mutex_lock(&log__wmutex);
+	ring = log__rings;
+	pthread_mutex_unlock(&log__wmutex);
+
+	/* only we unlink rings so the list behind the head is stable */
+	for (; ring; ring = ring->next)
+		busy |= log__drain(ring, buf);
+
+	pthread_mutex_lock(&log__wmutex);
+	iter = &log__rings;
+	while ((ring = *iter)) {
+		if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE) &&
+		    !log__drain(ring, buf)) {
+			*iter = ring->next;
+			free(ring);
+		} else {
+			iter = &ring->next;
+		}
+	}
+	++log__flushed;
+	pthread_cond_broadcast(&log__fcond);
+	pthread_mutex_unlock(&log__wmutex);
+
+	if (busy) {
+		pthread_mutex_lock(&log__out_mutex);
+		fflush(log__file ? log__file : stderr);
+		pthread_mutex_unlock(&log__out_mutex);
+	}
+
+	return busy;
+}
+
+static void *log__writer(void *data)
+{
+	char buf[LOG_LINE_MAX];
+	struct timespec ts;
+	bool done;
+
+	while (1) {
+		pthread_mutex_lock(&log__wmutex);
+		done = log__wexit;
+		pthread_mutex_unlock(&log__wmutex);
+
+		/* always flush once more after we were told to exit */
+		if (log__flush(buf) && !done)
+			continue;
+		if (done)
+			break;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += LOG_FLUSH_MSEC * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec += 1;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		pthread_mutex_lock(&log__wmutex);
+		if (!log__wexit && !log__wake)
+			pthread_cond_timedwait(&log__wcond, &log__wmutex, &ts);
+		log__wake = false;
+		pthread_mutex_unlock(&log__wmutex);
+	}
+
+	return NULL;
+}
+
+/* waits until the writer has written all records queued before the call */
+static void log__wait_flush(void)
+{
+	struct timespec ts;
+	unsigned long gen;
+	int ret = 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += LOG_SYNC_MSEC * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec += 1;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&log__wmutex);
+	/* a flush that is already running may have missed our records */
+	gen = log__flushed + 2;
+	log__wake = true;
+	pthread_cond_signal(&log__wcond);
+	while (!ret && log__flushed < gen)
+		ret = pthread_cond_timedwait(&log__fcond, &log__wmutex, &ts);
+	pthread_mutex_unlock(&log__wmutex);
+}
+
+/* a forked child has no writer thread */
+static void log__atfork_child(void)
+{
+	__atomic_store_n(&log__async, false, __ATOMIC_RELAXED);
+}
+
+int log_set_async(bool async)
+{
+	char buf[LOG_LINE_MAX];
+	sigset_t mask, oldmask;
+	int ret = 0;
+
+	log_lock();
+
+	if (async == __atomic_load_n(&log__async, __ATOMIC_RELAXED))
+		goto out;
+
+	if (async) {
+		if (!log__async_init) {
+			ret = -pthread_key_create(&log__ring_key,
+							log__ring_dead);
+			if (ret)
+				goto out;
+			pthread_atfork(NULL, NULL, log__atfork_child);
+			log__async_init = true;
+		}
+
+		/* the writer computes time offsets without the lock */
+		if (log__ftime.tv_sec == 0 && log__ftime.tv_usec == 0)
+			gettimeofday(&log__ftime, NULL);
+
+		log__wexit = false;
+
+		/* signals are handled by the threads that block them */
+		sigfillset(&mask);
+		pthread_sigmask(SIG_SETMASK, &mask, &oldmask);
+		ret = -pthread_create(&log__thread, NULL, log__writer, NULL);
+		pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+		if (ret)
+			goto out;
+
+		__atomic_store_n(&log__async, true, __ATOMIC_RELEASE);
+	} else {
+		__atomic_store_n(&log__async, false, __ATOMIC_RELEASE);
+
+		pthread_mutex_lock(&log__wmutex);
+		log__wexit = true;
+		pthread_cond_signal(&log__wcond);
+		pthread_mutex_unlock(&log__wmutex);
+
+		pthread_join(log__thread, NULL);
+		log__flush(buf);
+	}
+
+out:
+	log_unlock();
+	return ret;
+}
+
 void log_submit(const char *file,
 		int line,
 		const char *func,
@@ -464,9 +1294,24 @@ void log_submit(const char *file,
 {
 	int saved_errno = errno;
 
-	log_lock();
-	log__submit(file, line, func, config, subs, sev, format, args);
-	log_unlock();
+	if (!__atomic_load_n(&log__async, __ATOMIC_ACQUIRE)) {
+		log_lock();
+		log__submit(file, line, func, config, subs, sev, format, args);
+		log_unlock();
+	} else if (sev < LOG_CRITICAL) {
+		log__async_submit(file, line, func, config, subs, sev, format,
+					args, saved_errno);
+	} else {
+		/* written by us so it is out before a following abort */
+		log__wait_flush();
+		log_lock();
+		errno = saved_errno;
+		log__submit(file, line, func, config, subs, sev, format, args);
+		pthread_mutex_lock(&log__out_mutex);
+		fflush(log__file ? log__file : stderr);
+		pthread_mutex_unlock(&log__out_mutex);
+		log_unlock();
+	}
 
 	errno = saved_errno;
 }
@@ -481,15 +1326,93 @@ void log_format(const char *file,
 		...)
 {
 	va_list list;
-	int saved_errno = errno;
 
 	va_start(list, format);
-	log_lock();
-	log__submit(file, line, func, config, subs, sev, format, list);
-	log_unlock();
+	log_submit(file, line, func, config, subs, sev, format, list);
 	va_end(list);
+}
+
+/*
+ * Rate-Limiting
+ * The token bucket of each call-site is kept as the time at which it is full
+ * again (generic cell rate algorithm). Every message moves this time
+ * LOG_RATELIMIT_INTERVAL into the future; if it is more than the burst ahead
+ * of now the bucket is empty. This needs a single compare-and-swap so
+ * call-sites are shared between threads without locking.
+ */
+
+static uint64_t log__now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static bool log__ratelimit(struct log_ratelimit *rl)
+{
+	uint64_t now, tat, next;
+
+	now = log__now();
+	tat = __atomic_load_n(&rl->tat, __ATOMIC_RELAXED);
+	do {
+		next = tat > now ? tat : now;
+		if (next - now > (LOG_RATELIMIT_BURST - 1) *
+						(uint64_t)LOG_RATELIMIT_INTERVAL) {
+			__atomic_add_fetch(&rl->suppressed, 1, __ATOMIC_RELAXED);
+			return false;
+		}
+		next += LOG_RATELIMIT_INTERVAL;
+	} while (!__atomic_compare_exchange_n(&rl->tat, &tat, next, true,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED));
+
+	return true;
+}
+
+void log_submit_ratelimited(struct log_ratelimit *rl,
+				const char *file,
+				int line,
+				const char *func,
+				const struct log_config *config,
+				const char *subs,
+				enum log_severity sev,
+				const char *format,
+				va_list args)
+{
+	int saved_errno = errno;
+	unsigned long suppressed;
+
+	if (log_omit(file, line, func, config, subs, sev))
+		return;
+	if (!log__ratelimit(rl))
+		return;
+
+	suppressed = __atomic_exchange_n(&rl->suppressed, 0, __ATOMIC_RELAXED);
+	if (suppressed)
+		log_format(file, line, func, config, subs, sev,
+				"%lu similar messages suppressed", suppressed);
 
 	errno = saved_errno;
+	log_submit(file, line, func, config, subs, sev, format, args);
+}
+
+void log_format_ratelimited(struct log_ratelimit *rl,
+				const char *file,
+				int line,
+				const char *func,
+				const struct log_config *config,
+				const char *subs,
+				enum log_severity sev,
+				const char *format,
+				...)
+{
+	va_list list;
+
+	va_start(list, format);
+	log_submit_ratelimited(rl, file, line, func, config, subs, sev, format,
+				list);
+	va_end(list);
 }
 
 void log_print_init(const char *appname)
@@ -27,6 +27,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 /*
@@ -162,6 +163,17 @@ void log_clean_filter();
  * No log-file-roations or other backup/rotation functions are supported. Use a
  * proper init system like systemd to do this.
  *
+ * log_set_async(async):
+ * If \async is true, messages are no longer written by the caller but queued
+ * in a ring of the calling thread and written by a background thread. The
+ * format string and the file, func and subsystem strings must stay valid
+ * forever, which holds for all helpers below. Messages are dropped if a ring
+ * is full. Critical and fatal messages are still written by the caller, after
+ * the messages queued before them, so they are not lost if the program aborts
+ * or crashes right after. Disabling async mode writes all queued messages
+ * before returning.
+ * Returns 0 on success or a negative error code.
+ *
  * log_print_init(appname):
  * This prints a message with build-time/date and appname to the log. You should
  * invoke this very early in your program. It is not required, though. However,
@@ -189,6 +201,7 @@ void log_format(const char *file,
 		...);
 
 int log_set_file(const char *file);
+int log_set_async(bool async);
 void log_print_init(const char *appname);
 
 /*
@@ -236,29 +249,126 @@ extern const char *LOG_SUBSYSTEM;
 #define log_printf(sev, format, ...) \
 	log_format(LOG_DEFAULT, (sev), (format), ##__VA_ARGS__)
 
+/*
+ * Rate-Limiting
+ * log_format_ratelimited() and log_submit_ratelimited() are the same as
+ * log_format() and log_submit() but drop the message if the call-site \rl
+ * logged too often. Each call-site is a token bucket holding up to
+ * LOG_RATELIMIT_BURST messages which is refilled with one token every
+ * LOG_RATELIMIT_INTERVAL microseconds. Messages that are filtered out do not
+ * use tokens. The next message that gets through is preceded by a note with the
+ * number of suppressed messages.
+ * \rl must be zeroed and should be a static object of the call-site. The
+ * helpers from log_info() to log_error() do this automatically so input that
+ * triggers a warning in a tight loop cannot flood the log. log_debug(),
+ * log_critical() and log_fatal() are never throttled; the latter two usually
+ * explain why we are about to exit.
+ */
+
+#define LOG_RATELIMIT_BURST 10
+#define LOG_RATELIMIT_INTERVAL (200 * 1000)
+
+struct log_ratelimit {
+	uint64_t tat;			/* time the bucket is full again */
+	unsigned long suppressed;
+};
+
+void log_submit_ratelimited(struct log_ratelimit *rl,
+				const char *file,
+				int line,
+				const char *func,
+				const struct log_config *config,
+				const char *subs,
+				enum log_severity sev,
+				const char *format,
+				va_list args);
+
+void log_format_ratelimited(struct log_ratelimit *rl,
+				const char *file,
+				int line,
+				const char *func,
+				const struct log_config *config,
+				const char *subs,
+				enum log_severity sev,
+				const char *format,
+				...);
+
+#define log_printf_ratelimited(sev, format, ...) \
+	do { \
+		static struct log_ratelimit log__rl; \
+		log_format_ratelimited(&log__rl, LOG_DEFAULT, (sev), (format), \
+					##__VA_ARGS__); \
+	} while (0)
+
 /*
  * Helpers
  * The pick-up all the default values and submit the message to the
  * log-subsystem. The log_debug() function produces zero-code if
  * LOG_ENABLE_DEBUG is not defined. Therefore, it can be heavily used for
  * debugging and will not have any side-effects.
+ * Likewise, all helpers below LOG_MIN_SEVERITY produce zero-code. It is set
+ * with --with-log-level and defaults to LOG_DEBUG if LOG_ENABLE_DEBUG is
+ * defined and LOG_INFO otherwise. Messages of severity LOG_CRITICAL and above
+ * are always compiled in.
+ * Disabled helpers still see their arguments through log__drop() so the
+ * format is checked and variables that are only logged don't cause unused
+ * warnings. The compiler removes the dead call.
  */
 
-#ifdef LOG_ENABLE_DEBUG
+#define log__drop(sev, format, ...) \
+	do { \
+		if (0) \
+			log_printf((sev), (format), ##__VA_ARGS__); \
+	} while (0)
+
+#ifndef LOG_MIN_SEVERITY
+	#ifdef LOG_ENABLE_DEBUG
+		#define LOG_MIN_SEVERITY 0
+	#else
+		#define LOG_MIN_SEVERITY 1
+	#endif
+#endif
+
+#if defined(LOG_ENABLE_DEBUG) && LOG_MIN_SEVERITY <= 0
 	#define log_debug(format, ...) \
 		log_printf(LOG_DEBUG, (format), ##__VA_ARGS__)
 #else
-	#define log_debug(format, ...)
+	#define log_debug(format, ...) \
+		log__drop(LOG_DEBUG, (format), ##__VA_ARGS__)
+#endif
+
+#if LOG_MIN_SEVERITY <= 1
+	#define log_info(format, ...) \
+		log_printf_ratelimited(LOG_INFO, (format), ##__VA_ARGS__)
+#else
+	#define log_info(format, ...) \
+		log__drop(LOG_INFO, (format), ##__VA_ARGS__)
+#endif
+
+#if LOG_MIN_SEVERITY <= 2
+	#define log_notice(format, ...) \
+		log_printf_ratelimited(LOG_NOTICE, (format), ##__VA_ARGS__)
+#else
+	#define log_notice(format, ...) \
+		log__drop(LOG_NOTICE, (format), ##__VA_ARGS__)
+#endif
+
+#if LOG_MIN_SEVERITY <= 3
+	#define log_warning(format, ...) \
+		log_printf_ratelimited(LOG_WARNING, (format), ##__VA_ARGS__)
+#else
+	#define log_warning(format, ...) \
+		log__drop(LOG_WARNING, (format), ##__VA_ARGS__)
+#endif
+
+#if LOG_MIN_SEVERITY <= 4
+	#define log_error(format, ...) \
+		log_printf_ratelimited(LOG_ERROR, (format), ##__VA_ARGS__)
+#else
+	#define log_error(format, ...) \
+		log__drop(LOG_ERROR, (format), ##__VA_ARGS__)
 #endif
 
-#define log_info(format, ...) \
-	log_printf(LOG_INFO, (format), ##__VA_ARGS__)
-#define log_notice(format, ...) \
-	log_printf(LOG_NOTICE, (format), ##__VA_ARGS__)
-#define log_warning(format, ...) \
-	log_printf(LOG_WARNING, (format), ##__VA_ARGS__)
-#define log_error(format, ...) \
-	log_printf(LOG_ERROR, (format), ##__VA_ARGS__)
 #define log_critical(format, ...) \
 	log_printf(LOG_CRITICAL, (format), ##__VA_ARGS__)
 #define log_fatal(format, ...) \
@@ -33,6 +33,7 @@
 #include "eloop.h"
 #include "input.h"
 #include "log.h"
+#include "trace.h"
 #include "ui.h"
 #include "uterm.h"
 #include "vt.h"
@@ -56,6 +57,19 @@ static void sig_generic(struct ev_eloop *eloop, struct signalfd_siginfo *info,
 	log_info("terminating due to caught signal %d", info->ssi_signo);
 }
 
+static void sig_trace(struct ev_eloop *eloop, struct signalfd_siginfo *info,
+			void *data)
+{
+	int ret;
+
+	ret = kmscon_trace_dump(NULL);
+	if (ret)
+		log_warn("cannot dump event trace (%d): %s", ret,
+				strerror(-ret));
+	else
+		log_info("dumped event trace to %s", conf_global.trace);
+}
+
 static bool vt_switch(struct kmscon_vt *vt,
 			enum kmscon_vt_action action,
 			void *data)
@@ -87,6 +101,7 @@ static void destroy_app(struct kmscon_app *app)
 	uterm_video_unref(app->video);
 	kmscon_vt_unref(app->vt);
 	ev_eloop_unregister_signal_cb(app->eloop, SIGINT, sig_generic, app);
+	ev_eloop_unregister_signal_cb(app->eloop, SIGQUIT, sig_trace, app);
 	ev_eloop_unregister_signal_cb(app->eloop, SIGTERM, sig_generic, app);
 	ev_eloop_rm_eloop(app->vt_eloop);
 	ev_eloop_unref(app->eloop);
@@ -110,6 +125,17 @@ static int setup_app(struct kmscon_app *app)
 	if (ret)
 		goto err_app;
 
+	if (conf_global.trace) {
+		ret = kmscon_trace_start(conf_global.trace);
+		if (ret)
+			goto err_app;
+
+		ret = ev_eloop_register_signal_cb(app->eloop, SIGQUIT,
+							sig_trace, app);
+		if (ret)
+			goto err_app;
+	}
+
 	ret = ev_eloop_new_eloop(app->eloop, &app->vt_eloop);
 	if (ret)
 		goto err_app;
@@ -172,6 +198,10 @@ int main(int argc, char **argv)
 
 	log_print_init("kmscon");
 
+	ret = log_set_async(true);
+	if (ret)
+		log_warn("cannot start log writer, logging synchronously");
+
 	memset(&app, 0, sizeof(app));
 	ret = setup_app(&app);
 	if (ret)
@@ -204,11 +234,17 @@ int main(int argc, char **argv)
 	}
 
 	destroy_app(&app);
+	if (conf_global.trace) {
+		kmscon_trace_dump(NULL);
+		kmscon_trace_stop();
+	}
 	log_info("exiting");
+	log_set_async(false);
 
 	return EXIT_SUCCESS;
 
 err_out:
 	log_err("cannot initialize kmscon, errno %d: %s", ret, strerror(-ret));
+	log_set_async(false);
 	return -ret;
 }
@@ -27,31 +27,143 @@
 /*
  * Miscellaneous Helpers
  * Rings: Rings are used to buffer a byte-stream of data. It works like a FIFO
- * queue but in-memory.
+ * queue but in-memory. The pending data is always available as one contiguous
+ * span.
+ * Hash Tables: Open-addressing hash tables with a fast path for integer keys.
  */
 
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "log.h"
 #include "misc.h"
 
 #define LOG_SUBSYSTEM "misc"
 
-#define RING_SIZE 512
+/*
+ * The ring is a power-of-two sized buffer which is mapped twice back-to-back
+ * into our address space. Both mappings share the same memfd pages, so
+ * writing past the end of the first mapping writes to the start of the buffer.
+ * Therefore, every readable span is contiguous and can be passed to a single
+ * write(). \start and \end are free-running byte counters; their difference
+ * is the number of pending bytes and masking them with (size - 1) gives the
+ * buffer offset.
+ * The buffer is allocated lazily on the first write and grows by powers of two
+ * if the pending data does not fit. A grown buffer is released once it drains
+ * so a single burst of output does not pin its memory for the lifetime of the
+ * pty; the next write maps a buffer of the minimal size again.
+ */
 
-struct ring_entry {
-	struct ring_entry *next;
-	size_t len;
-	char buf[];
-};
+#define RING_MIN_SIZE (16 * 1024)
 
 struct kmscon_ring {
-	struct ring_entry *first;
-	struct ring_entry *last;
+	char *buf;
+	size_t size;
+	size_t start;
+	size_t end;
 };
 
+static void ring_unmap(char *buf, size_t size)
+{
+	if (buf)
+		munmap(buf, size * 2);
+}
+
+static int ring_map(char **out, size_t size)
+{
+	int fd, ret;
+	char *buf, *p;
+
+	fd = memfd_create("kmscon-ring", MFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (ftruncate(fd, size)) {
+		ret = -errno;
+		goto err_fd;
+	}
+
+	/* reserve address space for both mappings first */
+	buf = mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0);
+	if (buf == MAP_FAILED) {
+		ret = -errno;
+		goto err_fd;
+	}
+
+	p = mmap(buf, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+			fd, 0);
+	if (p == MAP_FAILED) {
+		ret = -errno;
+		goto err_unmap;
+	}
+
+	p = mmap(buf + size, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED, fd, 0);
+	if (p == MAP_FAILED) {
+		ret = -errno;
+		goto err_unmap;
+	}
+
+	/* the mappings keep the memfd alive */
+	close(fd);
+	*out = buf;
+	return 0;
+
+err_unmap:
+	munmap(buf, size * 2);
+err_fd:
+	close(fd);
+	return ret;
+}
+
+static size_t ring_min_size(void)
+{
+	size_t page;
+
+	page = sysconf(_SC_PAGESIZE);
+	return page > RING_MIN_SIZE ? page : RING_MIN_SIZE;
+}
+
+static int ring_grow(struct kmscon_ring *ring, size_t len)
+{
+	size_t size, used;
+	char *buf = NULL;
+	int ret;
+
+	used = ring->end - ring->start;
+	size = ring->size ? ring->size : ring_min_size();
+	while (size < used + len) {
+		if (size * 2 < size)
+			return -ENOMEM;
+		size *= 2;
+	}
+
+	if (size == ring->size)
+		return 0;
+
+	ret = ring_map(&buf, size);
+	if (ret) {
+		log_warn("cannot map ring buffer of size %zu (%d)", size, ret);
+		return ret;
+	}
+
+	if (used)
+		memcpy(buf, &ring->buf[ring->start & (ring->size - 1)], used);
+
+	ring_unmap(ring->buf, ring->size);
+	ring->buf = buf;
+	ring->size = size;
+	ring->start = 0;
+	ring->end = used;
+
+	return 0;
+}
+
 int kmscon_ring_new(struct kmscon_ring **out)
 {
 	struct kmscon_ring *ring;
@@ -71,16 +183,10 @@ int kmscon_ring_new(struct kmscon_ring **out)
 
 void kmscon_ring_free(struct kmscon_ring *ring)
 {
-	struct ring_entry *tmp;
-
 	if (!ring)
 		return;
 
-	while (ring->first) {
-		tmp = ring->first;
-		ring->first = tmp->next;
-		free(tmp);
-	}
+	ring_unmap(ring->buf, ring->size);
 	free(ring);
 }
 
@@ -89,83 +195,60 @@ bool kmscon_ring_is_empty(struct kmscon_ring *ring)
 	if (!ring)
 		return true;
 
-	return ring->first == NULL;
+	return ring->start == ring->end;
+}
+
+size_t kmscon_ring_len(struct kmscon_ring *ring)
+{
+	if (!ring)
+		return 0;
+
+	return ring->end - ring->start;
 }
 
 int kmscon_ring_write(struct kmscon_ring *ring, const char *val, size_t len)
 {
-	struct ring_entry *ent;
-	size_t space, cp;
+	int ret;
 
 	if (!ring || !val || !len)
 		return -EINVAL;
 
-next:
-	ent = ring->last;
-	if (!ent || ent->len >= RING_SIZE) {
-		ent = malloc(sizeof(*ent) + RING_SIZE);
-		if (!ent)
-			return -ENOMEM;
-
-		ent->len = 0;
-		ent->next = NULL;
-		if (ring->last)
-			ring->last->next = ent;
-		else
-			ring->first = ent;
-		ring->last = ent;
+	if (ring->end - ring->start + len > ring->size) {
+		ret = ring_grow(ring, len);
+		if (ret)
+			return ret;
 	}
 
-	space = RING_SIZE - ent->len;
-	if (len >= space)
-		cp = space;
-	else
-		cp = len;
-
-	memcpy(&ent->buf[ent->len], val, cp);
-	ent->len += cp;
-
-	val = &val[cp];
-	len -= cp;
-	if (len > 0)
-		goto next;
+	memcpy(&ring->buf[ring->end & (ring->size - 1)], val, len);
+	ring->end += len;
 
 	return 0;
 }
 
 const char *kmscon_ring_peek(struct kmscon_ring *ring, size_t *len)
 {
-	if (!ring || !ring->first)
+	if (!ring || ring->start == ring->end)
 		return NULL;
 
-	*len = ring->first->len;
-	return ring->first->buf;
+	*len = ring->end - ring->start;
+	return &ring->buf[ring->start & (ring->size - 1)];
 }
 
 void kmscon_ring_drop(struct kmscon_ring *ring, size_t len)
 {
-	struct ring_entry *ent;
-
 	if (!ring || !len)
 		return;
 
-next:
-	ent = ring->first;
-	if (!ent)
-		return;
-
-	if (len >= ent->len) {
-		len -= ent->len;
-		ring->first = ent->next;
-		free(ent);
-		if (!ring->first)
-			ring->last = NULL;
-
-		if (len)
-			goto next;
+	if (len >= ring->end - ring->start) {
+		ring->start = 0;
+		ring->end = 0;
+		if (ring->size > ring_min_size()) {
+			ring_unmap(ring->buf, ring->size);
+			ring->buf = NULL;
+			ring->size = 0;
+		}
 	} else {
-		memmove(ent->buf, &ent->buf[len], ent->len - len);
-		ent->len -= len;
+		ring->start += len;
 	}
 }
 
@@ -281,27 +364,152 @@ void kmscon_hook_call(struct kmscon_hook *hook, void *parent, void *arg)
 	}
 }
 
-/* Hash Tables
- * This is currently a wrapper around the GHashTable glib object. We should
- * replace this with an own hash-table to avoid glib dependency. However, I
- * currently don't have the time so we use glib.
- * TODO: Write an own hash-table implementation!
+/*
+ * Hash Tables
+ * This is an open-addressing hash table with robin-hood insertion and linear
+ * probing. Every slot caches the hash of its key and its distance to the
+ * bucket the hash maps to (0 marks empty slots). Lookups stop as soon as they
+ * hit a slot whose entry is closer to its own bucket than our key would be, so
+ * misses are cheap even at high load. The table is kept at most 7/8 full and
+ * is doubled in size if this is exceeded. Entries are removed with backward
+ * shift deletion, so there are no tombstones that slow down later lookups.
+ * Tables using kmscon_direct_hash/kmscon_direct_equal take a specialized path
+ * which hashes the pointer value inline and compares keys directly instead of
+ * calling through the callbacks.
  */
 
-#include <glib.h>
+#define HASHTABLE_MIN 16
+
+struct hashtable_slot {
+	void *key;
+	void *value;
+	unsigned int hash;
+	unsigned int dist;
+};
 
 struct kmscon_hashtable {
-	GHashTable *tbl;
+	size_t size;
+	size_t num;
+	struct hashtable_slot *slots;
+	bool direct;
+
+	kmscon_hash_cb hash_cb;
+	kmscon_equal_cb equal_cb;
+	kmscon_free_cb free_key;
+	kmscon_free_cb free_value;
 };
 
+static inline unsigned int direct_hash(const void *data)
+{
+	uint64_t v = (uintptr_t)data;
+
+	/* fibonacci hashing; the high bits are the best mixed ones */
+	return (v * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
 unsigned int kmscon_direct_hash(const void *data)
 {
-	return g_direct_hash(data);
+	return direct_hash(data);
 }
 
 int kmscon_direct_equal(const void *data1, const void *data2)
 {
-	return g_direct_equal(data1, data2);
+	return data1 == data2;
+}
+
+static inline unsigned int hashtable_hash(struct kmscon_hashtable *tbl,
+						const void *key)
+{
+	if (tbl->direct)
+		return direct_hash(key);
+	return tbl->hash_cb(key);
+}
+
+static inline bool hashtable_equal(struct kmscon_hashtable *tbl,
+					struct hashtable_slot *slot,
+					const void *key, unsigned int hash)
+{
+	if (tbl->direct)
+		return slot->key == key;
+	return slot->hash == hash && tbl->equal_cb(slot->key, key);
+}
+
+static struct hashtable_slot *hashtable_lookup(struct kmscon_hashtable *tbl,
+						const void *key,
+						unsigned int hash)
+{
+	struct hashtable_slot *slot;
+	size_t i, mask;
+	unsigned int dist;
+
+	mask = tbl->size - 1;
+	i = hash & mask;
+	for (dist = 1; ; ++dist) {
+		slot = &tbl->slots[i];
+		if (slot->dist < dist)
+			return NULL;
+		if (hashtable_equal(tbl, slot, key, hash))
+			return slot;
+		i = (i + 1) & mask;
+	}
+}
+
+/* insert a key that is known not to be in the table and that fits */
+static void hashtable_place(struct kmscon_hashtable *tbl, void *key,
+				void *value, unsigned int hash)
+{
+	struct hashtable_slot cur, tmp, *slot;
+	size_t i, mask;
+
+	cur.key = key;
+	cur.value = value;
+	cur.hash = hash;
+	cur.dist = 1;
+
+	mask = tbl->size - 1;
+	i = hash & mask;
+	while (1) {
+		slot = &tbl->slots[i];
+		if (!slot->dist) {
+			*slot = cur;
+			return;
+		}
+
+		/* robin-hood: take the slot from entries closer to home */
+		if (slot->dist < cur.dist) {
+			tmp = *slot;
+			*slot = cur;
+			cur = tmp;
+		}
+
+		i = (i + 1) & mask;
+		++cur.dist;
+	}
+}
+
+static int hashtable_resize(struct kmscon_hashtable *tbl, size_t size)
+{
+	struct hashtable_slot *old;
+	size_t i, old_size;
+
+	old = tbl->slots;
+	old_size = tbl->size;
+
+	tbl->slots = calloc(size, sizeof(*tbl->slots));
+	if (!tbl->slots) {
+		tbl->slots = old;
+		return -ENOMEM;
+	}
+	tbl->size = size;
+
+	for (i = 0; i < old_size; ++i) {
+		if (old[i].dist)
+			hashtable_place(tbl, old[i].key, old[i].value,
+					old[i].hash);
+	}
+
+	free(old);
+	return 0;
 }
 
 int kmscon_hashtable_new(struct kmscon_hashtable **out,
@@ -319,11 +527,17 @@ int kmscon_hashtable_new(struct kmscon_hashtable **out,
 	if (!tbl)
 		return -ENOMEM;
 	memset(tbl, 0, sizeof(*tbl));
-
-	tbl->tbl = g_hash_table_new_full(hash_cb, equal_cb,
-						free_key, free_value);
-	if (!tbl->tbl) {
-		log_err("cannot allocate GHashTable");
+	tbl->hash_cb = hash_cb;
+	tbl->equal_cb = equal_cb;
+	tbl->free_key = free_key;
+	tbl->free_value = free_value;
+	tbl->direct = hash_cb == kmscon_direct_hash &&
+			equal_cb == kmscon_direct_equal;
+
+	tbl->size = HASHTABLE_MIN;
+	tbl->slots = calloc(tbl->size, sizeof(*tbl->slots));
+	if (!tbl->slots) {
+		log_err("cannot allocate hashtable");
 		free(tbl);
 		return -ENOMEM;
 	}
@@ -334,35 +548,123 @@ int kmscon_hashtable_new(struct kmscon_hashtable **out,
 
 void kmscon_hashtable_free(struct kmscon_hashtable *tbl)
 {
+	size_t i;
+
 	if (!tbl)
 		return;
 
-	g_hash_table_unref(tbl->tbl);
+	for (i = 0; i < tbl->size; ++i) {
+		if (!tbl->slots[i].dist)
+			continue;
+		if (tbl->free_key)
+			tbl->free_key(tbl->slots[i].key);
+		if (tbl->free_value)
+			tbl->free_value(tbl->slots[i].value);
+	}
+
+	free(tbl->slots);
+	free(tbl);
 }
 
+/*
+ * If \key is already in the table, its value is replaced (and freed with the
+ * free_value callback) and the passed \key is freed with the free_key
+ * callback. This matches the semantics of g_hash_table_insert().
+ */
 int kmscon_hashtable_insert(struct kmscon_hashtable *tbl, void *key,
 				void *data)
 {
+	struct hashtable_slot *slot;
+	unsigned int hash;
+	int ret;
+
 	if (!tbl)
 		return -EINVAL;
 
-	g_hash_table_insert(tbl->tbl, key, data);
+	hash = hashtable_hash(tbl, key);
+	slot = hashtable_lookup(tbl, key, hash);
+	if (slot) {
+		if (tbl->free_value)
+			tbl->free_value(slot->value);
+		if (tbl->free_key)
+			tbl->free_key(key);
+		slot->value = data;
+		return 0;
+	}
+
+	if ((tbl->num + 1) * 8 > tbl->size * 7) {
+		ret = hashtable_resize(tbl, tbl->size * 2);
+		if (ret)
+			return ret;
+	}
+
+	hashtable_place(tbl, key, data, hash);
+	++tbl->num;
 	return 0;
 }
 
 bool kmscon_hashtable_find(struct kmscon_hashtable *tbl, void **out, void *key)
 {
-	void *val;
-	gboolean res;
+	struct hashtable_slot *slot;
 
 	if (!tbl)
-		return -EINVAL;
+		return false;
 
-	res = g_hash_table_lookup_extended(tbl->tbl, key, NULL, &val);
-	if (res != TRUE)
+	slot = hashtable_lookup(tbl, key, hashtable_hash(tbl, key));
+	if (!slot)
 		return false;
 
 	if (out)
-		*out = val;
+		*out = slot->value;
 	return true;
 }
+
+/* removes \key and frees it and its value; returns false if it is not found */
+bool kmscon_hashtable_remove(struct kmscon_hashtable *tbl, void *key)
+{
+	struct hashtable_slot *slot, *next;
+	size_t i, mask;
+
+	if (!tbl)
+		return false;
+
+	slot = hashtable_lookup(tbl, key, hashtable_hash(tbl, key));
+	if (!slot)
+		return false;
+
+	if (tbl->free_key)
+		tbl->free_key(slot->key);
+	if (tbl->free_value)
+		tbl->free_value(slot->value);
+
+	/* move following entries one slot closer to their bucket */
+	mask = tbl->size - 1;
+	i = slot - tbl->slots;
+	while (1) {
+		next = &tbl->slots[(i + 1) & mask];
+		if (next->dist <= 1)
+			break;
+		tbl->slots[i] = *next;
+		--tbl->slots[i].dist;
+		i = (i + 1) & mask;
+	}
+
+	memset(&tbl->slots[i], 0, sizeof(tbl->slots[i]));
+	--tbl->num;
+	return true;
+}
+
+/* calls \cb for every entry; \cb must not modify the table */
+void kmscon_hashtable_foreach(struct kmscon_hashtable *tbl,
+				kmscon_foreach_cb cb, void *data)
+{
+	size_t i;
+
+	if (!tbl || !cb)
+		return;
+
+	for (i = 0; i < tbl->size; ++i) {
+		if (tbl->slots[i].dist)
+			cb(tbl->slots[i].key, tbl->slots[i].value, data);
+	}
+}
@@ -50,6 +50,7 @@ struct kmscon_ring;
 int kmscon_ring_new(struct kmscon_ring **out);
 void kmscon_ring_free(struct kmscon_ring *ring);
 bool kmscon_ring_is_empty(struct kmscon_ring *ring);
+size_t kmscon_ring_len(struct kmscon_ring *ring);
 
 int kmscon_ring_write(struct kmscon_ring *ring, const char *val, size_t len);
 const char *kmscon_ring_peek(struct kmscon_ring *ring, size_t *len);
@@ -78,6 +79,7 @@ struct kmscon_hashtable;
 typedef unsigned int (*kmscon_hash_cb) (const void *data);
 typedef int (*kmscon_equal_cb) (const void *data1, const void *data2);
 typedef void (*kmscon_free_cb) (void *data);
+typedef void (*kmscon_foreach_cb) (void *key, void *value, void *data);
 
 unsigned int kmscon_direct_hash(const void *data);
 int kmscon_direct_equal(const void *data1, const void *data2);
@@ -91,6 +93,9 @@ void kmscon_hashtable_free(struct kmscon_hashtable *tbl);
 int kmscon_hashtable_insert(struct kmscon_hashtable *tbl, void *key,
 				void *data);
 bool kmscon_hashtable_find(struct kmscon_hashtable *tbl, void **out, void *key);
+bool kmscon_hashtable_remove(struct kmscon_hashtable *tbl, void *key);
+void kmscon_hashtable_foreach(struct kmscon_hashtable *tbl,
+				kmscon_foreach_cb cb, void *data);
 
 /* double linked list */
 
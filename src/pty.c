@@ -27,24 +27,34 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <pty.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
-#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include "conf.h"
 #include "eloop.h"
 #include "log.h"
 #include "misc.h"
 #include "pty.h"
+#include "trace.h"
 
 #define LOG_SUBSYSTEM "pty"
 
-/* Match N_TTY_BUF_SIZE from the kernel to read as much as we can. */
+/*
+ * The input buffer starts at N_TTY_BUF_SIZE from the kernel and grows up to
+ * KMSCON_NREAD_MAX while the child keeps producing more data than fits into a
+ * single buffer per wakeup. It shrinks again when the load goes down.
+ */
 #define KMSCON_NREAD 4096
+#define KMSCON_NREAD_MAX (64 * 1024)
 
 struct kmscon_pty {
 	unsigned long ref;
@@ -52,9 +62,13 @@ struct kmscon_pty {
 
 	int fd;
 	pid_t child;
+	struct ev_child *cwatch;
 	struct ev_fd *efd;
 	struct kmscon_ring *msgbuf;
-	char io_buf[KMSCON_NREAD];
+	char *io_buf;
+	size_t io_size;
+	bool throttled;
+	bool corked;
 
 	kmscon_pty_input_cb input_cb;
 	void *data;
@@ -80,15 +94,24 @@ int kmscon_pty_new(struct kmscon_pty **out, struct ev_eloop *loop,
 	pty->input_cb = input_cb;
 	pty->data = data;
 
+	pty->io_size = KMSCON_NREAD;
+	pty->io_buf = malloc(pty->io_size);
+	if (!pty->io_buf) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
 	ret = kmscon_ring_new(&pty->msgbuf);
 	if (ret)
-		goto err_free;
+		goto err_buf;
 
 	log_debug("new pty object");
 	ev_eloop_ref(pty->eloop);
 	*out = pty;
 	return 0;
 
+err_buf:
+	free(pty->io_buf);
 err_free:
 	free(pty);
 	return ret;
@@ -110,6 +133,7 @@ void kmscon_pty_unref(struct kmscon_pty *pty)
 	log_debug("free pty object");
 	kmscon_pty_close(pty);
 	kmscon_ring_free(pty->msgbuf);
+	free(pty->io_buf);
 	ev_eloop_unref(pty->eloop);
 	free(pty);
 }
@@ -119,12 +143,17 @@ static bool pty_is_open(struct kmscon_pty *pty)
 	return pty->fd >= 0;
 }
 
-static void sig_child(struct ev_eloop *eloop, struct signalfd_siginfo *info,
-			void *data);
+static void child_reap(struct ev_child *child, pid_t pid, int status,
+			void *data)
+{
+	log_debug("reaped detached child %d", pid);
+}
 
 static void pty_close(struct kmscon_pty *pty, bool user)
 {
 	bool called = true;
+	struct ev_child *reaper;
+	int ret;
 
 	if (!pty || !pty_is_open(pty))
 		return;
@@ -142,91 +171,130 @@ static void pty_close(struct kmscon_pty *pty, bool user)
 		return;
 	}
 
-	ev_eloop_unregister_signal_cb(pty->eloop, SIGCHLD, sig_child, pty);
+	/*
+	 * If the child is still running, hand it over to a detached watch so
+	 * it gets reaped once it exits due to the hangup on its pty. The
+	 * source is one-shot and owned by the eloop until then.
+	 */
+	if (pty->cwatch) {
+		ev_eloop_rm_child(pty->cwatch);
+		pty->cwatch = NULL;
+
+		ret = ev_eloop_new_child(pty->eloop, &reaper, pty->child,
+						child_reap, NULL);
+		if (ret)
+			log_warn("cannot watch detached child %d", pty->child);
+	}
+
 	close(pty->fd);
 	pty->fd = -1;
 }
 
-static void __attribute__((noreturn))
-exec_child(int pty_master)
+/*
+ * Spawning
+ * We do not fork() the child. fork() duplicates our page tables which gets
+ * expensive once we hold large glyph caches and scrollback buffers. Instead,
+ * we clone() with CLONE_VM | CLONE_VFORK so the child runs on a small separate
+ * stack inside our address space while we are suspended until it calls
+ * execve() or exits. Spawning thus takes constant time regardless of our RSS.
+ * As the child shares our memory, it must not touch any global state. Hence,
+ * everything that allocates (environment, slave name, window size) is done in
+ * the parent and the trampoline performs raw syscalls only. If one of them
+ * fails, the child stores errno in the shared spawn context so the parent can
+ * report it synchronously.
+ */
+
+#define SPAWN_STACK_SIZE (64 * 1024)
+
+struct spawn_ctx {
+	const char *slave_name;
+	const char *file;
+	char **argv;
+	char **envp;
+	int err;
+};
+
+extern char **environ;
+
+/* returns a copy of our environment with TERM set to \term */
+static char **spawn_env(const char *term)
 {
-	setenv("TERM", conf_global.term, 1);
-	execvp(conf_global.login, conf_global.argv);
+	size_t num, i, j, len;
+	char **envp, *t;
+
+	for (num = 0; environ && environ[num]; ++num)
+		/* empty */ ;
 
-	log_err("failed to exec child: %m");
+	len = strlen(term) + 6;
+	envp = malloc(sizeof(*envp) * (num + 2) + len);
+	if (!envp)
+		return NULL;
 
-	exit(EXIT_FAILURE);
+	t = (char*)&envp[num + 2];
+	snprintf(t, len, "TERM=%s", term);
+
+	for (i = 0, j = 0; i < num; ++i) {
+		if (strncmp(environ[i], "TERM=", 5))
+			envp[j++] = environ[i];
+	}
+	envp[j++] = t;
+	envp[j] = NULL;
+
+	return envp;
 }
 
-static void setup_child(int master, struct winsize *ws)
+static int spawn_child(void *data)
 {
-	int ret;
+	struct spawn_ctx *ctx = data;
+	struct sigaction sa;
 	sigset_t sigset;
-	pid_t pid;
-	char slave_name[128];
-	int slave = -1;
+	int slave, sig;
 
-	/* The child should not inherit our signal mask. */
-	sigemptyset(&sigset);
-	ret = pthread_sigmask(SIG_SETMASK, &sigset, NULL);
-	if (ret)
-		log_warn("cannot reset blocked signals: %m");
-
-	ret = grantpt(master);
-	if (ret < 0) {
-		log_err("grantpt failed: %m");
-		goto err_out;
-	}
+	/*
+	 * We share our memory with the parent, so its handlers (e.g. the crash
+	 * handlers of the trace facility) must never run here. Like
+	 * posix_spawn() we reset all caught signals to their defaults before
+	 * unblocking them. Ignored signals stay ignored. The handler table is
+	 * not shared as we do not use CLONE_SIGHAND.
+	 */
+	for (sig = 1; sig < _NSIG; ++sig) {
+		if (sigaction(sig, NULL, &sa))
+			continue;
+		if (sa.sa_handler == SIG_IGN || sa.sa_handler == SIG_DFL)
+			continue;
 
-	ret = unlockpt(master);
-	if (ret < 0) {
-		log_err("cannot unlock pty: %m");
-		goto err_out;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = SIG_DFL;
+		sigaction(sig, &sa, NULL);
 	}
 
-	ret = ptsname_r(master, slave_name, sizeof(slave_name));
-	if (ret) {
-		log_err("cannot find slave name: %m");
-		goto err_out;
-	}
+	/* The child should not inherit our signal mask. */
+	sigemptyset(&sigset);
+	sigprocmask(SIG_SETMASK, &sigset, NULL);
 
 	/* This also loses our controlling tty. */
-	pid = setsid();
-	if (pid < 0) {
-		log_err("cannot start a new session: %m");
+	if (setsid() < 0)
 		goto err_out;
-	}
 
 	/* And the slave pty becomes our controlling tty. */
-	slave = open(slave_name, O_RDWR | O_CLOEXEC);
-	if (slave < 0) {
-		log_err("cannot open slave: %m");
+	slave = open(ctx->slave_name, O_RDWR | O_CLOEXEC);
+	if (slave < 0)
 		goto err_out;
-	}
-
-	if (ws) {
-		ret = ioctl(slave, TIOCSWINSZ, ws);
-		if (ret)
-			log_warn("cannot set slave window size: %m");
-	}
 
 	if (dup2(slave, STDIN_FILENO) != STDIN_FILENO ||
 			dup2(slave, STDOUT_FILENO) != STDOUT_FILENO ||
-			dup2(slave, STDERR_FILENO) != STDERR_FILENO) {
-		log_err("cannot duplicate slave: %m");
+			dup2(slave, STDERR_FILENO) != STDERR_FILENO)
 		goto err_out;
-	}
 
-	close(master);
-	close(slave);
-	return;
+	/* the master and all our other fds are O_CLOEXEC */
+	if (slave > STDERR_FILENO)
+		close(slave);
+
+	execvpe(ctx->file, ctx->argv, ctx->envp);
 
 err_out:
-	ret = -errno;
-	if (slave >= 0)
-		close(slave);
-	close(master);
-	exit(EXIT_FAILURE);
+	ctx->err = errno;
+	_exit(EXIT_FAILURE);
 }
 
 /*
@@ -237,64 +305,275 @@ err_out:
 static int pty_spawn(struct kmscon_pty *pty, int master,
 			unsigned short width, unsigned short height)
 {
-	pid_t pid;
+	struct spawn_ctx ctx;
 	struct winsize ws;
+	char slave_name[128];
+	sigset_t sigset, oldset;
+	char *stack;
+	pid_t pid;
+	int ret;
+
+	ret = grantpt(master);
+	if (ret < 0) {
+		log_err("grantpt failed: %m");
+		return -errno;
+	}
+
+	ret = unlockpt(master);
+	if (ret < 0) {
+		log_err("cannot unlock pty: %m");
+		return -errno;
+	}
+
+	ret = ptsname_r(master, slave_name, sizeof(slave_name));
+	if (ret) {
+		log_err("cannot find slave name: %m");
+		return -errno;
+	}
 
 	memset(&ws, 0, sizeof(ws));
 	ws.ws_col = width;
 	ws.ws_row = height;
 
-	log_debug("forking child");
-	pid = fork();
-	switch (pid) {
-	case -1:
-		log_err("cannot fork: %m");
-		return -errno;
-	case 0:
-		setup_child(master, &ws);
-		exec_child(pty->fd);
-		exit(EXIT_FAILURE);
-	default:
-		pty->fd = master;
-		pty->child = pid;
-		break;
+	ret = ioctl(master, TIOCSWINSZ, &ws);
+	if (ret)
+		log_warn("cannot set slave window size: %m");
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.slave_name = slave_name;
+	ctx.file = conf_global.login;
+	ctx.argv = conf_global.argv;
+	ctx.envp = spawn_env(conf_global.term);
+	if (!ctx.envp)
+		return -ENOMEM;
+
+	stack = mmap(NULL, SPAWN_STACK_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (stack == MAP_FAILED) {
+		ret = -errno;
+		goto err_env;
+	}
+
+	/* No signal handler may run on the child's stack in our memory. */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_SETMASK, &sigset, &oldset);
+
+	log_debug("spawning child");
+	pid = clone(spawn_child, stack + SPAWN_STACK_SIZE,
+			CLONE_VM | CLONE_VFORK | SIGCHLD, &ctx);
+	if (pid < 0)
+		ret = -errno;
+
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	munmap(stack, SPAWN_STACK_SIZE);
+
+	if (pid < 0) {
+		log_err("cannot spawn child (%d): %s", ret, strerror(-ret));
+		goto err_env;
+	}
+
+	if (ctx.err) {
+		ret = -ctx.err;
+		log_err("failed to exec child %s: %s", ctx.file,
+				strerror(ctx.err));
+		waitpid(pid, NULL, 0);
+		goto err_env;
 	}
 
+	free(ctx.envp);
+	pty->fd = master;
+	pty->child = pid;
 	return 0;
+
+err_env:
+	free(ctx.envp);
+	return ret;
+}
+
+/*
+ * Recalculate the event mask of the pty fd. We poll for input unless the user
+ * throttled us and we poll for writeability only if there is pending output
+ * that is not corked.
+ */
+static void pty_update_mask(struct kmscon_pty *pty)
+{
+	int mask = 0;
+
+	if (!pty->efd)
+		return;
+
+	if (!pty->throttled)
+		mask |= EV_READABLE;
+	if (!pty->corked && !kmscon_ring_is_empty(pty->msgbuf))
+		mask |= EV_WRITEABLE;
+
+	ev_eloop_update_fd(pty->efd, mask);
 }
 
 static int send_buf(struct kmscon_pty *pty)
 {
 	const char *buf;
 	size_t len;
-	int ret;
+	int ret = 0;
 
+	if (pty->corked)
+		goto out;
+
+	/* every exit re-arms the mask so leftover data is sent on EV_WRITEABLE */
 	while ((buf = kmscon_ring_peek(pty->msgbuf, &len))) {
 		ret = write(pty->fd, buf, len);
 		if (ret > 0) {
 			kmscon_ring_drop(pty->msgbuf, ret);
+			ret = 0;
 			continue;
 		}
 
 		if (ret < 0 && errno != EWOULDBLOCK) {
 			log_warn("cannot write to child process");
-			return ret;
+			goto out;
 		}
 
 		/* EWOULDBLOCK */
-		return 0;
+		ret = 0;
+		break;
 	}
 
-	ev_eloop_update_fd(pty->efd, EV_READABLE);
-	return 0;
+out:
+	pty_update_mask(pty);
+	return ret;
+}
+
+static uint64_t pty_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Resize the input buffer between two wakeups. It is always empty here so
+ * there is no need to preserve its content. If we run out of memory we simply
+ * keep the old buffer.
+ */
+static void pty_resize_buf(struct kmscon_pty *pty, size_t size)
+{
+	char *buf;
+
+	if (size == pty->io_size)
+		return;
+
+	buf = realloc(pty->io_buf, size);
+	if (!buf)
+		return;
+
+	pty->io_buf = buf;
+	pty->io_size = size;
+}
+
+/*
+ * Read from the pty until it would block or until the per-wakeup budget is
+ * spent. The data is collected into \io_buf and handed to the input callback
+ * only when the buffer is full or when we stop reading. This coalesces bulk
+ * output into few large chunks so the terminal parses and schedules redraws
+ * less often. If the budget is spent, we simply return to the event loop; the
+ * fd is still readable so we get called again on the next dispatch, after
+ * other sources had a chance to run.
+ * If the child hung up, the eloop already stopped polling the fd so we ignore
+ * the budget and drain everything that is left.
+ * Returns 0 on success or a negative error code if the pty got closed.
+ */
+static int pty_read(struct kmscon_pty *pty, bool hup)
+{
+	ssize_t len;
+	size_t fill = 0, total = 0, budget;
+	uint64_t start = 0, time_budget;
+	bool drained = false;
+	int ret = 0;
+
+	budget = conf_global.pty_budget ? : KMSCON_NREAD;
+	time_budget = conf_global.pty_budget_time;
+	if (time_budget)
+		start = pty_now();
+
+	while (1) {
+		len = read(pty->fd, &pty->io_buf[fill], pty->io_size - fill);
+		if (len > 0) {
+			fill += len;
+			total += len;
+			if (fill == pty->io_size) {
+				pty->input_cb(pty, pty->io_buf, fill,
+						pty->data);
+				fill = 0;
+				/* input_cb may close or throttle the pty */
+				if (!pty_is_open(pty))
+					return 0;
+				if (pty->throttled && !hup)
+					break;
+			}
+
+			if (hup)
+				continue;
+			if (total >= budget)
+				break;
+			if (time_budget && pty_now() - start >= time_budget)
+				break;
+		} else if (len == 0) {
+			log_debug("child closed remote end");
+			ret = -EPIPE;
+			break;
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno == EWOULDBLOCK) {
+			drained = true;
+			break;
+		} else if (errno == EIO) {
+			/* linux returns EIO once all slaves are closed */
+			log_debug("child closed remote end");
+			ret = -EPIPE;
+			break;
+		} else {
+			log_err("cannot read from pty: %m");
+			ret = -errno;
+			break;
+		}
+	}
+
+	if (fill) {
+		pty->input_cb(pty, pty->io_buf, fill, pty->data);
+		if (!pty_is_open(pty))
+			return 0;
+	}
+
+	/*
+	 * Grow the buffer if the child produced more than one buffer full of
+	 * data during this wakeup, shrink it if we barely used it.
+	 */
+	if (!drained && total >= pty->io_size &&
+					pty->io_size < KMSCON_NREAD_MAX)
+		pty_resize_buf(pty, pty->io_size * 2);
+	else if (drained && total < pty->io_size / 8 &&
+					pty->io_size > KMSCON_NREAD)
+		pty_resize_buf(pty, pty->io_size / 2);
+
+	return ret;
 }
 
 static void pty_input(struct ev_fd *fd, int mask, void *data)
 {
 	int ret;
-	ssize_t len;
 	struct kmscon_pty *pty = data;
 
+	/* read pending data first; the child may have exited right after
+	 * writing its last output */
+	if (mask & EV_READABLE) {
+		kmscon_trace_begin(KMSCON_TRACE_PTY_INPUT, mask);
+		ret = pty_read(pty, mask & EV_HUP);
+		kmscon_trace_end(KMSCON_TRACE_PTY_INPUT);
+		if (ret)
+			goto err;
+	}
+
 	if (mask & EV_ERR) {
 		log_warn("error on child pty socket");
 		goto err;
@@ -309,37 +588,26 @@ static void pty_input(struct ev_fd *fd, int mask, void *data)
 			goto err;
 	}
 
-	if (mask & EV_READABLE) {
-		len = read(pty->fd, pty->io_buf, sizeof(pty->io_buf));
-		if (len > 0) {
-			if (pty->input_cb)
-				pty->input_cb(pty, pty->io_buf, len, pty->data);
-		} else if (len == 0) {
-			log_debug("child closed remote end");
-			goto err;
-		} else if (errno != EWOULDBLOCK) {
-			log_err("cannot read from pty: %m");
-			goto err;
-		}
-	}
-
 	return;
 
 err:
 	pty_close(pty, false);
 }
 
-static void sig_child(struct ev_eloop *eloop, struct signalfd_siginfo *info,
+static void child_exit(struct ev_child *child, pid_t pid, int status,
 			void *data)
 {
 	struct kmscon_pty *pty = data;
 
-	if (info->ssi_pid != pty->child)
-		return;
+	/* child sources are one-shot; the eloop already dropped it */
+	pty->cwatch = NULL;
 
-	log_info("child exited: pid: %u status: %d utime: %llu stime: %llu",
-			info->ssi_pid, info->ssi_status,
-			info->ssi_utime, info->ssi_stime);
+	if (WIFSIGNALED(status))
+		log_info("child exited: pid: %d signal: %d", pid,
+				WTERMSIG(status));
+	else
+		log_info("child exited: pid: %d status: %d", pid,
+				WEXITSTATUS(status));
 
 	pty_close(pty, false);
 }
@@ -367,18 +635,31 @@ int kmscon_pty_open(struct kmscon_pty *pty, unsigned short width,
 	if (ret)
 		goto err_master;
 
-	ret = ev_eloop_register_signal_cb(pty->eloop, SIGCHLD, sig_child, pty);
+	ret = pty_spawn(pty, master, width, height);
 	if (ret)
 		goto err_fd;
 
-	ret = pty_spawn(pty, master, width, height);
+	/*
+	 * Watch the child through its pidfd. Unlike a shared SIGCHLD handler
+	 * this wakes up only the pty whose child exited and cannot lose exit
+	 * notifications due to coalesced signals. Opening the pidfd after
+	 * fork() is race-free as the child stays a zombie until we reap it.
+	 * Kernels without pidfds fall back to SIGCHLD, see eloop.c.
+	 */
+	ret = ev_eloop_new_child(pty->eloop, &pty->cwatch, pty->child,
+					child_exit, pty);
 	if (ret)
-		goto err_sig;
+		goto err_child;
 
+	/* a fresh session starts without any flow-control restrictions */
+	pty->throttled = false;
+	pty->corked = false;
 	return 0;
 
-err_sig:
-	ev_eloop_unregister_signal_cb(pty->eloop, SIGCHLD, sig_child, pty);
+err_child:
+	kill(pty->child, SIGKILL);
+	waitpid(pty->child, NULL, 0);
+	pty->fd = -1;
 err_fd:
 	ev_eloop_rm_fd(pty->efd);
 	pty->efd = NULL;
@@ -402,7 +683,7 @@ int kmscon_pty_write(struct kmscon_pty *pty, const char *u8, size_t len)
 	if (!pty || !pty_is_open(pty) || !u8 || !len)
 		return -EINVAL;
 
-	if (!kmscon_ring_is_empty(pty->msgbuf))
+	if (pty->corked || !kmscon_ring_is_empty(pty->msgbuf))
 		goto buf;
 
 	ret = write(pty->fd, u8, len);
@@ -418,16 +699,47 @@ int kmscon_pty_write(struct kmscon_pty *pty, const char *u8, size_t len)
 		u8 = &u8[ret];
 	}
 
-	ev_eloop_update_fd(pty->efd, EV_READABLE | EV_WRITEABLE);
-
 buf:
 	ret = kmscon_ring_write(pty->msgbuf, u8, len);
 	if (ret)
 		log_warn("cannot allocate buffer; dropping output");
 
+	/* the buffer is sent once we are uncorked */
+	if (!pty->corked)
+		pty_update_mask(pty);
 	return 0;
 }
 
+/*
+ * Flow control
+ * kmscon_pty_throttle() stops reading from the child. The kernel buffers are
+ * limited, so the child is blocked once they are full. This bounds the amount
+ * of data we have to handle if the child produces output faster than we can
+ * parse and draw it.
+ */
+void kmscon_pty_throttle(struct kmscon_pty *pty, bool throttle)
+{
+	if (!pty || pty->throttled == throttle)
+		return;
+
+	pty->throttled = throttle;
+	pty_update_mask(pty);
+}
+
+/*
+ * kmscon_pty_cork() collects writes in the output buffer. Uncorking sends
+ * them with a single write() so a batch of keys costs one syscall.
+ */
+void kmscon_pty_cork(struct kmscon_pty *pty, bool cork)
+{
+	if (!pty || pty->corked == cork)
+		return;
+
+	pty->corked = cork;
+	if (!cork && pty_is_open(pty))
+		send_buf(pty);
+}
+
 void kmscon_pty_signal(struct kmscon_pty *pty, int signum)
 {
 	int ret;
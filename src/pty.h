@@ -35,13 +35,14 @@
  *
  * The pty can be closed voluntarily using the kmson_pty_close method. The
  * child process can also exit at will; this will be communicated through the
- * input callback. The pty object does not wait on the child processes it
- * spawns; this is the responsibility of the object's user.
+ * input callback. The pty object watches and reaps the child processes it
+ * spawns, even after it was closed by the user.
  */
 
 #ifndef KMSCON_PTY_H
 #define KMSCON_PTY_H
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include "eloop.h"
 
@@ -64,4 +65,7 @@ void kmscon_pty_signal(struct kmscon_pty *pty, int signum);
 void kmscon_pty_resize(struct kmscon_pty *pty,
 			unsigned short width, unsigned short height);
 
+void kmscon_pty_throttle(struct kmscon_pty *pty, bool throttle);
+void kmscon_pty_cork(struct kmscon_pty *pty, bool cork);
+
 #endif /* KMSCON_PTY_H */
@@ -37,20 +37,38 @@
 #include <GLES2/gl2ext.h>
 #include <stdlib.h>
 #include <string.h>
+#include "conf.h"
 #include "console.h"
 #include "eloop.h"
 #include "font.h"
 #include "gl.h"
 #include "input.h"
+#include "latency.h"
 #include "log.h"
 #include "pty.h"
 #include "terminal.h"
+#include "trace.h"
 #include "unicode.h"
 #include "uterm.h"
 #include "vte.h"
 
 #define LOG_SUBSYSTEM "terminal"
 
+/*
+ * Flow control
+ * The VTE parses pty data synchronously so the backlog between the pty and the
+ * screen is the amount of data parsed that was not presented, yet. A frame
+ * counts as presented once the page-flip of every screen it was drawn to has
+ * completed; only then is the data it contains taken off the backlog. If the
+ * backlog exceeds FLOW_HIGH_WATER, we stop reading from the pty and resume once
+ * presented frames brought it down to FLOW_LOW_WATER. The kernel pty buffers
+ * block the child meanwhile.
+ * While a page-flip is pending, redraws are deferred until it completes, so we
+ * draw at most one frame per vblank no matter how fast data arrives.
+ */
+#define FLOW_HIGH_WATER (256 * 1024)
+#define FLOW_LOW_WATER (64 * 1024)
+
 struct screen {
 	struct screen *next;
 	struct screen *prev;
@@ -58,6 +76,8 @@ struct screen {
 	struct uterm_screen *screen;
 	struct font_buffer *buf;
 	struct font_screen *fscr;
+	struct ev_fd *font_fd;
+	bool flipping;			/* waiting for a page-flip */
 };
 
 struct kmscon_terminal {
@@ -76,20 +96,54 @@ struct kmscon_terminal {
 	struct ev_idle *redraw;
 	struct kmscon_vte *vte;
 	struct kmscon_pty *pty;
+	size_t flow_pending;		/* parsed but not presented */
+	size_t flow_inflight;		/* part of it waiting for page-flips */
+	bool flow_throttled;
+	bool redraw_deferred;
+	struct kmscon_latency *latency;
 
 	kmscon_terminal_event_cb cb;
 	void *data;
 };
 
+static void schedule_redraw(struct kmscon_terminal *term);
+
+static void update_flow(struct kmscon_terminal *term)
+{
+	unsigned int flow;
+	bool throttle;
+
+	if (term->flow_pending >= FLOW_HIGH_WATER)
+		term->flow_throttled = true;
+	else if (term->flow_pending <= FLOW_LOW_WATER)
+		term->flow_throttled = false;
+
+	flow = kmscon_vte_get_flow(term->vte);
+	throttle = term->flow_throttled || (flow & KMSCON_VTE_FLOW_HOLD);
+
+	kmscon_pty_throttle(term->pty, throttle);
+}
+
 static void draw_all(struct ev_idle *idle, void *data)
 {
 	struct kmscon_terminal *term = data;
 	struct screen *iter;
 	struct uterm_screen *screen;
+	bool flipping;
 	int ret;
 
 	ev_eloop_rm_idle(idle);
 
+	for (iter = term->screens; iter; iter = iter->next) {
+		if (iter->flipping) {
+			term->redraw_deferred = true;
+			return;
+		}
+	}
+
+	kmscon_trace_begin(KMSCON_TRACE_DRAW, 0);
+	flipping = false;
+
 	iter = term->screens;
 	for (; iter; iter = iter->next) {
 		screen = iter->screen;
@@ -102,8 +156,22 @@ static void draw_all(struct ev_idle *idle, void *data)
 		glClearColor(0.0, 0.0, 0.0, 1.0);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 		kmscon_console_draw(term->console, iter->fscr);
-		uterm_screen_swap(screen);
+		if (!uterm_screen_swap(screen)) {
+			iter->flipping = true;
+			flipping = true;
+		}
 	}
+	kmscon_latency_stamp(term->latency, KMSCON_LATENCY_DRAW);
+
+	/* nothing is shown (e.g. asleep or DPMS off) so we do not wait */
+	if (flipping)
+		term->flow_inflight = term->flow_pending;
+	else
+		term->flow_pending = 0;
+	update_flow(term);
+
+	kmscon_symbol_gc();
+	kmscon_trace_end(KMSCON_TRACE_DRAW);
 }
 
 static void schedule_redraw(struct kmscon_terminal *term)
@@ -115,6 +183,39 @@ static void schedule_redraw(struct kmscon_terminal *term)
 		log_warn("terminal: cannot schedule redraw");
 }
 
+/* called when a screen completed or dropped its page-flip */
+static void flip_done(struct kmscon_terminal *term)
+{
+	struct screen *iter;
+
+	for (iter = term->screens; iter; iter = iter->next) {
+		if (iter->flipping)
+			return;
+	}
+
+	/* the last frame is presented */
+	term->flow_pending -= term->flow_inflight;
+	term->flow_inflight = 0;
+	update_flow(term);
+
+	if (term->redraw_deferred) {
+		term->redraw_deferred = false;
+		schedule_redraw(term);
+	}
+}
+
+/* glyphs that were left blank in the last frame are ready now */
+static void font_ready(struct ev_fd *fd, int mask, void *data)
+{
+	struct kmscon_terminal *term = data;
+	struct screen *iter;
+
+	for (iter = term->screens; iter; iter = iter->next)
+		font_screen_dispatch(iter->fscr);
+
+	schedule_redraw(term);
+}
+
 static int add_display(struct kmscon_terminal *term, struct uterm_display *disp)
 {
 	struct screen *scr;
@@ -144,6 +245,12 @@ static int add_display(struct kmscon_terminal *term, struct uterm_display *disp)
 	if (ret)
 		goto err_buf;
 
+	ret = ev_eloop_new_fd(term->eloop, &scr->font_fd,
+				font_screen_get_fd(scr->fscr), EV_READABLE,
+				font_ready, term);
+	if (ret)
+		goto err_font;
+
 	scr->next = term->screens;
 	if (scr->next)
 		scr->next->prev = scr;
@@ -154,6 +261,8 @@ static int add_display(struct kmscon_terminal *term, struct uterm_display *disp)
 	uterm_display_ref(scr->disp);
 	return 0;
 
+err_font:
+	font_screen_free(scr->fscr);
 err_buf:
 	font_buffer_free(scr->buf);
 err_screen:
@@ -165,6 +274,7 @@ err_free:
 
 static void free_screen(struct screen *scr)
 {
+	ev_eloop_rm_fd(scr->font_fd);
 	font_screen_free(scr->fscr);
 	font_buffer_free(scr->buf);
 	uterm_screen_unref(scr->screen);
@@ -193,6 +303,7 @@ static void rm_display(struct kmscon_terminal *term, struct uterm_display *disp)
 
 	log_debug("removed display %p from terminal %p", disp, term);
 	free_screen(scr);
+	flip_done(term);
 	if (!term->screens && term->cb)
 		term->cb(term, KMSCON_TERMINAL_NO_DISPLAY, term->data);
 }
@@ -216,7 +327,11 @@ static void pty_input(struct kmscon_pty *pty, const char *u8, size_t len,
 		if (term->cb)
 			term->cb(term, KMSCON_TERMINAL_HUP, term->data);
 	} else {
+		kmscon_latency_stamp(term->latency, KMSCON_LATENCY_ECHO);
 		kmscon_vte_input(term->vte, u8, len);
+		kmscon_latency_stamp(term->latency, KMSCON_LATENCY_PARSE);
+		term->flow_pending += len;
+		update_flow(term);
 		schedule_redraw(term);
 	}
 }
@@ -227,8 +342,20 @@ static void video_event(struct uterm_video *video,
 {
 	struct kmscon_terminal *term = data;
 
-	if (ev->action == UTERM_GONE)
+	struct screen *iter;
+
+	if (ev->action == UTERM_GONE) {
 		rm_display(term, ev->display);
+	} else if (ev->action == UTERM_PAGE_FLIP) {
+		kmscon_latency_stamp(term->latency, KMSCON_LATENCY_FLIP);
+		for (iter = term->screens; iter; iter = iter->next) {
+			if (iter->disp == ev->display && iter->flipping) {
+				iter->flipping = false;
+				flip_done(term);
+				break;
+			}
+		}
+	}
 }
 
 static void input_event(struct kmscon_input *input,
@@ -243,15 +370,24 @@ static void input_event(struct kmscon_input *input,
 	if (!term->opened)
 		return;
 
+	/* send all keys of an evdev frame with a single write */
+	if (ev->more)
+		kmscon_pty_cork(term->pty, true);
+
 	ret = kmscon_vte_handle_keyboard(term->vte, ev, &u8, &len);
+	update_flow(term);
 	switch (ret) {
 		case KMSCON_VTE_SEND:
-			kmscon_pty_write(term->pty, u8, len);
+			if (!kmscon_pty_write(term->pty, u8, len))
+				kmscon_latency_write(term->latency, ev->time);
 			break;
 		case KMSCON_VTE_DROP:
 		default:
 			break;
 	}
+
+	if (!ev->more)
+		kmscon_pty_cork(term->pty, false);
 }
 
 int kmscon_terminal_new(struct kmscon_terminal **out,
@@ -296,9 +432,15 @@ int kmscon_terminal_new(struct kmscon_terminal **out,
 	if (ret)
 		goto err_pty;
 
+	if (conf_global.latency) {
+		ret = kmscon_latency_new(&term->latency);
+		if (ret)
+			goto err_shader;
+	}
+
 	ret = uterm_video_register_cb(term->video, video_event, term);
 	if (ret)
-		goto err_shader;
+		goto err_latency;
 
 	ret = kmscon_input_register_cb(term->input, input_event, term);
 	if (ret)
@@ -314,6 +456,8 @@ int kmscon_terminal_new(struct kmscon_terminal **out,
 
 err_video:
 	uterm_video_unregister_cb(term->video, video_event, term);
+err_latency:
+	kmscon_latency_free(term->latency);
 err_shader:
 	gl_shader_unref(term->shader);
 err_pty:
@@ -350,6 +494,7 @@ void kmscon_terminal_unref(struct kmscon_terminal *term)
 	rm_all_screens(term);
 	kmscon_input_unregister_cb(term->input, input_event, term);
 	uterm_video_unregister_cb(term->video, video_event, term);
+	kmscon_latency_free(term->latency);
 	gl_shader_unref(term->shader);
 	kmscon_pty_unref(term->pty);
 	kmscon_vte_unref(term->vte);
@@ -377,6 +522,11 @@ int kmscon_terminal_open(struct kmscon_terminal *term,
 	if (ret)
 		return ret;
 
+	kmscon_vte_reset_flow(term->vte);
+	term->flow_pending = 0;
+	term->flow_inflight = 0;
+	update_flow(term);
+
 	term->opened = true;
 	term->cb = cb;
 	term->data = data;
@@ -0,0 +1,402 @@
+/*
+ * kmscon - Event Tracing
+ *
+ * Copyright (c) 2012 David Herrmann <dh.herrmann@googlemail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Event Tracing
+ * Each thread allocates its ring on its first event and links it into a global
+ * list. Rings are never freed so events of exited threads can still be dumped.
+ * The owning thread is the only writer; it publishes a record by incrementing
+ * the ring position. A dump running concurrently may therefore catch a
+ * half-written record, which is acceptable for a trace.
+ * kmscon_trace_dump() only uses async-signal-safe functions and does not lock
+ * so it can run from the crash handler.
+ *
+ * The dump file uses host byte order:
+ *   header:    "KMSTRACE", u32 version, u32 pid, u32 event count,
+ *              u32 record size
+ *   names:     per event: name, arg0 name, arg1 name; TRACE_NAME_MAX bytes each
+ *   per ring:  u32 thread ID, u32 record count, records oldest first
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "trace.h"
+
+#define LOG_SUBSYSTEM "trace"
+
+#define TRACE_MAGIC "KMSTRACE"
+#define TRACE_VERSION 1
+#define TRACE_NAME_MAX 16
+
+struct trace_record {
+	uint64_t time;			/* nsecs of CLOCK_MONOTONIC */
+	uint16_t event;
+	uint16_t phase;
+	uint32_t pad;
+	uint64_t args[2];
+};
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t pid;
+	uint32_t event_num;
+	uint32_t rec_size;
+};
+
+struct trace_block {
+	uint32_t tid;
+	uint32_t num;
+};
+
+struct trace_ring {
+	struct trace_ring *next;
+	uint32_t tid;
+	unsigned long pos;
+	struct trace_record recs[KMSCON_TRACE_RING];
+};
+
+static const char trace_names[KMSCON_TRACE_EVENT_NUM][3][TRACE_NAME_MAX] = {
+	[KMSCON_TRACE_KEY] = { "key", "code", "value" },
+	[KMSCON_TRACE_PTY_INPUT] = { "pty-input", "mask", "" },
+	[KMSCON_TRACE_VTE_INPUT] = { "vte-input", "bytes", "" },
+	[KMSCON_TRACE_SCROLL] = { "scroll", "lines", "" },
+	[KMSCON_TRACE_DRAW] = { "draw", "", "" },
+	[KMSCON_TRACE_SWAP] = { "swap", "", "" },
+	[KMSCON_TRACE_FLIP] = { "flip", "frame", "" },
+};
+
+static const int trace_signals[] = {
+	SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT,
+};
+
+bool kmscon_trace_enabled;
+
+static __thread struct trace_ring *trace_ring;
+static struct trace_ring *trace_rings;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char trace_file[PATH_MAX];
+static struct sigaction trace_oldact[sizeof(trace_signals) /
+					sizeof(*trace_signals)];
+
+static struct trace_ring *trace_ring_new(void)
+{
+	struct trace_ring *ring;
+
+	ring = malloc(sizeof(*ring));
+	if (!ring)
+		return NULL;
+	memset(ring, 0, sizeof(*ring));
+	ring->tid = syscall(SYS_gettid);
+
+	pthread_mutex_lock(&trace_mutex);
+	ring->next = trace_rings;
+	__atomic_store_n(&trace_rings, ring, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trace_mutex);
+
+	trace_ring = ring;
+	return ring;
+}
+
+void kmscon_trace_record(enum kmscon_trace_event event,
+				enum kmscon_trace_phase phase,
+				uint64_t arg0, uint64_t arg1)
+{
+	struct trace_ring *ring = trace_ring;
+	struct trace_record *rec;
+	struct timespec ts;
+
+	if (!ring) {
+		ring = trace_ring_new();
+		if (!ring)
+			return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	rec = &ring->recs[ring->pos % KMSCON_TRACE_RING];
+	rec->time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec->event = event;
+	rec->phase = phase;
+	rec->args[0] = arg0;
+	rec->args[1] = arg1;
+
+	__atomic_store_n(&ring->pos, ring->pos + 1, __ATOMIC_RELEASE);
+}
+
+static int trace_write(int fd, const void *data, size_t size)
+{
+	const char *buf = data;
+	ssize_t len;
+
+	while (size) {
+		len = write(fd, buf, size);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += len;
+		size -= len;
+	}
+
+	return 0;
+}
+
+static int trace_write_ring(int fd, struct trace_ring *ring)
+{
+	struct trace_block block;
+	unsigned long pos, start, first;
+	size_t num;
+	int ret;
+
+	pos = __atomic_load_n(&ring->pos, __ATOMIC_ACQUIRE);
+	num = pos < KMSCON_TRACE_RING ? pos : KMSCON_TRACE_RING;
+	start = pos - num;
+
+	block.tid = ring->tid;
+	block.num = num;
+	ret = trace_write(fd, &block, sizeof(block));
+	if (ret)
+		return ret;
+
+	/* the oldest records may wrap around the end of the ring */
+	first = start % KMSCON_TRACE_RING;
+	if (first + num > KMSCON_TRACE_RING) {
+		ret = trace_write(fd, &ring->recs[first],
+				(KMSCON_TRACE_RING - first) * sizeof(*ring->recs));
+		if (ret)
+			return ret;
+		num -= KMSCON_TRACE_RING - first;
+		first = 0;
+	}
+
+	return trace_write(fd, &ring->recs[first], num * sizeof(*ring->recs));
+}
+
+int kmscon_trace_dump(const char *file)
+{
+	struct trace_header hdr;
+	struct trace_ring *ring;
+	int fd, ret, saved_errno = errno;
+
+	if (!file)
+		file = trace_file;
+	if (!*file)
+		return -EINVAL;
+
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TRACE_VERSION;
+	hdr.pid = getpid();
+	hdr.event_num = KMSCON_TRACE_EVENT_NUM;
+	hdr.rec_size = sizeof(struct trace_record);
+
+	ret = trace_write(fd, &hdr, sizeof(hdr));
+	if (ret)
+		goto out_close;
+	ret = trace_write(fd, trace_names, sizeof(trace_names));
+	if (ret)
+		goto out_close;
+
+	ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+	for ( ; ring; ring = ring->next) {
+		ret = trace_write_ring(fd, ring);
+		if (ret)
+			goto out_close;
+	}
+
+out_close:
+	close(fd);
+out:
+	errno = saved_errno;
+	return ret;
+}
+
+static void trace_crash(int sig)
+{
+	/* SA_RESETHAND restored the default action for the re-raise */
+	kmscon_trace_dump(NULL);
+	raise(sig);
+}
+
+int kmscon_trace_start(const char *file)
+{
+	struct sigaction act;
+	unsigned int i;
+
+	if (!file || !*file)
+		return -EINVAL;
+	if (strlen(file) >= sizeof(trace_file))
+		return -ENAMETOOLONG;
+	if (kmscon_trace_enabled)
+		return -EALREADY;
+
+	strcpy(trace_file, file);
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = trace_crash;
+	act.sa_flags = SA_RESETHAND;
+	sigemptyset(&act.sa_mask);
+	for (i = 0; i < sizeof(trace_signals) / sizeof(*trace_signals); ++i)
+		sigaction(trace_signals[i], &act, &trace_oldact[i]);
+
+	kmscon_trace_enabled = true;
+	log_info("tracing events into %s", trace_file);
+
+	return 0;
+}
+
+void kmscon_trace_stop(void)
+{
+	unsigned int i;
+
+	if (!kmscon_trace_enabled)
+		return;
+
+	kmscon_trace_enabled = false;
+	for (i = 0; i < sizeof(trace_signals) / sizeof(*trace_signals); ++i)
+		sigaction(trace_signals[i], &trace_oldact[i], NULL);
+}
+
+/* prints the named arguments of \rec as JSON object */
+static void trace_json_args(FILE *out, const struct trace_record *rec,
+				char (*names)[3][TRACE_NAME_MAX])
+{
+	unsigned int i;
+	bool first = true;
+
+	fprintf(out, ",\"args\":{");
+	for (i = 0; i < 2; ++i) {
+		if (!names[rec->event][i + 1][0])
+			continue;
+		fprintf(out, "%s\"%.*s\":%" PRIu64, first ? "" : ",",
+			TRACE_NAME_MAX, names[rec->event][i + 1],
+			rec->args[i]);
+		first = false;
+	}
+	fprintf(out, "}");
+}
+
+int kmscon_trace_to_json(const char *file, FILE *out)
+{
+	static const char phases[] = { 'B', 'E', 'i' };
+	char (*names)[3][TRACE_NAME_MAX] = NULL;
+	struct trace_header hdr;
+	struct trace_block block;
+	struct trace_record rec;
+	FILE *in;
+	uint32_t i;
+	bool first = true;
+	int ret = 0;
+
+	if (!file || !out)
+		return -EINVAL;
+
+	in = fopen(file, "rb");
+	if (!in) {
+		log_err("cannot open trace %s (%d): %m", file, errno);
+		return -errno;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+	    memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != TRACE_VERSION ||
+	    hdr.rec_size != sizeof(rec) || !hdr.event_num) {
+		log_err("invalid trace file %s", file);
+		ret = -EINVAL;
+		goto err_in;
+	}
+
+	names = malloc(sizeof(*names) * hdr.event_num);
+	if (!names) {
+		ret = -ENOMEM;
+		goto err_in;
+	}
+
+	if (fread(names, sizeof(*names), hdr.event_num, in) != hdr.event_num) {
+		log_err("truncated trace file %s", file);
+		ret = -EINVAL;
+		goto err_names;
+	}
+
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+	while (fread(&block, sizeof(block), 1, in) == 1) {
+		for (i = 0; i < block.num; ++i) {
+			if (fread(&rec, sizeof(rec), 1, in) != 1) {
+				log_warn("truncated trace file %s", file);
+				goto done;
+			}
+			if (rec.event >= hdr.event_num ||
+			    rec.phase >= sizeof(phases))
+				continue;
+
+			fprintf(out, "%s\n{\"name\":\"%.*s\",\"ph\":\"%c\","
+				"\"ts\":%" PRIu64 ".%03u,\"pid\":%u,"
+				"\"tid\":%u",
+				first ? "" : ",",
+				TRACE_NAME_MAX, names[rec.event][0],
+				phases[rec.phase], rec.time / 1000,
+				(unsigned int)(rec.time % 1000), hdr.pid,
+				block.tid);
+			/* arguments of end events would replace the ones
+			 * of the slice */
+			if (rec.phase == KMSCON_TRACE_INSTANT)
+				fprintf(out, ",\"s\":\"t\"");
+			if (rec.phase != KMSCON_TRACE_END)
+				trace_json_args(out, &rec, names);
+			fprintf(out, "}");
+			first = false;
+		}
+	}
+
+done:
+	fprintf(out, "\n]}\n");
+
+err_names:
+	free(names);
+err_in:
+	fclose(in);
+	return ret;
+}
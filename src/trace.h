@@ -0,0 +1,102 @@
+/*
+ * kmscon - Event Tracing
+ *
+ * Copyright (c) 2012 David Herrmann <dh.herrmann@googlemail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Event Tracing
+ * Hot paths record fixed-size binary events into a ring of the current thread.
+ * An event is a timestamp, an event ID and up to two arguments and costs a
+ * clock_gettime() plus a 32 byte store. While tracing is disabled it costs a
+ * single branch. Each ring keeps the last KMSCON_TRACE_RING events of its
+ * thread.
+ *
+ * kmscon_trace_start() enables tracing and installs a crash handler which
+ * dumps all rings into the given file. kmscon_trace_dump() does the same on
+ * demand. kmscon_trace_to_json() converts such a file into the Chrome trace
+ * event format which can be loaded into chrome://tracing or Perfetto.
+ *
+ * kmscon_trace_begin() and kmscon_trace_end() enclose a slice of work,
+ * kmscon_trace_point() records a single instant.
+ */
+
+#ifndef KMSCON_TRACE_H
+#define KMSCON_TRACE_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define KMSCON_TRACE_RING 4096
+
+enum kmscon_trace_event {
+	KMSCON_TRACE_KEY,		/* key event: code, value */
+	KMSCON_TRACE_PTY_INPUT,		/* pty wakeup: mask */
+	KMSCON_TRACE_VTE_INPUT,		/* vte parser run: bytes */
+	KMSCON_TRACE_SCROLL,		/* buffer scrolled up: lines */
+	KMSCON_TRACE_DRAW,		/* redraw of all displays */
+	KMSCON_TRACE_SWAP,		/* display swap */
+	KMSCON_TRACE_FLIP,		/* page flip completed: frame */
+	KMSCON_TRACE_EVENT_NUM,
+};
+
+enum kmscon_trace_phase {
+	KMSCON_TRACE_BEGIN,
+	KMSCON_TRACE_END,
+	KMSCON_TRACE_INSTANT,
+};
+
+extern bool kmscon_trace_enabled;
+
+void kmscon_trace_record(enum kmscon_trace_event event,
+				enum kmscon_trace_phase phase,
+				uint64_t arg0, uint64_t arg1);
+
+static inline void kmscon_trace_begin(enum kmscon_trace_event event,
+					uint64_t arg0)
+{
+	if (kmscon_trace_enabled)
+		kmscon_trace_record(event, KMSCON_TRACE_BEGIN, arg0, 0);
+}
+
+static inline void kmscon_trace_end(enum kmscon_trace_event event)
+{
+	if (kmscon_trace_enabled)
+		kmscon_trace_record(event, KMSCON_TRACE_END, 0, 0);
+}
+
+static inline void kmscon_trace_point(enum kmscon_trace_event event,
+					uint64_t arg0, uint64_t arg1)
+{
+	if (kmscon_trace_enabled)
+		kmscon_trace_record(event, KMSCON_TRACE_INSTANT, arg0, arg1);
+}
+
+int kmscon_trace_start(const char *file);
+void kmscon_trace_stop(void);
+int kmscon_trace_dump(const char *file);
+
+int kmscon_trace_to_json(const char *file, FILE *out);
+
+#endif /* KMSCON_TRACE_H */
@@ -51,10 +51,9 @@
 /*
  * Unicode Handling
  * Main implementation of the symbol datatype. The symbol table contains two-way
- * references. The Hash Table contains all the symbols with the symbol ucs4
- * string as key and the symbol ID as value.
- * The index array contains the symbol ID as key and a pointer to the ucs4
- * string as value. But the hash table owns the ucs4 string.
+ * references. The index maps a symbol ID to its table entry which contains the
+ * ucs4 string. The hash table maps a ucs4 string to its symbol ID and is used
+ * to avoid duplicates when appending characters to symbols.
  * This allows fast implementations of *_get() and *_append() without long
  * search intervals.
  *
@@ -62,72 +61,117 @@
  * do not add it to our symbol table as it is only one character. However, if a
  * character is appended to an existing symbol, we create a new ucs4 string and
  * push the new symbol into the symbol table.
+ *
+ * The table is read-mostly: the parser appends symbols rarely compared to how
+ * often the renderers look them up. Therefore, lookups never take a lock.
+ * Writers are serialized by \table_mutex and publish new data with release
+ * semantics; readers load it with acquire semantics:
+ *  - The index is an array of fixed-size segments. Segments and entries are
+ *    allocated before their pointers are published and never move, so a
+ *    reader that sees an entry pointer sees the whole entry.
+ *  - The hash table uses open addressing with linear probing and stores
+ *    symbol IDs only. A slot is written once with an ID and at most once more
+ *    with a tombstone when the symbol is collected. If live symbols and
+ *    tombstones fill half of the table, a writer creates a fresh copy and
+ *    publishes it. Old copies may still be used by readers so they are kept
+ *    on a retired-list.
+ * Hence, kmscon_symbol_get() and the dedup-lookup of kmscon_symbol_append()
+ * are wait-free and only creating a new composed symbol takes the mutex.
+ *
+ * Composed symbols are reclaimed by a mark-and-sweep collector. Every owner of
+ * symbols (console buffers, glyph caches) registers a marker. Once the table
+ * has grown enough since the last run, kmscon_symbol_gc() starts a new
+ * generation, calls all markers which call kmscon_symbol_mark() on every symbol
+ * they still hold, and then frees all entries that were not marked. Their IDs
+ * are recycled. As readers might still look at removed entries and retired
+ * hash tables, these are freed only by the collection after the next one.
+ * The collector must run on the thread that creates composed symbols so no
+ * symbol can be handed out while its entry is swept.
  */
 
-/* TODO: Remove the glib dependencies */
-
 #include <errno.h>
-#include <glib.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include "log.h"
-#include "misc.h"
 #include "unicode.h"
 
 #define LOG_SUBSYSTEM "unicode"
 
 #define KMSCON_UCS4_MAXLEN 10
-#define KMSCON_UCS4_MAX 0x7fffffffUL
 #define KMSCON_UCS4_INVALID 0xfffd
 
+/* index segments; limits the table to 4M composed symbols */
+#define TABLE_SEG_BITS 10
+#define TABLE_SEG_SIZE (1UL << TABLE_SEG_BITS)
+#define TABLE_SEG_MAX 4096
+
+/* initial number of hash slots; must be a power of two */
+#define TABLE_HASH_MIN 256
+
+/* hash slot of a collected symbol; never a valid ID */
+#define TABLE_TOMBSTONE UINT32_MAX
+
+/* collect if the table doubled since the last run and has this many symbols */
+#define TABLE_GC_MIN 1024
+
 const kmscon_symbol_t kmscon_symbol_default = 0;
-static const char default_u8[] = { 0 };
 
-static pthread_mutex_t table_mutex = PTHREAD_MUTEX_INITIALIZER;
-static uint32_t table_next_id;
-static GArray *table_index;
-static struct kmscon_hashtable *table_symbols;
+struct table_entry {
+	struct table_entry *next;	/* dead-list */
+	unsigned int gen;		/* generation of the last mark */
+	unsigned int hash;
+	size_t len;
+	uint32_t ucs4[];		/* terminated by KMSCON_UCS4_MAX + 1 */
+};
+
+struct table_hash {
+	struct table_hash *next;	/* retired-list */
+	size_t size;
+	uint32_t slots[];		/* symbol IDs; 0 marks empty slots */
+};
 
-static guint hash_ucs4(gconstpointer key)
+struct table_marker {
+	struct table_marker *next;
+	kmscon_symbol_mark_cb cb;
+	void *data;
+};
+
+static pthread_mutex_t table_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t table_next_id = KMSCON_UCS4_MAX + 2;
+static size_t table_used;
+static size_t table_tombs;
+static struct table_entry **table_index[TABLE_SEG_MAX];
+static struct table_hash *table_hash;
+
+/* removed data; freed by the collection after the next one */
+static struct table_hash *table_retired;
+static struct table_hash *table_retired_old;
+static struct table_entry *table_dead;
+static struct table_entry *table_dead_old;
+
+/* collector state */
+static struct table_marker *table_markers;
+static unsigned int table_gen;
+static size_t table_gc_next = TABLE_GC_MIN;
+static uint32_t *table_free_ids;
+static size_t table_free_num;
+static size_t table_free_size;
+static struct kmscon_symbol_stats table_stats;
+
+static unsigned int hash_ucs4(const uint32_t *ucs4, size_t len)
 {
-	guint val = 5381;
+	unsigned int val = 5381;
 	size_t i;
-	const uint32_t *ucs4 = key;
 
-	i = 0;
-	while (ucs4[i] <= KMSCON_UCS4_MAX) {
+	for (i = 0; i < len; ++i)
 		val = val * 33 + ucs4[i];
-		++i;
-	}
 
 	return val;
 }
 
-static gboolean cmp_ucs4(gconstpointer a, gconstpointer b)
-{
-	size_t i;
-	const uint32_t *v1, *v2;
-
-	v1 = a;
-	v2 = b;
-	i = 0;
-
-	while (1) {
-		if (v1[i] > KMSCON_UCS4_MAX && v2[i] > KMSCON_UCS4_MAX)
-			return TRUE;
-		if (v1[i] > KMSCON_UCS4_MAX && v2[i] <= KMSCON_UCS4_MAX)
-			return FALSE;
-		if (v1[i] <= KMSCON_UCS4_MAX && v2[i] > KMSCON_UCS4_MAX)
-			return FALSE;
-		if (v1[i] != v2[i])
-			return FALSE;
-
-		++i;
-	}
-}
-
 static void table_lock()
 {
 	pthread_mutex_lock(&table_mutex);
@@ -138,35 +182,257 @@ static void table_unlock()
 	pthread_mutex_unlock(&table_mutex);
 }
 
-static int table__init()
+static const struct table_entry *table_get_entry(kmscon_symbol_t sym)
 {
-	static const uint32_t *val = NULL; /* we need an lvalue for glib */
-	int ret;
+	struct table_entry **seg;
+	uint32_t id;
+
+	id = sym - (KMSCON_UCS4_MAX + 1);
+	if ((id >> TABLE_SEG_BITS) >= TABLE_SEG_MAX)
+		return NULL;
+
+	seg = __atomic_load_n(&table_index[id >> TABLE_SEG_BITS],
+				__ATOMIC_ACQUIRE);
+	if (!seg)
+		return NULL;
 
-	if (table_symbols)
+	return __atomic_load_n(&seg[id & (TABLE_SEG_SIZE - 1)],
+				__ATOMIC_ACQUIRE);
+}
+
+/* returns the symbol ID of \ucs4 or 0 if it is not in the table */
+static kmscon_symbol_t table_find(const uint32_t *ucs4, size_t len,
+					unsigned int hash)
+{
+	const struct table_hash *h;
+	const struct table_entry *ent;
+	size_t i, mask;
+	uint32_t id;
+
+	h = __atomic_load_n(&table_hash, __ATOMIC_ACQUIRE);
+	if (!h)
 		return 0;
 
-	table_next_id = KMSCON_UCS4_MAX + 2;
+	mask = h->size - 1;
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		id = __atomic_load_n(&h->slots[i], __ATOMIC_ACQUIRE);
+		if (!id)
+			return 0;
 
-	table_index = g_array_new(FALSE, TRUE, sizeof(uint32_t*));
-	if (!table_index) {
-		log_err("cannot allocate table-index");
-		return -ENOMEM;
+		ent = table_get_entry(id);
+		if (ent && ent->hash == hash && ent->len == len &&
+				!memcmp(ent->ucs4, ucs4, len * sizeof(*ucs4)))
+			return id;
 	}
+}
 
-	/* first entry is not used so add dummy */
-	g_array_append_val(table_index, val);
+static void table__hash_add(struct table_hash *h, uint32_t id,
+				unsigned int hash)
+{
+	size_t i, mask;
+
+	mask = h->size - 1;
+	for (i = hash & mask; h->slots[i]; i = (i + 1) & mask)
+		/* empty */ ;
 
-	ret = kmscon_hashtable_new(&table_symbols, hash_ucs4, cmp_ucs4,
-					free, NULL);
-	if (ret) {
-		g_array_unref(table_index);
+	__atomic_store_n(&h->slots[i], id, __ATOMIC_RELEASE);
+}
+
+/*
+ * Make room for one more symbol. Live symbols and tombstones fill the hash table
+ * at most half. If this is exceeded, the table is rebuilt without tombstones
+ * and sized so that it is at most a quarter full afterwards.
+ */
+static int table__reserve()
+{
+	struct table_hash *h;
+	const struct table_entry *ent;
+	size_t size, i;
+	uint32_t id;
+
+	if (table_hash &&
+			(table_used + table_tombs + 1) * 2 <= table_hash->size)
+		return 0;
+
+	size = TABLE_HASH_MIN;
+	while ((table_used + 1) * 4 > size)
+		size *= 2;
+
+	h = malloc(sizeof(*h) + sizeof(*h->slots) * size);
+	if (!h)
 		return -ENOMEM;
+	memset(h, 0, sizeof(*h) + sizeof(*h->slots) * size);
+	h->size = size;
+
+	if (table_hash) {
+		for (i = 0; i < table_hash->size; ++i) {
+			id = table_hash->slots[i];
+			ent = id ? table_get_entry(id) : NULL;
+			if (ent)
+				table__hash_add(h, id, ent->hash);
+		}
+
+		/* readers may still use the old table */
+		table_hash->next = table_retired;
+		table_retired = table_hash;
 	}
 
+	__atomic_store_n(&table_hash, h, __ATOMIC_RELEASE);
+	table_tombs = 0;
 	return 0;
 }
 
+static uint32_t table__alloc_id()
+{
+	uint32_t id;
+
+	if (table_free_num)
+		return table_free_ids[--table_free_num];
+
+	id = table_next_id;
+	if (((id - (KMSCON_UCS4_MAX + 1)) >> TABLE_SEG_BITS) >= TABLE_SEG_MAX)
+		return 0;
+
+	++table_next_id;
+	return id;
+}
+
+static void table__free_id(uint32_t id)
+{
+	uint32_t *tmp;
+	size_t size;
+
+	if (table_free_num >= table_free_size) {
+		size = table_free_size ? table_free_size * 2 : 64;
+		tmp = realloc(table_free_ids, sizeof(*tmp) * size);
+		if (!tmp)
+			return;	/* the ID is lost but nothing else breaks */
+		table_free_ids = tmp;
+		table_free_size = size;
+	}
+
+	table_free_ids[table_free_num++] = id;
+}
+
+static kmscon_symbol_t table__add(const uint32_t *ucs4, size_t len,
+					unsigned int hash)
+{
+	struct table_entry *ent, **seg;
+	uint32_t id, idx;
+
+	if (table__reserve())
+		return 0;
+
+	id = table__alloc_id();
+	if (!id) {
+		log_warn("symbol table is full");
+		return 0;
+	}
+	idx = id - (KMSCON_UCS4_MAX + 1);
+
+	seg = table_index[idx >> TABLE_SEG_BITS];
+	if (!seg) {
+		seg = calloc(TABLE_SEG_SIZE, sizeof(*seg));
+		if (!seg)
+			goto err_id;
+		__atomic_store_n(&table_index[idx >> TABLE_SEG_BITS], seg,
+					__ATOMIC_RELEASE);
+	}
+
+	ent = malloc(sizeof(*ent) + sizeof(*ucs4) * (len + 1));
+	if (!ent)
+		goto err_id;
+
+	ent->next = NULL;
+	ent->gen = table_gen;
+	ent->hash = hash;
+	ent->len = len;
+	memcpy(ent->ucs4, ucs4, sizeof(*ucs4) * len);
+	ent->ucs4[len] = KMSCON_UCS4_MAX + 1;
+
+	/* publish the entry before its ID becomes visible in the hash */
+	__atomic_store_n(&seg[idx & (TABLE_SEG_SIZE - 1)], ent,
+				__ATOMIC_RELEASE);
+	table__hash_add(table_hash, id, hash);
+
+	++table_used;
+	return id;
+
+err_id:
+	table__free_id(id);
+	return 0;
+}
+
+static void table__remove(uint32_t id, struct table_entry **slot)
+{
+	struct table_entry *ent = *slot;
+	size_t i, mask;
+
+	mask = table_hash->size - 1;
+	for (i = ent->hash & mask; table_hash->slots[i]; i = (i + 1) & mask) {
+		if (table_hash->slots[i] == id) {
+			__atomic_store_n(&table_hash->slots[i], TABLE_TOMBSTONE,
+						__ATOMIC_RELEASE);
+			++table_tombs;
+			break;
+		}
+	}
+
+	__atomic_store_n(slot, NULL, __ATOMIC_RELEASE);
+	ent->next = table_dead;
+	table_dead = ent;
+
+	table__free_id(id);
+	--table_used;
+}
+
+/* frees all data that was removed before the previous collection */
+static void table__free_dead()
+{
+	struct table_entry *ent;
+	struct table_hash *h;
+
+	while ((ent = table_dead_old)) {
+		table_dead_old = ent->next;
+		free(ent);
+	}
+	while ((h = table_retired_old)) {
+		table_retired_old = h->next;
+		free(h);
+	}
+
+	table_dead_old = table_dead;
+	table_dead = NULL;
+	table_retired_old = table_retired;
+	table_retired = NULL;
+}
+
+static size_t table__sweep()
+{
+	struct table_entry **seg, *ent;
+	uint32_t idx, num;
+	size_t freed = 0;
+
+	num = table_next_id - (KMSCON_UCS4_MAX + 1);
+	for (idx = 0; idx < num; ++idx) {
+		seg = table_index[idx >> TABLE_SEG_BITS];
+		if (!seg) {
+			idx |= TABLE_SEG_SIZE - 1;
+			continue;
+		}
+
+		ent = seg[idx & (TABLE_SEG_SIZE - 1)];
+		if (!ent || ent->gen == table_gen)
+			continue;
+
+		table__remove(idx + KMSCON_UCS4_MAX + 1,
+				&seg[idx & (TABLE_SEG_SIZE - 1)]);
+		++freed;
+	}
+
+	return freed;
+}
+
 kmscon_symbol_t kmscon_symbol_make(uint32_t ucs4)
 {
 	if (ucs4 > KMSCON_UCS4_MAX) {
@@ -183,14 +449,18 @@ kmscon_symbol_t kmscon_symbol_make(uint32_t ucs4)
  * Therefore, the returned value may get destroyed if your \sym argument gets
  * destroyed.
  * If \sym is a composed ucs4 string, then the returned value points into the
- * hash table of the symbol table and lives as long as the symbol table does.
+ * symbol table. It is only valid while \sym is held by an owner whose marker
+ * marks it. Once no marker marks \sym any more, the collector frees its entry
+ * two collections later and the pointer dangles. Copy the string if you need
+ * it longer.
  *
  * This always returns a valid value. If an error happens, the default character
  * is returned. If \size is NULL, then the size value is omitted.
+ * This never blocks and is safe to call from any thread.
  */
-static const uint32_t *table__get(kmscon_symbol_t *sym, size_t *size)
+const uint32_t *kmscon_symbol_get(kmscon_symbol_t *sym, size_t *size)
 {
-	uint32_t *ucs4;
+	const struct table_entry *ent;
 
 	if (*sym <= KMSCON_UCS4_MAX) {
 		if (size)
@@ -198,120 +468,194 @@ static const uint32_t *table__get(kmscon_symbol_t *sym, size_t *size)
 		return sym;
 	}
 
-	if (table__init()) {
+	ent = table_get_entry(*sym);
+	if (!ent) {
 		if (size)
 			*size = 1;
 		return &kmscon_symbol_default;
 	}
 
-	ucs4 = g_array_index(table_index, uint32_t*,
-				*sym - (KMSCON_UCS4_MAX + 1));
-	if (!ucs4) {
-		if (size)
-			*size = 1;
-		return &kmscon_symbol_default;
+	if (size)
+		*size = ent->len;
+	return ent->ucs4;
+}
+
+kmscon_symbol_t kmscon_symbol_append(kmscon_symbol_t sym, uint32_t ucs4)
+{
+	uint32_t buf[KMSCON_UCS4_MAXLEN + 1];
+	const uint32_t *ptr;
+	size_t s;
+	unsigned int hash;
+	kmscon_symbol_t rsym;
+
+	if (ucs4 > KMSCON_UCS4_MAX) {
+		log_warn("invalid ucs4 character");
+		return sym;
 	}
 
-	if (size) {
-		*size = 0;
-		while (ucs4[*size] <= KMSCON_UCS4_MAX)
-			++*size;
+	ptr = kmscon_symbol_get(&sym, &s);
+	if (s >= KMSCON_UCS4_MAXLEN)
+		return sym;
+
+	memcpy(buf, ptr, s * sizeof(uint32_t));
+	buf[s++] = ucs4;
+	hash = hash_ucs4(buf, s);
+
+	/* fast path: the symbol already exists */
+	rsym = table_find(buf, s, hash);
+	if (rsym)
+		return rsym;
+
+	table_lock();
+
+	/* somebody else might have added it meanwhile */
+	rsym = table_find(buf, s, hash);
+	if (!rsym) {
+		log_debug("adding new composed symbol");
+		rsym = table__add(buf, s, hash);
 	}
 
-	return ucs4;
+	table_unlock();
+
+	return rsym ? rsym : sym;
 }
 
-const uint32_t *kmscon_symbol_get(kmscon_symbol_t *sym, size_t *size)
+/*
+ * Registers a marker for the symbol collector. \cb is called with \data during
+ * each collection and must call kmscon_symbol_mark() on every symbol that is
+ * still in use by its owner. It must not create new symbols.
+ */
+int kmscon_symbol_add_marker(kmscon_symbol_mark_cb cb, void *data)
 {
-	const uint32_t *res;
+	struct table_marker *marker;
+
+	if (!cb)
+		return -EINVAL;
+
+	marker = malloc(sizeof(*marker));
+	if (!marker)
+		return -ENOMEM;
+	memset(marker, 0, sizeof(*marker));
+	marker->cb = cb;
+	marker->data = data;
 
 	table_lock();
-	res = table__get(sym, size);
+	marker->next = table_markers;
+	table_markers = marker;
 	table_unlock();
 
-	return res;
+	return 0;
 }
 
-kmscon_symbol_t kmscon_symbol_append(kmscon_symbol_t sym, uint32_t ucs4)
+void kmscon_symbol_rm_marker(kmscon_symbol_mark_cb cb, void *data)
 {
-	uint32_t buf[KMSCON_UCS4_MAXLEN + 1], nsym, *nval;
-	const uint32_t *ptr;
-	size_t s;
-	kmscon_symbol_t rsym;
-	void *tmp;
-	bool res;
+	struct table_marker **iter, *marker;
 
 	table_lock();
 
-	if (table__init()) {
-		rsym = sym;
-		goto unlock;
+	for (iter = &table_markers; *iter; iter = &(*iter)->next) {
+		marker = *iter;
+		if (marker->cb == cb && marker->data == data) {
+			*iter = marker->next;
+			free(marker);
+			break;
+		}
 	}
 
-	if (ucs4 > KMSCON_UCS4_MAX) {
-		log_warn("invalid ucs4 character");
-		rsym = sym;
-		goto unlock;
-	}
+	table_unlock();
+}
 
-	ptr = table__get(&sym, &s);
-	if (s >= KMSCON_UCS4_MAXLEN) {
-		rsym = sym;
-		goto unlock;
-	}
+/* only valid from inside a marker callback */
+void kmscon_symbol_mark(kmscon_symbol_t sym)
+{
+	struct table_entry *ent;
 
-	memcpy(buf, ptr, s * sizeof(uint32_t));
-	buf[s++] = ucs4;
-	buf[s++] = KMSCON_UCS4_MAX + 1;
+	if (sym <= KMSCON_UCS4_MAX)
+		return;
 
-	res = kmscon_hashtable_find(table_symbols, &tmp, buf);
-	if (res) {
-		rsym = (uint32_t)(long)tmp;
-		goto unlock;
-	}
+	ent = (struct table_entry*)table_get_entry(sym);
+	if (ent)
+		ent->gen = table_gen;
+}
+
+/*
+ * Runs a collection if the table grew enough since the last one. This must be
+ * called on the thread that calls kmscon_symbol_append().
+ */
+void kmscon_symbol_gc(void)
+{
+	struct table_marker *marker;
+	size_t freed;
 
-	log_debug("adding new composed symbol");
+	if (__atomic_load_n(&table_used, __ATOMIC_RELAXED) < table_gc_next)
+		return;
 
-	nval = malloc(sizeof(uint32_t) * s);
-	if (!nval) {
-		rsym = sym;
-		goto unlock;
-	}
+	table_lock();
 
-	memcpy(nval, buf, s * sizeof(uint32_t));
-	nsym = table_next_id++;
-	kmscon_hashtable_insert(table_symbols, nval, (void*)(long)nsym);
-	g_array_append_val(table_index, nval);
-	rsym = nsym;
+	table__free_dead();
+	++table_gen;
+
+	for (marker = table_markers; marker; marker = marker->next)
+		marker->cb(marker->data);
+
+	freed = table__sweep();
+
+	table_gc_next = table_used * 2;
+	if (table_gc_next < TABLE_GC_MIN)
+		table_gc_next = TABLE_GC_MIN;
+
+	++table_stats.collections;
+	table_stats.freed += freed;
 
-unlock:
 	table_unlock();
-	return rsym;
+
+	log_debug("collected %zu composed symbols, %zu left", freed,
+			table_used);
 }
 
-const char *kmscon_symbol_get_u8(kmscon_symbol_t sym, size_t *size)
+void kmscon_symbol_get_stats(struct kmscon_symbol_stats *stats)
+{
+	if (!stats)
+		return;
+
+	table_lock();
+	*stats = table_stats;
+	stats->symbols = table_used;
+	/* ids start at KMSCON_UCS4_MAX + 2, see table_next_id */
+	stats->ids = table_next_id - (KMSCON_UCS4_MAX + 2);
+	stats->hash_size = table_hash ? table_hash->size : 0;
+	table_unlock();
+}
+
+/* composed symbols; see kmscon_symbol_to_u8() */
+size_t kmscon_symbol_to_u8_slow(kmscon_symbol_t sym, char *buf, size_t cap)
 {
 	const uint32_t *ucs4;
-	gchar *val;
-	glong len;
+	size_t len, i, pos, n;
 
-	ucs4 = kmscon_symbol_get(&sym, size);
-	val = g_ucs4_to_utf8(ucs4, *size, NULL, &len, NULL);
-	if (!val || len < 0) {
-		if (size)
-			*size = 1;
-		return default_u8;
+	ucs4 = kmscon_symbol_get(&sym, &len);
+
+	pos = 0;
+	for (i = 0; i < len; ++i) {
+		n = kmscon_ucs4_to_u8(ucs4[i], &buf[pos], cap - pos);
+		if (!n)
+			break;
+		pos += n;
 	}
 
-	if (size)
-		*size = len;
-	return val;
+	return pos;
 }
 
-void kmscon_symbol_free_u8(const char *s)
+/*
+ * Returns the number of cells \sym occupies. Composed symbols take the width of
+ * their base character as combining marks never widen a character.
+ */
+unsigned int kmscon_symbol_get_width(kmscon_symbol_t sym)
 {
-	if (s != default_u8)
-		g_free((char*)s);
+	const uint32_t *ucs4;
+
+	ucs4 = kmscon_symbol_get(&sym, NULL);
+	return kmscon_ucs4_width(ucs4[0]);
 }
 
 struct kmscon_utf8_mach {
@@ -43,25 +43,144 @@
  * marks and the table will return a new valid kmscon_symbol_t. It is no longer
  * a valid UCS4 value, though. But no memory management is needed as all
  * kmscon_symbol_t objects are simple integers.
+ * Composed symbols are garbage collected, though. Every owner of symbols
+ * registers a marker with kmscon_symbol_add_marker(). A composed symbol and the
+ * string returned by kmscon_symbol_get() stay valid only while some marker
+ * still marks the symbol.
  */
 
 #ifndef KMSCON_UNICODE_H
 #define KMSCON_UNICODE_H
 
 #include <inttypes.h>
+#include <stdbool.h>
 #include <stdlib.h>
 
 /* symbols */
 
 typedef uint32_t kmscon_symbol_t;
 
+#define KMSCON_UCS4_MAX 0x7fffffffUL
+
+/* buffer size that fits the UTF-8 representation of any symbol */
+#define KMSCON_SYMBOL_U8_MAX 64
+
 extern const kmscon_symbol_t kmscon_symbol_default;
 
 kmscon_symbol_t kmscon_symbol_make(uint32_t ucs4);
 kmscon_symbol_t kmscon_symbol_append(kmscon_symbol_t sym, uint32_t ucs4);
 const uint32_t *kmscon_symbol_get(kmscon_symbol_t *sym, size_t *size);
-const char *kmscon_symbol_get_u8(kmscon_symbol_t sym, size_t *size);
-void kmscon_symbol_free_u8(const char *s);
+size_t kmscon_symbol_to_u8_slow(kmscon_symbol_t sym, char *buf, size_t cap);
+unsigned int kmscon_symbol_get_width(kmscon_symbol_t sym);
+
+/* symbol collector */
+
+typedef void (*kmscon_symbol_mark_cb) (void *data);
+
+struct kmscon_symbol_stats {
+	size_t symbols;			/* live composed symbols */
+	size_t ids;			/* IDs ever allocated */
+	size_t hash_size;		/* slots of the hash table */
+	unsigned long collections;	/* number of collector runs */
+	unsigned long freed;		/* total number of collected symbols */
+};
+
+int kmscon_symbol_add_marker(kmscon_symbol_mark_cb cb, void *data);
+void kmscon_symbol_rm_marker(kmscon_symbol_mark_cb cb, void *data);
+void kmscon_symbol_mark(kmscon_symbol_t sym);
+void kmscon_symbol_gc(void);
+void kmscon_symbol_get_stats(struct kmscon_symbol_stats *stats);
+
+/*
+ * Encodes \ucs4 as UTF-8 into \buf and returns the number of bytes written.
+ * Returns 0 if \cap is too small. Like the decoder, this accepts the full
+ * 31-bit range and hence writes up to 6 bytes.
+ */
+static inline size_t kmscon_ucs4_to_u8(uint32_t ucs4, char *buf, size_t cap)
+{
+	size_t len, i;
+
+	if (ucs4 < 0x80)
+		len = 1;
+	else if (ucs4 < 0x800)
+		len = 2;
+	else if (ucs4 < 0x10000)
+		len = 3;
+	else if (ucs4 < 0x200000)
+		len = 4;
+	else if (ucs4 < 0x4000000)
+		len = 5;
+	else
+		len = 6;
+
+	if (len > cap)
+		return 0;
+
+	if (len == 1) {
+		buf[0] = ucs4;
+		return 1;
+	}
+
+	for (i = len - 1; i > 0; --i) {
+		buf[i] = 0x80 | (ucs4 & 0x3f);
+		ucs4 >>= 6;
+	}
+	buf[0] = ((0xff00 >> len) & 0xff) | ucs4;
+
+	return len;
+}
+
+/*
+ * Writes the UTF-8 representation of \sym into \buf and returns the number
+ * of bytes written. The output is not zero-terminated. If \cap is too small,
+ * the output is truncated at a character boundary. A buffer of
+ * KMSCON_SYMBOL_U8_MAX bytes is always big enough.
+ * Plain UCS4 symbols are encoded inline, only composed symbols need a lookup in
+ * the symbol table. This never allocates memory.
+ */
+static inline size_t kmscon_symbol_to_u8(kmscon_symbol_t sym, char *buf,
+						size_t cap)
+{
+	if (sym <= KMSCON_UCS4_MAX)
+		return kmscon_ucs4_to_u8(sym, buf, cap);
+
+	return kmscon_symbol_to_u8_slow(sym, buf, cap);
+}
+
+/* character properties */
+
+#define KMSCON_UCS4_WIDTH_MASK 0x3
+#define KMSCON_UCS4_COMBINING 0x4
+
+/* generated from unicode_width.txt by genunicode */
+extern const uint16_t kmscon_ucs4_stage1[];
+extern const uint8_t kmscon_ucs4_stage2[];
+
+/*
+ * Returns the property bits of \ucs4. Each 256-code-point block is mapped to a
+ * shared second-level block with one nibble per code point.
+ */
+static inline unsigned int kmscon_ucs4_props(uint32_t ucs4)
+{
+	size_t idx;
+
+	if (ucs4 >= 0x110000)
+		return 1;
+
+	idx = kmscon_ucs4_stage1[ucs4 >> 8] * 128 + (ucs4 & 0xff) / 2;
+	return (kmscon_ucs4_stage2[idx] >> ((ucs4 & 1) * 4)) & 0xf;
+}
+
+/* number of cells \ucs4 occupies: 0, 1 or 2 */
+static inline unsigned int kmscon_ucs4_width(uint32_t ucs4)
+{
+	return kmscon_ucs4_props(ucs4) & KMSCON_UCS4_WIDTH_MASK;
+}
+
+static inline bool kmscon_ucs4_is_combining(uint32_t ucs4)
+{
+	return kmscon_ucs4_props(ucs4) & KMSCON_UCS4_COMBINING;
+}
 
 /* utf8 state machine */
 
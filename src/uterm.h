@@ -117,6 +117,7 @@ enum uterm_video_type {
 enum uterm_video_action {
 	UTERM_NEW,
 	UTERM_GONE,
+	UTERM_PAGE_FLIP,
 };
 
 struct uterm_video_hotplug {
@@ -220,6 +221,7 @@ struct uterm_input_event {
 	uint32_t keysym;	/* X keysym - XK_* - X11/keysym.h */
 	unsigned int mods;	/* active modifiers - uterm_modifier mask */
 	uint32_t unicode;	/* ucs4 unicode value or UTERM_INPUT_INVALID */
+	bool more;		/* more events of the same evdev frame follow */
 };
 
 typedef void (*uterm_input_cb) (struct uterm_input *input,
@@ -26,6 +26,9 @@
 
 /*
  * Input Devices
+ * Events are queued per device until the SYN_REPORT that ends the evdev frame
+ * and are then delivered together; the last event of a frame has ev->more
+ * unset.
  */
 
 #include <errno.h>
@@ -40,6 +43,7 @@
 #include "eloop.h"
 #include "log.h"
 #include "misc.h"
+#include "trace.h"
 #include "uterm.h"
 #include "uterm_internal.h"
 
@@ -48,6 +52,9 @@
 /* How many longs are needed to hold \n bits. */
 #define NLONGS(n) (((n) + LONG_BIT - 1) / LONG_BIT)
 
+#define INPUT_READ_MAX 64
+#define INPUT_FRAME_MAX 32
+
 enum device_feature {
 	FEATURE_HAS_KEYS = 0x01,
 	FEATURE_HAS_LEDS = 0x02,
@@ -62,6 +69,9 @@ struct uterm_input_dev {
 	char *node;
 	struct ev_fd *fd;
 	struct kbd_dev *kbd;
+
+	struct uterm_input_event frame[INPUT_FRAME_MAX];
+	unsigned int frame_num;
 };
 
 struct uterm_input {
@@ -77,6 +87,18 @@ struct uterm_input {
 
 static void input_free_dev(struct uterm_input_dev *dev);
 
+/* delivers the queued events; \end is set if the frame is complete */
+static void flush_frame(struct uterm_input_dev *dev, bool end)
+{
+	unsigned int i, num = dev->frame_num;
+
+	dev->frame_num = 0;
+	for (i = 0; i < num; ++i) {
+		dev->frame[i].more = !end || i + 1 < num;
+		kmscon_hook_call(dev->input->hook, dev->input, &dev->frame[i]);
+	}
+}
+
 static void notify_key(struct uterm_input_dev *dev,
 			uint16_t type,
 			uint16_t code,
@@ -88,17 +110,20 @@ static void notify_key(struct uterm_input_dev *dev,
 	if (type != EV_KEY)
 		return;
 
+	kmscon_trace_point(KMSCON_TRACE_KEY, code, value);
 	ret = kbd_dev_process_key(dev->kbd, value, code, &ev);
 	if (ret)
 		return;
 
-	kmscon_hook_call(dev->input->hook, dev->input, &ev);
+	if (dev->frame_num == INPUT_FRAME_MAX)
+		flush_frame(dev, false);
+	dev->frame[dev->frame_num++] = ev;
 }
 
 static void input_data_dev(struct ev_fd *fd, int mask, void *data)
 {
 	struct uterm_input_dev *dev = data;
-	struct input_event ev[16];
+	struct input_event ev[INPUT_READ_MAX];
 	ssize_t len, n;
 	int i;
 
@@ -124,9 +149,14 @@ static void input_data_dev(struct ev_fd *fd, int mask, void *data)
 			log_warn("invalid input_event on %s", dev->node);
 		} else {
 			n = len / sizeof(*ev);
-			for (i = 0; i < n; i++)
-				notify_key(dev, ev[i].type, ev[i].code,
+			for (i = 0; i < n; i++) {
+				if (ev[i].type == EV_SYN &&
+				    ev[i].code == SYN_REPORT)
+					flush_frame(dev, true);
+				else
+					notify_key(dev, ev[i].type, ev[i].code,
 								ev[i].value);
+			}
 		}
 	}
 }
@@ -179,6 +209,7 @@ static void input_sleep_dev(struct uterm_input_dev *dev)
 	dev->fd = NULL;
 	close(dev->rfd);
 	dev->rfd = -1;
+	dev->frame_num = 0;
 }
 
 static void input_new_dev(struct uterm_input *input,
@@ -254,6 +285,7 @@ int uterm_input_new(struct uterm_input **out,
 		goto err_free;
 
 	ret = kbd_desc_new(&input->desc,
+					conf_global.keymap_cache,
 					conf_global.xkb_layout,
 					conf_global.xkb_variant,
 					conf_global.xkb_options);
@@ -391,6 +391,7 @@ int kbd_dev_process_key(struct kbd_dev *kbd,
 }
 
 int kbd_desc_new(struct kbd_desc **out,
+			const char *cache_dir,
 			const char *layout,
 			const char *variant,
 			const char *options)
@@ -300,7 +300,9 @@ static inline bool input_bit_is_set(const unsigned long *array, int bit)
 struct kbd_desc;
 struct kbd_dev;
 
+/* \cache_dir is where compiled key maps are cached, NULL disables the cache */
 int kbd_desc_new(struct kbd_desc **out,
+			const char *cache_dir,
 			const char *layout,
 			const char *variant,
 			const char *options);
@@ -49,6 +49,7 @@
 #include "eloop.h"
 #include "log.h"
 #include "misc.h"
+#include "trace.h"
 #include "uterm.h"
 #include "uterm_internal.h"
 
@@ -385,6 +386,8 @@ static int display_swap(struct uterm_display *disp)
 	if (disp->dpms != UTERM_DPMS_ON)
 		return -EINVAL;
 
+	kmscon_trace_begin(KMSCON_TRACE_SWAP, 0);
+
 	/* TODO: is glFlush sufficient here? */
 	glFinish();
 
@@ -393,6 +396,7 @@ static int display_swap(struct uterm_display *disp)
 	ret = drmModePageFlip(disp->video->drm.fd, disp->drm.crtc_id,
 				disp->drm.rb[disp->drm.current_rb].fb,
 				DRM_MODE_PAGE_FLIP_EVENT, disp);
+	kmscon_trace_end(KMSCON_TRACE_SWAP);
 	if (ret) {
 		log_warn("page-flip failed %d %d", ret, errno);
 		return -EFAULT;
@@ -522,7 +526,10 @@ static void page_flip_handler(int fd, unsigned int frame, unsigned int sec,
 {
 	struct uterm_display *disp = data;
 
+	kmscon_trace_point(KMSCON_TRACE_FLIP, frame, 0);
 	disp->flags &= ~DISPLAY_VSYNC;
+	if (display_is_conn(disp))
+		VIDEO_CB(disp->video, disp, UTERM_PAGE_FLIP);
 	uterm_display_unref(disp);
 }
 
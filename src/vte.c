@@ -49,6 +49,7 @@
  */
 
 #include <errno.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <X11/keysym.h>
@@ -56,6 +57,7 @@
 #include "console.h"
 #include "input.h"
 #include "log.h"
+#include "trace.h"
 #include "unicode.h"
 #include "vte.h"
 
@@ -108,12 +110,15 @@ struct kmscon_vte {
 	unsigned long ref;
 	struct kmscon_console *con;
 
-	const char *kbd_sym;
+	char kbd_sym[KMSCON_SYMBOL_U8_MAX];
 	struct kmscon_utf8_mach *mach;
 
 	unsigned int state;
 	unsigned int csi_argc;
 	int csi_argv[CSI_ARG_MAX];
+
+	unsigned int flow;
+	bool printed;		/* last action was ACTION_PRINT */
 };
 
 int kmscon_vte_new(struct kmscon_vte **out)
@@ -164,7 +169,6 @@ void kmscon_vte_unref(struct kmscon_vte *vte)
 	log_debug("destroying vte object");
 	kmscon_console_unref(vte->con);
 	kmscon_utf8_mach_free(vte->mach);
-	kmscon_symbol_free_u8(vte->kbd_sym);
 	free(vte);
 }
 
@@ -178,6 +182,31 @@ void kmscon_vte_bind(struct kmscon_vte *vte, struct kmscon_console *con)
 	kmscon_console_ref(vte->con);
 }
 
+/*
+ * Returns the current flow-control state as a mask of kmscon_vte_flow flags.
+ * The user of the VTE is responsible for honouring it: KMSCON_VTE_FLOW_HOLD
+ * means no more host data should be read.
+ */
+unsigned int kmscon_vte_get_flow(struct kmscon_vte *vte)
+{
+	if (!vte)
+		return 0;
+
+	return vte->flow;
+}
+
+/*
+ * Clears the flow-control state. Must be called whenever a new host session
+ * is started so a hold from a previous session does not carry over.
+ */
+void kmscon_vte_reset_flow(struct kmscon_vte *vte)
+{
+	if (!vte)
+		return;
+
+	vte->flow = 0;
+}
+
 /* execute control character (C0 or C1) */
 static void do_execute(struct kmscon_vte *vte, uint32_t ctrl)
 {
@@ -232,12 +261,11 @@ static void do_execute(struct kmscon_vte *vte, uint32_t ctrl)
 			/* TODO */
 			break;
 		case 0x11: /* XON */
-			/* Resume transmission */
-			/* TODO */
-			break;
 		case 0x13: /* XOFF */
-			/* Stop transmission */
-			/* TODO */
+			/* XON/XOFF from the host are ignored. Stray DC3 bytes
+			 * (e.g. binary output) must not lock up the keyboard.
+			 * Keyboard flow control is done by the pty line
+			 * discipline (IXON). */
 			break;
 		case 0x18: /* CAN */
 			/* Cancel escape sequence */
@@ -427,6 +455,9 @@ static void do_action(struct kmscon_vte *vte, uint32_t data, int action)
 {
 	kmscon_symbol_t sym;
 
+	if (action != ACTION_NONE && action != ACTION_PRINT)
+		vte->printed = false;
+
 	switch (action) {
 		case ACTION_NONE:
 			/* do nothing */
@@ -435,8 +466,15 @@ static void do_action(struct kmscon_vte *vte, uint32_t data, int action)
 			/* ignore character */
 			break;
 		case ACTION_PRINT:
+			/* combining marks are merged into the previous cell as
+			 * long as nothing else happened in between */
+			if (vte->printed && kmscon_ucs4_is_combining(data)) {
+				kmscon_console_combine(vte->con, data);
+				break;
+			}
 			sym = kmscon_symbol_make(data);
 			kmscon_console_write(vte->con, sym);
+			vte->printed = true;
 			break;
 		case ACTION_EXECUTE:
 			do_execute(vte, data);
@@ -862,6 +900,7 @@ void kmscon_vte_input(struct kmscon_vte *vte, const char *u8, size_t len)
 	if (!vte || !vte->con)
 		return;
 
+	kmscon_trace_begin(KMSCON_TRACE_VTE_INPUT, len);
 	for (i = 0; i < len; ++i) {
 		state = kmscon_utf8_mach_feed(vte->mach, u8[i]);
 		if (state == KMSCON_UTF8_ACCEPT ||
@@ -870,6 +909,7 @@ void kmscon_vte_input(struct kmscon_vte *vte, const char *u8, size_t len)
 			parse_data(vte, ucs4);
 		}
 	}
+	kmscon_trace_end(KMSCON_TRACE_VTE_INPUT);
 }
 
 int kmscon_vte_handle_keyboard(struct kmscon_vte *vte,
@@ -900,10 +940,10 @@ int kmscon_vte_handle_keyboard(struct kmscon_vte *vte,
 			*len = 1;
 			return KMSCON_VTE_SEND;
 		case XK_Scroll_Lock:
-			/* TODO: do we need scroll lock impl.? */
-			*u8 = "\x14";
-			*len = 1;
-			return KMSCON_VTE_SEND;
+			/* Hold screen; like the linux console we stop reading
+			 * from the host until Scroll Lock is pressed again. */
+			vte->flow ^= KMSCON_VTE_FLOW_HOLD;
+			return KMSCON_VTE_DROP;
 		case XK_Sys_Req:
 			*u8 = "\x15";
 			*len = 1;
@@ -921,9 +961,9 @@ int kmscon_vte_handle_keyboard(struct kmscon_vte *vte,
 	}
 
 	if (ev->unicode != KMSCON_INPUT_INVALID) {
-		kmscon_symbol_free_u8(vte->kbd_sym);
 		sym = kmscon_symbol_make(ev->unicode);
-		vte->kbd_sym = kmscon_symbol_get_u8(sym, len);
+		*len = kmscon_symbol_to_u8(sym, vte->kbd_sym,
+						sizeof(vte->kbd_sym));
 		*u8 = vte->kbd_sym;
 		return KMSCON_VTE_SEND;
 	}
@@ -45,6 +45,10 @@ enum kmscon_vte_keyboard_action {
 	KMSCON_VTE_SEND,
 };
 
+enum kmscon_vte_flow {
+	KMSCON_VTE_FLOW_HOLD = 0x01,	/* screen held by the user */
+};
+
 int kmscon_vte_new(struct kmscon_vte **out);
 void kmscon_vte_ref(struct kmscon_vte *vte);
 void kmscon_vte_unref(struct kmscon_vte *vte);
@@ -53,5 +57,7 @@ void kmscon_vte_bind(struct kmscon_vte *vte, struct kmscon_console *con);
 void kmscon_vte_input(struct kmscon_vte *vte, const char *u8, size_t len);
 int kmscon_vte_handle_keyboard(struct kmscon_vte *vte,
 	const struct kmscon_input_event *ev, const char **u8, size_t *len);
+unsigned int kmscon_vte_get_flow(struct kmscon_vte *vte);
+void kmscon_vte_reset_flow(struct kmscon_vte *vte);
 
 #endif /* KMSCON_VTE_H */
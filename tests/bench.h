@@ -0,0 +1,108 @@
+/*
+ * bench - Benchmark Helpers
+ *
+ * Copyright (c) 2012 David Herrmann <dh.herrmann@googlemail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Benchmark Helpers
+ * Shared by the benchmark programs that "make bench" runs. Every result is
+ * printed to stdout as one JSON object per line so the output of different
+ * builds can be stored and compared:
+ *   {"suite":"vte","bench":"ascii","ops":1048576,"nsec":2684354,
+ *    "ns_per_op":2.560,"bytes":1048576,"mb_per_s":390.62}
+ * "bytes" and "mb_per_s" are only present for benchmarks that consume a byte
+ * stream. bench_run() runs a benchmark once to warm up and then BENCH_RUNS
+ * times and reports the fastest run, which is the most reproducible figure on
+ * a busy machine. Input data is generated with bench_rand() from fixed seeds
+ * so every build measures the same work.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_RUNS 5
+
+typedef void (*bench_cb) (void *data);
+
+static inline uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void bench_report(const char *suite, const char *name,
+				uint64_t nsec, unsigned long ops,
+				uint64_t bytes)
+{
+	if (!nsec)
+		nsec = 1;
+
+	printf("{\"suite\":\"%s\",\"bench\":\"%s\",\"ops\":%lu,"
+		"\"nsec\":%" PRIu64 ",\"ns_per_op\":%.3f",
+		suite, name, ops, nsec, ops ? (double)nsec / ops : 0.0);
+	if (bytes)
+		printf(",\"bytes\":%" PRIu64 ",\"mb_per_s\":%.2f",
+			bytes, bytes * 1000.0 / nsec);
+	printf("}\n");
+	fflush(stdout);
+}
+
+static inline void bench_run(const char *suite, const char *name,
+				unsigned long ops, uint64_t bytes,
+				bench_cb cb, void *data)
+{
+	uint64_t start, nsec, best = UINT64_MAX;
+	unsigned int i;
+
+	cb(data);
+	for (i = 0; i < BENCH_RUNS; ++i) {
+		start = bench_now();
+		cb(data);
+		nsec = bench_now() - start;
+		if (nsec < best)
+			best = nsec;
+	}
+
+	bench_report(suite, name, best, ops, bytes);
+}
+
+/* xorshift32; \seed must not be 0 */
+static inline uint32_t bench_rand(uint32_t *seed)
+{
+	uint32_t x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*seed = x;
+	return x;
+}
+
+#endif /* BENCH_H */
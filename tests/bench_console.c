@@ -0,0 +1,149 @@
+/*
+ * bench_console - Console Buffer Benchmarks
+ *
+ * Copyright (c) 2012 David Herrmann <dh.herrmann@googlemail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Console Buffer Benchmarks
+ * Measures the console operations the VTE performs without the parser in
+ * front: writing symbols with auto-wrap, scrolling the screen by newlines at
+ * the bottom line and erasing lines and the whole screen. One op is one call.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "console.h"
+#include "log.h"
+#include "unicode.h"
+
+#define CON_OPS (1024 * 1024)
+#define CON_ERASE_OPS (64 * 1024)
+
+struct con_bench {
+	struct kmscon_console *con;
+	kmscon_symbol_t syms[CON_OPS];
+	unsigned int rows[CON_ERASE_OPS];
+};
+
+static void run_write(void *data)
+{
+	struct con_bench *b = data;
+	unsigned int i;
+
+	for (i = 0; i < CON_OPS; ++i)
+		kmscon_console_write(b->con, b->syms[i]);
+}
+
+static void run_scroll(void *data)
+{
+	struct con_bench *b = data;
+	unsigned int i, last;
+
+	last = kmscon_console_get_height(b->con) - 1;
+	kmscon_console_move_to(b->con, 0, last);
+	for (i = 0; i < CON_OPS; ++i)
+		kmscon_console_newline(b->con);
+}
+
+static void run_erase_line(void *data)
+{
+	struct con_bench *b = data;
+	unsigned int i;
+
+	for (i = 0; i < CON_ERASE_OPS; ++i) {
+		kmscon_console_move_to(b->con, 0, b->rows[i]);
+		kmscon_console_erase_current_line(b->con);
+	}
+}
+
+static void run_erase_screen(void *data)
+{
+	struct con_bench *b = data;
+	unsigned int i;
+
+	for (i = 0; i < CON_ERASE_OPS; ++i)
+		kmscon_console_erase_screen(b->con);
+}
+
+/* fills the screen so erasing has lines to clear */
+static void fill_screen(struct con_bench *b)
+{
+	unsigned int i, num;
+
+	kmscon_console_move_to(b->con, 0, 0);
+	num = kmscon_console_get_width(b->con) *
+		kmscon_console_get_height(b->con);
+	for (i = 0; i < num && i < CON_OPS; ++i)
+		kmscon_console_write(b->con, b->syms[i]);
+}
+
+int main(int argc, char **argv)
+{
+	struct con_bench *b;
+	uint32_t seed = 7;
+	unsigned int i, height;
+	int ret;
+
+	log_print_init(argv[0]);
+
+	b = malloc(sizeof(*b));
+	if (!b) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	memset(b, 0, sizeof(*b));
+
+	ret = kmscon_console_new(&b->con);
+	if (ret)
+		goto err_free;
+
+	height = kmscon_console_get_height(b->con);
+	for (i = 0; i < CON_OPS; ++i)
+		b->syms[i] = kmscon_symbol_make(0x21 + bench_rand(&seed) % 0x5e);
+	for (i = 0; i < CON_ERASE_OPS; ++i)
+		b->rows[i] = bench_rand(&seed) % height;
+
+	bench_run("console", "write", CON_OPS, 0, run_write, b);
+	bench_run("console", "scroll", CON_OPS, 0, run_scroll, b);
+
+	fill_screen(b);
+	bench_run("console", "erase-line", CON_ERASE_OPS, 0, run_erase_line,
+			b);
+
+	fill_screen(b);
+	bench_run("console", "erase-screen", CON_ERASE_OPS, 0,
+			run_erase_screen, b);
+
+	kmscon_console_unref(b->con);
+	free(b);
+	return EXIT_SUCCESS;
+
+err_free:
+	free(b);
+err:
+	log_err("benchmark failed, errno %d: %s", ret, strerror(-ret));
+	return abs(ret);
+}
@@ -0,0 +1,327 @@
+/*
+ * bench_font - Glyph Lookup Benchmarks
+ *
+ * Copyright (c) 2012 David Herrmann <dh.herrmann@googlemail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Glyph Lookup Benchmarks
+ * Drives the glyph lookup of the font backend this tree is configured with:
+ *  - "hit": lookups of the resident ASCII glyphs, which only set the CLOCK bit
+ *  - "miss-evict": a cyclic working set four times the glyph budget, so every
+ *    lookup rasterizes a glyph and the clock hand evicts another one
+ *  - "async-miss" (pango only): lookups that queue glyphs for the workers and
+ *    return them pending, followed by waiting for all of them
+ * The backend source is included so its static lookup functions can be called
+ * directly. The texture and shader API is stubbed: glyph uploads cost nothing
+ * and no GL context is needed. The glyph cache file is disabled so all glyphs
+ * go through the budget. One op is one lookup.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "conf.h"
+#include "gl.h"
+
+/*
+ * Stubs for everything gl_shader.c exports. As all of them are defined here,
+ * that object is never linked from libkmscon-core.
+ */
+
+static unsigned int bench_tex;
+
+void gl_clear_error()
+{
+}
+
+bool gl_has_error()
+{
+	return false;
+}
+
+void gl_viewport(struct uterm_screen *screen)
+{
+}
+
+unsigned int gl_tex_new()
+{
+	return ++bench_tex;
+}
+
+void gl_tex_free(unsigned int tex)
+{
+}
+
+void gl_tex_load(unsigned int tex, unsigned int width, unsigned int stride,
+			unsigned int height, void *buf)
+{
+}
+
+void gl_tex_load_a8(unsigned int tex, unsigned int width, unsigned int height,
+			void *buf)
+{
+}
+
+int gl_shader_new(struct gl_shader **out)
+{
+	return -EOPNOTSUPP;
+}
+
+void gl_shader_ref(struct gl_shader *shader)
+{
+}
+
+void gl_shader_unref(struct gl_shader *shader)
+{
+}
+
+void gl_shader_draw_def(struct gl_shader *shader, float *vertices,
+			float *colors, size_t num)
+{
+}
+
+void gl_shader_draw_tex(struct gl_shader *shader, const float *vertices,
+			const float *texcoords, size_t num,
+			unsigned int tex, const float *m)
+{
+}
+
+void gl_shader_draw_mask(struct gl_shader *shader, const float *vertices,
+			const float *texcoords, size_t num,
+			unsigned int tex, const float *m, const float *color)
+{
+}
+
+#ifdef USE_PANGO
+
+#include "font_pango.c"
+
+#define BENCH_FONT "pango"
+
+typedef struct font_face bench_font;
+
+static int bench_font_new(bench_font **out)
+{
+	return manager_get(out, FONT_ATTR(NULL, 12, 96), false);
+}
+
+static void bench_font_free(bench_font *face)
+{
+	face_unref(face);
+}
+
+static int bench_lookup(bench_font *face, kmscon_symbol_t ch)
+{
+	struct font_glyph *glyph;
+
+	return face_lookup(face, &glyph, ch);
+}
+
+static size_t *bench_budget(bench_font *face)
+{
+	return &face->budget;
+}
+
+static size_t bench_bytes(bench_font *face)
+{
+	return face->bytes;
+}
+
+static void bench_evict(bench_font *face)
+{
+	face_evict(face, NULL);
+}
+
+#else /* !USE_PANGO */
+
+#include "font_freetype.c"
+
+#define BENCH_FONT "freetype"
+
+typedef struct kmscon_font bench_font;
+
+static int bench_font_new(bench_font **out)
+{
+	struct kmscon_font_factory *ff;
+	int ret;
+
+	ret = kmscon_font_factory_new(&ff);
+	if (ret)
+		return ret;
+
+	ret = kmscon_font_factory_load(ff, out, 8, 16);
+	kmscon_font_factory_unref(ff);
+	return ret;
+}
+
+static void bench_font_free(bench_font *font)
+{
+	kmscon_font_unref(font);
+}
+
+static int bench_lookup(bench_font *font, kmscon_symbol_t ch)
+{
+	struct kmscon_glyph *glyph;
+
+	return kmscon_font_lookup(font, ch, &glyph);
+}
+
+static size_t *bench_budget(bench_font *font)
+{
+	return &font->budget;
+}
+
+static size_t bench_bytes(bench_font *font)
+{
+	return font->bytes;
+}
+
+static void bench_evict(bench_font *font)
+{
+	font_evict(font, NULL);
+}
+
+#endif /* USE_PANGO */
+
+#define FONT_HIT_OPS (1024 * 1024)
+#define FONT_HOT_NUM 95			/* printable ASCII */
+#define FONT_COLD_NUM 512		/* U+0100 to U+02FF */
+
+struct font_bench {
+	bench_font *font;
+	kmscon_symbol_t hot[FONT_HOT_NUM];
+	kmscon_symbol_t cold[FONT_COLD_NUM];
+};
+
+static void run_hit(void *data)
+{
+	struct font_bench *b = data;
+	unsigned int i;
+
+	for (i = 0; i < FONT_HIT_OPS; ++i)
+		bench_lookup(b->font, b->hot[i % FONT_HOT_NUM]);
+}
+
+static void run_miss(void *data)
+{
+	struct font_bench *b = data;
+	unsigned int i;
+
+	for (i = 0; i < FONT_COLD_NUM; ++i)
+		bench_lookup(b->font, b->cold[i]);
+}
+
+/* drops all glyphs that are not used right now */
+static void drop_glyphs(struct font_bench *b)
+{
+	size_t budget, *p = bench_budget(b->font);
+
+	budget = *p;
+	*p = 0;
+	bench_evict(b->font);
+	*p = budget;
+}
+
+#ifdef USE_PANGO
+
+static void run_async_miss(void *data)
+{
+	struct font_bench *b = data;
+	struct font_glyph *glyphs[FONT_COLD_NUM];
+	unsigned int i;
+
+	for (i = 0; i < FONT_COLD_NUM; ++i) {
+		if (face_lookup_async(b->font, &glyphs[i], b->cold[i]))
+			glyphs[i] = NULL;
+	}
+
+	for (i = 0; i < FONT_COLD_NUM; ++i) {
+		if (glyphs[i])
+			pool_wait(glyphs[i]);
+	}
+
+	drop_glyphs(b);
+}
+
+#endif /* USE_PANGO */
+
+int main(int argc, char **argv)
+{
+	struct font_bench *b;
+	unsigned int i;
+	size_t budget;
+	int ret;
+
+	log_print_init(argv[0]);
+
+	conf_global.glyph_cache = NULL;
+	conf_global.glyph_budget = 4096;
+
+	b = malloc(sizeof(*b));
+	if (!b) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	memset(b, 0, sizeof(*b));
+
+	for (i = 0; i < FONT_HOT_NUM; ++i)
+		b->hot[i] = kmscon_symbol_make(0x20 + i);
+	for (i = 0; i < FONT_COLD_NUM; ++i)
+		b->cold[i] = kmscon_symbol_make(0x100 + i);
+
+	ret = bench_font_new(&b->font);
+	if (ret) {
+		/* the benchmarks need a font, which is not an error of ours */
+		log_warn("cannot load %s font, skipping", BENCH_FONT);
+		free(b);
+		return EXIT_SUCCESS;
+	}
+
+	bench_run(BENCH_FONT, "hit", FONT_HIT_OPS, 0, run_hit, b);
+
+	/* measure the working set, then shrink the budget to a quarter */
+	drop_glyphs(b);
+	budget = bench_bytes(b->font);
+	run_miss(b);
+	budget = (bench_bytes(b->font) - budget) / 4;
+	drop_glyphs(b);
+	*bench_budget(b->font) = budget;
+	bench_run(BENCH_FONT, "miss-evict", FONT_COLD_NUM, 0, run_miss, b);
+	*bench_budget(b->font) = conf_global.glyph_budget * 1024UL;
+
+#ifdef USE_PANGO
+	drop_glyphs(b);
+	bench_run(BENCH_FONT, "async-miss", FONT_COLD_NUM, 0, run_async_miss,
+			b);
+#endif
+
+	bench_font_free(b->font);
+	free(b);
+	return EXIT_SUCCESS;
+
+err:
+	log_err("benchmark failed, errno %d: %s", ret, strerror(-ret));
+	return abs(ret);
+}
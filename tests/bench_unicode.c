@@ -0,0 +1,220 @@
+/*
+ * bench_unicode - Unicode Benchmarks
+ *
+ * Copyright (c) 2012 David Herrmann <dh.herrmann@googlemail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Unicode Benchmarks
+ * Measures the UTF-8 state machine on text of 1 to 4 byte sequences (one op is
+ * one byte) and the symbol table with the combining sequences the VTE creates:
+ * composing a base character with combining marks, which is a table lookup
+ * once the sequence is known, and reading it back for drawing.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "log.h"
+#include "unicode.h"
+
+#define UTF8_SIZE (1024 * 1024)
+#define SYM_NUM 4096
+#define SYM_ROUNDS 64
+
+struct utf8_bench {
+	struct kmscon_utf8_mach *mach;
+	char *buf;
+	size_t len;
+	uint32_t sum;
+};
+
+struct sym_bench {
+	uint32_t bases[SYM_NUM];
+	uint32_t marks[SYM_NUM][2];
+	kmscon_symbol_t syms[SYM_NUM];
+	uint32_t sum;
+};
+
+/* fills \buf with random characters of [\first, \first + \num) */
+static size_t make_text(char *buf, size_t size, uint32_t first, uint32_t num,
+			uint32_t seed)
+{
+	size_t len = 0, n;
+	uint32_t ucs4;
+
+	while (1) {
+		ucs4 = first + bench_rand(&seed) % num;
+		n = kmscon_ucs4_to_u8(ucs4, &buf[len], size - len);
+		if (!n)
+			break;
+		len += n;
+	}
+
+	return len;
+}
+
+static void run_utf8(void *data)
+{
+	struct utf8_bench *b = data;
+	size_t i;
+	int state;
+
+	for (i = 0; i < b->len; ++i) {
+		state = kmscon_utf8_mach_feed(b->mach, b->buf[i]);
+		if (state == KMSCON_UTF8_ACCEPT || state == KMSCON_UTF8_REJECT)
+			b->sum += kmscon_utf8_mach_get(b->mach);
+	}
+}
+
+static int bench_utf8(void)
+{
+	static const struct {
+		const char *name;
+		uint32_t first;
+		uint32_t num;
+	} texts[] = {
+		{ "ascii", 0x20, 0x5f },
+		{ "latin", 0xa0, 0x160 },
+		{ "cjk", 0x4e00, 0x5200 },
+		{ "emoji", 0x1f300, 0x300 },
+	};
+	struct utf8_bench b;
+	unsigned int i;
+	int ret;
+
+	memset(&b, 0, sizeof(b));
+	ret = kmscon_utf8_mach_new(&b.mach);
+	if (ret)
+		return ret;
+
+	b.buf = malloc(UTF8_SIZE);
+	if (!b.buf) {
+		ret = -ENOMEM;
+		goto err_mach;
+	}
+
+	for (i = 0; i < sizeof(texts) / sizeof(*texts); ++i) {
+		b.len = make_text(b.buf, UTF8_SIZE, texts[i].first,
+					texts[i].num, i + 1);
+		bench_run("utf8", texts[i].name, b.len, b.len, run_utf8, &b);
+	}
+
+	free(b.buf);
+err_mach:
+	kmscon_utf8_mach_free(b.mach);
+	return ret;
+}
+
+static void run_compose(void *data)
+{
+	struct sym_bench *b = data;
+	kmscon_symbol_t sym;
+	unsigned int i, j;
+
+	for (j = 0; j < SYM_ROUNDS; ++j) {
+		for (i = 0; i < SYM_NUM; ++i) {
+			sym = kmscon_symbol_make(b->bases[i]);
+			sym = kmscon_symbol_append(sym, b->marks[i][0]);
+			sym = kmscon_symbol_append(sym, b->marks[i][1]);
+			b->syms[i] = sym;
+		}
+	}
+}
+
+static void run_get(void *data)
+{
+	struct sym_bench *b = data;
+	kmscon_symbol_t sym;
+	const uint32_t *val;
+	unsigned int i, j;
+	size_t size;
+
+	for (j = 0; j < SYM_ROUNDS; ++j) {
+		for (i = 0; i < SYM_NUM; ++i) {
+			sym = b->syms[i];
+			val = kmscon_symbol_get(&sym, &size);
+			b->sum += val[size - 1];
+		}
+	}
+}
+
+static void run_width(void *data)
+{
+	struct sym_bench *b = data;
+	unsigned int i, j;
+
+	for (j = 0; j < SYM_ROUNDS; ++j)
+		for (i = 0; i < SYM_NUM; ++i)
+			b->sum += kmscon_symbol_get_width(b->syms[i]);
+}
+
+static int bench_symbols(void)
+{
+	struct sym_bench *b;
+	uint32_t seed = 42;
+	unsigned int i;
+
+	b = malloc(sizeof(*b));
+	if (!b)
+		return -ENOMEM;
+	memset(b, 0, sizeof(*b));
+
+	/* latin letters with one or two of the combining diacritics */
+	for (i = 0; i < SYM_NUM; ++i) {
+		b->bases[i] = 'a' + bench_rand(&seed) % 26;
+		b->marks[i][0] = 0x300 + bench_rand(&seed) % 0x70;
+		b->marks[i][1] = 0x300 + bench_rand(&seed) % 0x70;
+	}
+
+	bench_run("symbol", "compose", SYM_NUM * SYM_ROUNDS, 0, run_compose,
+			b);
+	bench_run("symbol", "get", SYM_NUM * SYM_ROUNDS, 0, run_get, b);
+	bench_run("symbol", "width", SYM_NUM * SYM_ROUNDS, 0, run_width, b);
+
+	free(b);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+
+	log_print_init(argv[0]);
+
+	ret = bench_utf8();
+	if (ret)
+		goto err;
+
+	ret = bench_symbols();
+	if (ret)
+		goto err;
+
+	return EXIT_SUCCESS;
+
+err:
+	log_err("benchmark failed, errno %d: %s", ret, strerror(-ret));
+	return abs(ret);
+}
@@ -0,0 +1,223 @@
+/*
+ * bench_vte - Terminal Emulator Benchmarks
+ *
+ * Copyright (c) 2012 David Herrmann <dh.herrmann@googlemail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Terminal Emulator Benchmarks
+ * Feeds canned output streams through the VTE parser into a console, in
+ * chunks of the size the pty reads, and measures the cost per byte:
+ *   ascii: plain text lines, the common case of "cat" and compiler output
+ *   sgr:   every word in its own color and attributes, like "ls --color"
+ *   tui:   full-screen redraws with cursor addressing, like top or an editor
+ *   cjk:   lines of double-width CJK characters
+ * Each stream is STREAM_SIZE bytes, generated from a fixed seed.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "console.h"
+#include "log.h"
+#include "unicode.h"
+#include "vte.h"
+
+#define STREAM_SIZE (1024 * 1024)
+#define STREAM_CHUNK 4096
+
+struct stream {
+	char *buf;
+	size_t len;
+	size_t size;
+	uint32_t seed;
+};
+
+struct vte_bench {
+	struct kmscon_vte *vte;
+	struct stream *stream;
+};
+
+static bool stream_full(struct stream *s)
+{
+	/* leave room for the longest single append */
+	return s->len + 64 > s->size;
+}
+
+static void stream_printf(struct stream *s, const char *format, ...)
+{
+	va_list list;
+	int ret;
+
+	va_start(list, format);
+	ret = vsnprintf(&s->buf[s->len], s->size - s->len, format, list);
+	va_end(list);
+
+	if (ret > 0 && s->len + ret < s->size)
+		s->len += ret;
+}
+
+static void stream_word(struct stream *s)
+{
+	unsigned int i, len;
+
+	len = 2 + bench_rand(&s->seed) % 8;
+	for (i = 0; i < len; ++i)
+		s->buf[s->len++] = 'a' + bench_rand(&s->seed) % 26;
+}
+
+static void make_ascii(struct stream *s)
+{
+	size_t start;
+
+	while (!stream_full(s)) {
+		start = s->len;
+		while (s->len - start < 70 && !stream_full(s)) {
+			stream_word(s);
+			s->buf[s->len++] = ' ';
+		}
+		stream_printf(s, "\r\n");
+	}
+}
+
+static void make_sgr(struct stream *s)
+{
+	unsigned int i;
+
+	while (!stream_full(s)) {
+		for (i = 0; i < 8 && !stream_full(s); ++i) {
+			stream_printf(s, "\e[%u;3%um",
+					bench_rand(&s->seed) % 2,
+					bench_rand(&s->seed) % 8);
+			stream_word(s);
+			stream_printf(s, "\e[0m ");
+		}
+		stream_printf(s, "\r\n");
+	}
+}
+
+static void make_tui(struct stream *s)
+{
+	unsigned int row, col;
+
+	while (!stream_full(s)) {
+		stream_printf(s, "\e[H\e[2J");
+		for (row = 1; row <= 24 && !stream_full(s); ++row) {
+			stream_printf(s, "\e[%u;1H", row);
+			for (col = 0; col < 60 && !stream_full(s); col += 10)
+				stream_printf(s, "%9u ",
+					bench_rand(&s->seed) % 100000);
+			stream_printf(s, "\e[K");
+		}
+		stream_printf(s, "\e[24;1H");
+	}
+}
+
+static void make_cjk(struct stream *s)
+{
+	unsigned int col;
+	uint32_t ucs4;
+
+	while (!stream_full(s)) {
+		for (col = 0; col < 39; ++col) {
+			ucs4 = 0x4e00 + bench_rand(&s->seed) % 0x5200;
+			s->len += kmscon_ucs4_to_u8(ucs4, &s->buf[s->len],
+							s->size - s->len);
+		}
+		stream_printf(s, "\r\n");
+	}
+}
+
+static void run_vte(void *data)
+{
+	struct vte_bench *b = data;
+	size_t off, len;
+
+	for (off = 0; off < b->stream->len; off += len) {
+		len = b->stream->len - off;
+		if (len > STREAM_CHUNK)
+			len = STREAM_CHUNK;
+		kmscon_vte_input(b->vte, &b->stream->buf[off], len);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		void (*make) (struct stream *s);
+	} streams[] = {
+		{ "ascii", make_ascii },
+		{ "sgr", make_sgr },
+		{ "tui", make_tui },
+		{ "cjk", make_cjk },
+	};
+	struct kmscon_console *con;
+	struct vte_bench b;
+	struct stream s;
+	unsigned int i;
+	int ret;
+
+	log_print_init(argv[0]);
+
+	ret = kmscon_console_new(&con);
+	if (ret)
+		goto err;
+
+	ret = kmscon_vte_new(&b.vte);
+	if (ret)
+		goto err_con;
+	kmscon_vte_bind(b.vte, con);
+
+	memset(&s, 0, sizeof(s));
+	s.size = STREAM_SIZE;
+	s.buf = malloc(s.size);
+	if (!s.buf) {
+		ret = -ENOMEM;
+		goto err_vte;
+	}
+	b.stream = &s;
+
+	for (i = 0; i < sizeof(streams) / sizeof(*streams); ++i) {
+		s.len = 0;
+		s.seed = i + 1;
+		streams[i].make(&s);
+		bench_run("vte", streams[i].name, s.len, s.len, run_vte, &b);
+	}
+
+	free(s.buf);
+	kmscon_vte_unref(b.vte);
+	kmscon_console_unref(con);
+	return EXIT_SUCCESS;
+
+err_vte:
+	kmscon_vte_unref(b.vte);
+err_con:
+	kmscon_console_unref(con);
+err:
+	log_err("benchmark failed, errno %d: %s", ret, strerror(-ret));
+	return abs(ret);
+}
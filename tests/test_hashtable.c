@@ -0,0 +1,433 @@
+/*
+ * test_hashtable - Hash Table Benchmark
+ *
+ * Copyright (c) 2012 David Herrmann <dh.herrmann@googlemail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Hash Table Benchmark
+ * This verifies the kmscon_hashtable implementation and compares it to
+ * GHashTable. The key pattern mimics the glyph caches: symbol values used as
+ * direct keys, looked up far more often than inserted. Each table is filled
+ * with HT_KEYS keys and then queried HT_ROUNDS times for every key and for the
+ * same number of missing keys. Afterwards every other key is removed from the
+ * kmscon table and the remaining keys are verified.
+ * Before the benchmarks, tables with string keys and custom hash and equal
+ * callbacks are verified: lookups through copies of the keys, replacing values,
+ * removing keys out of the middle of a collision chain and growing far past
+ * the 7/8 load limit.
+ * This is part of "make bench" and reports in the format of bench.h. Complete
+ * glyph lookups are measured by bench_font.
+ */
+
+#include <errno.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bench.h"
+#include "log.h"
+#include "misc.h"
+
+#define HT_KEYS 4096
+#define HT_ROUNDS 1000
+#define HT_CHAIN 12
+#define HT_GROW_KEYS 10000
+
+static void print_result(const char *name, const char *op, uint64_t nsec,
+				unsigned long num)
+{
+	char bench[64];
+
+	snprintf(bench, sizeof(bench), "%s-%s", name, op);
+	bench_report("hashtable", bench, nsec, num, 0);
+}
+
+/* keys look like the symbols of printable characters */
+static void *make_key(unsigned long i)
+{
+	return (void*)(uintptr_t)(0x20 + i);
+}
+
+/* djb2 */
+static unsigned int str_hash(const void *key)
+{
+	const unsigned char *s = key;
+	unsigned int hash = 5381;
+
+	while (*s)
+		hash = hash * 33 + *s++;
+	return hash;
+}
+
+/* puts every key into one of two neighbouring buckets */
+static unsigned int collide_hash(const void *key)
+{
+	return str_hash(key) & 1;
+}
+
+static int str_equal(const void *key1, const void *key2)
+{
+	return !strcmp(key1, key2);
+}
+
+static void count_cb(void *key, void *value, void *data)
+{
+	++*(unsigned long*)data;
+}
+
+static int insert_str(struct kmscon_hashtable *tbl, unsigned long i)
+{
+	char buf[32], *key;
+	int ret;
+
+	snprintf(buf, sizeof(buf), "key-%lu", i);
+	key = strdup(buf);
+	if (!key)
+		return -ENOMEM;
+
+	ret = kmscon_hashtable_insert(tbl, key, make_key(i));
+	if (ret)
+		free(key);
+	return ret;
+}
+
+/* looks the key up through a copy so the equal callback must be used */
+static bool find_str(struct kmscon_hashtable *tbl, unsigned long i)
+{
+	char buf[32];
+	void *val;
+
+	snprintf(buf, sizeof(buf), "key-%lu", i);
+	return kmscon_hashtable_find(tbl, &val, buf) && val == make_key(i);
+}
+
+static bool remove_str(struct kmscon_hashtable *tbl, unsigned long i)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "key-%lu", i);
+	return kmscon_hashtable_remove(tbl, buf);
+}
+
+static unsigned long count_str(struct kmscon_hashtable *tbl)
+{
+	unsigned long num = 0;
+
+	kmscon_hashtable_foreach(tbl, count_cb, &num);
+	return num;
+}
+
+static int test_strings(void)
+{
+	struct kmscon_hashtable *tbl;
+	unsigned long i;
+	char *key;
+	void *val;
+	int ret;
+
+	ret = kmscon_hashtable_new(&tbl, str_hash, str_equal, free, NULL);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < HT_CHAIN; ++i) {
+		ret = insert_str(tbl, i);
+		if (ret)
+			goto out;
+	}
+
+	ret = -EFAULT;
+	for (i = 0; i < HT_CHAIN * 2; ++i) {
+		if (find_str(tbl, i) != (i < HT_CHAIN))
+			goto out;
+	}
+
+	/* replacing a value frees the passed key and keeps the entry count */
+	key = strdup("key-0");
+	if (!key) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = kmscon_hashtable_insert(tbl, key, make_key(HT_CHAIN));
+	if (ret) {
+		free(key);
+		goto out;
+	}
+
+	ret = -EFAULT;
+	if (!kmscon_hashtable_find(tbl, &val, "key-0") ||
+	    val != make_key(HT_CHAIN) || count_str(tbl) != HT_CHAIN)
+		goto out;
+
+	if (!remove_str(tbl, 0) || remove_str(tbl, 0) ||
+	    kmscon_hashtable_find(tbl, NULL, "key-0"))
+		goto out;
+
+	ret = 0;
+out:
+	kmscon_hashtable_free(tbl);
+	if (ret == -EFAULT)
+		log_err("string keys returned wrong results");
+	return ret;
+}
+
+/* removes every position of a collision chain in turn */
+static int test_collisions(void)
+{
+	struct kmscon_hashtable *tbl;
+	unsigned long i, j;
+	int ret;
+
+	for (i = 0; i < HT_CHAIN; ++i) {
+		ret = kmscon_hashtable_new(&tbl, collide_hash, str_equal,
+						free, NULL);
+		if (ret)
+			return ret;
+
+		for (j = 0; j < HT_CHAIN; ++j) {
+			ret = insert_str(tbl, j);
+			if (ret)
+				goto err_tbl;
+		}
+
+		ret = -EFAULT;
+		if (!remove_str(tbl, i) || remove_str(tbl, i))
+			goto err_tbl;
+
+		for (j = 0; j < HT_CHAIN; ++j) {
+			if (find_str(tbl, j) != (j != i))
+				goto err_tbl;
+		}
+
+		if (count_str(tbl) != HT_CHAIN - 1)
+			goto err_tbl;
+
+		/* the freed slot must be reusable */
+		ret = insert_str(tbl, i);
+		if (ret)
+			goto err_tbl;
+
+		ret = -EFAULT;
+		for (j = 0; j < HT_CHAIN; ++j) {
+			if (!find_str(tbl, j))
+				goto err_tbl;
+		}
+
+		kmscon_hashtable_free(tbl);
+	}
+
+	return 0;
+
+err_tbl:
+	kmscon_hashtable_free(tbl);
+	if (ret == -EFAULT)
+		log_err("removal from collision chain %lu failed", i);
+	return ret;
+}
+
+static int test_growth(void)
+{
+	struct kmscon_hashtable *tbl;
+	unsigned long i;
+	int ret;
+
+	ret = kmscon_hashtable_new(&tbl, str_hash, str_equal, free, NULL);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < HT_GROW_KEYS; ++i) {
+		ret = insert_str(tbl, i);
+		if (ret)
+			goto out;
+	}
+
+	ret = -EFAULT;
+	for (i = 0; i < HT_GROW_KEYS; ++i) {
+		if (!find_str(tbl, i))
+			goto out;
+	}
+	if (find_str(tbl, HT_GROW_KEYS) || count_str(tbl) != HT_GROW_KEYS)
+		goto out;
+
+	for (i = 0; i < HT_GROW_KEYS; i += 2) {
+		if (!remove_str(tbl, i))
+			goto out;
+	}
+	for (i = 0; i < HT_GROW_KEYS; ++i) {
+		if (find_str(tbl, i) != (i % 2))
+			goto out;
+	}
+
+	ret = 0;
+out:
+	kmscon_hashtable_free(tbl);
+	if (ret == -EFAULT)
+		log_err("grown table returned wrong results");
+	return ret;
+}
+
+static int bench_kmscon(void)
+{
+	struct kmscon_hashtable *tbl;
+	unsigned long i, j, hits = 0;
+	uint64_t start;
+	void *val;
+	int ret;
+
+	ret = kmscon_hashtable_new(&tbl, kmscon_direct_hash,
+					kmscon_direct_equal, NULL, NULL);
+	if (ret)
+		return ret;
+
+	start = bench_now();
+	for (i = 0; i < HT_KEYS; ++i)
+		kmscon_hashtable_insert(tbl, make_key(i), make_key(i * 2));
+	print_result("kmscon", "insert", bench_now() - start, HT_KEYS);
+
+	start = bench_now();
+	for (j = 0; j < HT_ROUNDS; ++j) {
+		for (i = 0; i < HT_KEYS; ++i) {
+			if (kmscon_hashtable_find(tbl, &val, make_key(i)) &&
+					val == make_key(i * 2))
+				++hits;
+		}
+	}
+	print_result("kmscon", "hit", bench_now() - start,
+			HT_KEYS * HT_ROUNDS);
+
+	start = bench_now();
+	for (j = 0; j < HT_ROUNDS; ++j) {
+		for (i = HT_KEYS; i < HT_KEYS * 2; ++i) {
+			if (kmscon_hashtable_find(tbl, &val, make_key(i)))
+				--hits;
+		}
+	}
+	print_result("kmscon", "miss", bench_now() - start,
+			HT_KEYS * HT_ROUNDS);
+
+	start = bench_now();
+	for (i = 0; i < HT_KEYS; i += 2) {
+		if (!kmscon_hashtable_remove(tbl, make_key(i)))
+			--hits;
+	}
+	print_result("kmscon", "remove", bench_now() - start, HT_KEYS / 2);
+
+	for (i = 0; i < HT_KEYS; ++i) {
+		if (kmscon_hashtable_find(tbl, &val, make_key(i)) !=
+				(i % 2 && val == make_key(i * 2)))
+			--hits;
+	}
+
+	kmscon_hashtable_free(tbl);
+
+	if (hits != HT_KEYS * HT_ROUNDS) {
+		log_err("kmscon_hashtable returned wrong results");
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static int bench_glib(void)
+{
+	GHashTable *tbl;
+	unsigned long i, j, hits = 0;
+	uint64_t start;
+	void *val;
+
+	tbl = g_hash_table_new(g_direct_hash, g_direct_equal);
+	if (!tbl)
+		return -ENOMEM;
+
+	start = bench_now();
+	for (i = 0; i < HT_KEYS; ++i)
+		g_hash_table_insert(tbl, make_key(i), make_key(i * 2));
+	print_result("glib", "insert", bench_now() - start, HT_KEYS);
+
+	start = bench_now();
+	for (j = 0; j < HT_ROUNDS; ++j) {
+		for (i = 0; i < HT_KEYS; ++i) {
+			if (g_hash_table_lookup_extended(tbl, make_key(i),
+							NULL, &val) &&
+					val == make_key(i * 2))
+				++hits;
+		}
+	}
+	print_result("glib", "hit", bench_now() - start,
+			HT_KEYS * HT_ROUNDS);
+
+	start = bench_now();
+	for (j = 0; j < HT_ROUNDS; ++j) {
+		for (i = HT_KEYS; i < HT_KEYS * 2; ++i) {
+			if (g_hash_table_lookup_extended(tbl, make_key(i),
+							NULL, &val))
+				--hits;
+		}
+	}
+	print_result("glib", "miss", bench_now() - start,
+			HT_KEYS * HT_ROUNDS);
+
+	g_hash_table_unref(tbl);
+
+	if (hits != HT_KEYS * HT_ROUNDS) {
+		log_err("GHashTable returned wrong results");
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+
+	log_print_init(argv[0]);
+
+	ret = test_strings();
+	if (ret)
+		goto err;
+
+	ret = test_collisions();
+	if (ret)
+		goto err;
+
+	ret = test_growth();
+	if (ret)
+		goto err;
+
+	ret = bench_kmscon();
+	if (ret)
+		goto err;
+
+	ret = bench_glib();
+	if (ret)
+		goto err;
+
+	return EXIT_SUCCESS;
+
+err:
+	log_err("benchmark failed, errno %d: %s", ret, strerror(-ret));
+	return abs(ret);
+}
@@ -0,0 +1,570 @@
+/*
+ * test_replay - Record and Replay Input Events
+ *
+ * Copyright (c) 2012 David Herrmann <dh.herrmann@googlemail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Record and Replay Input Events
+ * This records the raw evdev streams of all keyboards to a file and plays
+ * them back later. Usage:
+ *   test_replay record <file> [options]
+ *     Records until SIGINT.
+ *   test_replay replay <file> [speed] [options]
+ *     Creates one uinput device per recorded device and replays the events
+ *     through it, so they pass the whole input stack of a running kmscon.
+ *     The recorded timing is divided by \speed; 0 replays without delays.
+ *   test_replay bench <file> [options]
+ *     Feeds the events directly through the keyboard backend and the VTE
+ *     keyboard handler, like notify_key() and the terminal do, and reports
+ *     the processing cost per event. The --xkb-* options select the keymap.
+ *
+ * File format: a struct rec_header followed by struct rec_event records in
+ * host byte order. Timestamps are usec deltas to the previous record. A record
+ * of type REC_DEVICE introduces device \code; it is followed by \value bytes
+ * of its name.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include "eloop.h"
+#include "input.h"
+#include "kbd.h"
+#include "log.h"
+#include "vte.h"
+#include "test_include.h"
+
+#define REC_MAGIC "KMSCONEV"
+#define REC_VERSION 1
+#define REC_BYTE_ORDER 0x01020304
+#define REC_DEVICE 0xffff
+#define REC_DEV_MAX 16
+#define REC_BENCH_ROUNDS 100
+
+struct rec_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+};
+
+struct rec_event {
+	uint32_t delta;		/* usecs since the previous record */
+	uint16_t dev;
+	uint16_t type;
+	uint16_t code;
+	uint16_t reserved;
+	int32_t value;
+};
+
+struct rec_dev {
+	struct ev_fd *fd;
+	int rfd;
+	unsigned int idx;
+};
+
+static FILE *rec_file;
+static uint64_t rec_last;
+static unsigned long rec_num;
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int write_event(unsigned int dev, uint64_t time, uint16_t type,
+			uint16_t code, int32_t value)
+{
+	struct rec_event rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.delta = rec_last && time > rec_last ? time - rec_last : 0;
+	rec.dev = dev;
+	rec.type = type;
+	rec.code = code;
+	rec.value = value;
+	if (time > rec_last)
+		rec_last = time;
+
+	if (fwrite(&rec, sizeof(rec), 1, rec_file) != 1)
+		return -EIO;
+
+	++rec_num;
+	return 0;
+}
+
+static void record_data(struct ev_fd *fd, int mask, void *data)
+{
+	struct rec_dev *dev = data;
+	struct input_event ev[64];
+	ssize_t len;
+	int i, n;
+
+	if (mask & (EV_HUP | EV_ERR)) {
+		log_warn("device %u is gone", dev->idx);
+		ev_eloop_rm_fd(dev->fd);
+		dev->fd = NULL;
+		return;
+	}
+
+	do {
+		len = read(dev->rfd, ev, sizeof(ev));
+		if (len < 0)
+			break;
+
+		n = len / sizeof(*ev);
+		for (i = 0; i < n; ++i)
+			write_event(dev->idx, ev[i].time.tv_sec * 1000000ULL +
+					ev[i].time.tv_usec, ev[i].type,
+					ev[i].code, ev[i].value);
+	} while (len == sizeof(ev));
+}
+
+static bool is_keyboard(int fd)
+{
+	unsigned long evbits[EV_CNT / LONG_BIT + 1] = { 0 };
+
+	if (ioctl(fd, EVIOCGBIT(0, sizeof(evbits)), evbits) < 0)
+		return false;
+
+	return kmscon_evdev_bit_is_set(evbits, EV_KEY) &&
+		!kmscon_evdev_bit_is_set(evbits, EV_REL) &&
+		!kmscon_evdev_bit_is_set(evbits, EV_ABS);
+}
+
+static int record(struct ev_eloop *eloop, const char *path)
+{
+	struct rec_header hdr;
+	struct rec_dev devs[REC_DEV_MAX];
+	unsigned int i, num = 0;
+	struct dirent *ent;
+	char node[300], name[256];
+	DIR *dir;
+	int fd, clk, ret;
+
+	rec_file = fopen(path, "wb");
+	if (!rec_file) {
+		log_err("cannot open %s: %m", path);
+		return -errno;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, REC_MAGIC, sizeof(hdr.magic));
+	hdr.version = REC_VERSION;
+	hdr.byte_order = REC_BYTE_ORDER;
+	fwrite(&hdr, sizeof(hdr), 1, rec_file);
+
+	dir = opendir("/dev/input");
+	if (!dir) {
+		ret = -errno;
+		goto err_file;
+	}
+
+	while ((ent = readdir(dir)) && num < REC_DEV_MAX) {
+		if (strncmp(ent->d_name, "event", 5))
+			continue;
+
+		snprintf(node, sizeof(node), "/dev/input/%s", ent->d_name);
+		fd = open(node, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		if (!is_keyboard(fd)) {
+			close(fd);
+			continue;
+		}
+
+		clk = CLOCK_MONOTONIC;
+		ioctl(fd, EVIOCSCLOCKID, &clk);
+
+		memset(name, 0, sizeof(name));
+		ioctl(fd, EVIOCGNAME(sizeof(name) - 1), name);
+		write_event(num, 0, REC_DEVICE, num, strlen(name));
+		fwrite(name, strlen(name), 1, rec_file);
+
+		devs[num].rfd = fd;
+		devs[num].idx = num;
+		ret = ev_eloop_new_fd(eloop, &devs[num].fd, fd, EV_READABLE,
+					record_data, &devs[num]);
+		if (ret) {
+			close(fd);
+			continue;
+		}
+
+		log_info("recording %s (%s) as device %u", node, name, num);
+		++num;
+	}
+	closedir(dir);
+
+	if (!num) {
+		log_err("no keyboards found");
+		ret = -ENODEV;
+		goto err_file;
+	}
+
+	rec_last = now_usec();
+	ev_eloop_run(eloop, -1);
+
+	for (i = 0; i < num; ++i) {
+		ev_eloop_rm_fd(devs[i].fd);
+		close(devs[i].rfd);
+	}
+
+	log_info("recorded %lu events", rec_num);
+	ret = 0;
+
+err_file:
+	if (fclose(rec_file) && !ret)
+		ret = -EIO;
+	return ret;
+}
+
+/*
+ * Reads the next record. Device records are handled here and their names are
+ * stored in \names. Returns 1 on success and 0 on EOF.
+ */
+static int read_event(FILE *file, struct rec_event *rec,
+			char names[REC_DEV_MAX][256])
+{
+	size_t len;
+
+	while (1) {
+		if (fread(rec, sizeof(*rec), 1, file) != 1)
+			return 0;
+
+		if (rec->type != REC_DEVICE)
+			return rec->dev < REC_DEV_MAX ? 1 : -EINVAL;
+
+		if (rec->code >= REC_DEV_MAX || rec->value < 0 ||
+		    rec->value > 255)
+			return -EINVAL;
+
+		len = rec->value;
+		memset(names[rec->code], 0, 256);
+		if (len && fread(names[rec->code], len, 1, file) != 1)
+			return -EINVAL;
+	}
+}
+
+static FILE *open_recording(const char *path)
+{
+	struct rec_header hdr;
+	FILE *file;
+
+	file = fopen(path, "rb");
+	if (!file) {
+		log_err("cannot open %s: %m", path);
+		return NULL;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, file) != 1 ||
+	    memcmp(hdr.magic, REC_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != REC_VERSION || hdr.byte_order != REC_BYTE_ORDER) {
+		log_err("%s is not a recording", path);
+		fclose(file);
+		return NULL;
+	}
+
+	return file;
+}
+
+static int uinput_new(const char *name)
+{
+	struct uinput_user_dev udev;
+	int fd, i;
+
+	fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		log_err("cannot open /dev/uinput: %m");
+		return -errno;
+	}
+
+	ioctl(fd, UI_SET_EVBIT, EV_KEY);
+	ioctl(fd, UI_SET_EVBIT, EV_SYN);
+	for (i = 0; i < KEY_MAX; ++i)
+		ioctl(fd, UI_SET_KEYBIT, i);
+
+	memset(&udev, 0, sizeof(udev));
+	snprintf(udev.name, sizeof(udev.name), "replay: %s", name);
+	udev.id.bustype = BUS_VIRTUAL;
+
+	if (write(fd, &udev, sizeof(udev)) != sizeof(udev) ||
+	    ioctl(fd, UI_DEV_CREATE)) {
+		log_err("cannot create uinput device: %m");
+		close(fd);
+		return -EFAULT;
+	}
+
+	return fd;
+}
+
+static int replay(const char *path, double speed)
+{
+	char names[REC_DEV_MAX][256];
+	int fds[REC_DEV_MAX];
+	struct rec_event rec;
+	struct input_event ev;
+	unsigned long num = 0;
+	unsigned int i;
+	uint64_t start;
+	FILE *file;
+	int ret;
+
+	file = open_recording(path);
+	if (!file)
+		return -EINVAL;
+
+	for (i = 0; i < REC_DEV_MAX; ++i)
+		fds[i] = -1;
+
+	start = now_usec();
+	while ((ret = read_event(file, &rec, names)) > 0) {
+		if (fds[rec.dev] < 0) {
+			fds[rec.dev] = uinput_new(names[rec.dev]);
+			if (fds[rec.dev] < 0) {
+				ret = fds[rec.dev];
+				break;
+			}
+			/* give udev and kmscon time to pick up the device */
+			sleep(1);
+		}
+
+		if (speed > 0 && rec.delta)
+			usleep(rec.delta / speed);
+
+		memset(&ev, 0, sizeof(ev));
+		ev.type = rec.type;
+		ev.code = rec.code;
+		ev.value = rec.value;
+		if (write(fds[rec.dev], &ev, sizeof(ev)) != sizeof(ev)) {
+			log_err("cannot write to uinput device: %m");
+			ret = -EIO;
+			break;
+		}
+		++num;
+	}
+
+	if (!ret)
+		log_info("replayed %lu events in %" PRIu64 "ms", num,
+				(now_usec() - start) / 1000);
+
+	for (i = 0; i < REC_DEV_MAX; ++i) {
+		if (fds[i] >= 0) {
+			ioctl(fds[i], UI_DEV_DESTROY);
+			close(fds[i]);
+		}
+	}
+
+	fclose(file);
+	return ret;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+	return (x > y) - (x < y);
+}
+
+/* runs all key events through the keyboard backend and the VTE */
+static int bench(const char *path)
+{
+	char names[REC_DEV_MAX][256];
+	struct kmscon_kbd_desc *desc;
+	struct kmscon_kbd *kbds[REC_DEV_MAX] = { NULL };
+	struct kmscon_vte *vte;
+	struct kmscon_input_event ev;
+	struct rec_event rec, *recs = NULL, *tmp;
+	size_t num = 0, size = 0, i, j, n, sent = 0, bytes = 0;
+	uint64_t *cost, start, total = 0;
+	const char *u8;
+	size_t len;
+	FILE *file;
+	int ret;
+
+	file = open_recording(path);
+	if (!file)
+		return -EINVAL;
+
+	while ((ret = read_event(file, &rec, names)) > 0) {
+		/* notify_key() drops kernel repeats */
+		if (rec.type != EV_KEY || rec.value == KMSCON_KEY_REPEATED)
+			continue;
+
+		if (num == size) {
+			size = size ? size * 2 : 1024;
+			tmp = realloc(recs, size * sizeof(*recs));
+			if (!tmp) {
+				ret = -ENOMEM;
+				break;
+			}
+			recs = tmp;
+		}
+		recs[num++] = rec;
+	}
+	fclose(file);
+	if (ret)
+		goto err_recs;
+
+	if (!num) {
+		log_err("no key events in %s", path);
+		ret = -EINVAL;
+		goto err_recs;
+	}
+
+	/* every sample is kept so all figures describe the same data */
+	cost = malloc(sizeof(*cost) * num * REC_BENCH_ROUNDS);
+	if (!cost) {
+		ret = -ENOMEM;
+		goto err_recs;
+	}
+
+	ret = kmscon_kbd_desc_new(&desc, conf_global.xkb_layout,
+					conf_global.xkb_variant,
+					conf_global.xkb_options);
+	if (ret)
+		goto err_cost;
+
+	ret = kmscon_vte_new(&vte);
+	if (ret)
+		goto err_desc;
+
+	for (j = 0; j < REC_BENCH_ROUNDS; ++j) {
+		for (i = 0; i < num; ++i) {
+			if (!kbds[recs[i].dev]) {
+				ret = kmscon_kbd_new(&kbds[recs[i].dev], desc);
+				if (ret)
+					goto err_kbds;
+			}
+
+			start = now_nsec();
+			ret = kmscon_kbd_process_key(kbds[recs[i].dev],
+							recs[i].value,
+							recs[i].code, &ev);
+			if (!ret && kmscon_vte_handle_keyboard(vte, &ev, &u8,
+						&len) == KMSCON_VTE_SEND) {
+				++sent;
+				bytes += len;
+			}
+			start = now_nsec() - start;
+
+			cost[j * num + i] = start;
+			total += start;
+		}
+	}
+	ret = 0;
+
+	n = num * REC_BENCH_ROUNDS;
+	qsort(cost, n, sizeof(*cost), cmp_u64);
+	log_info("%zu key events, %zu rounds, %zu writes of %zu bytes",
+			num, (size_t)REC_BENCH_ROUNDS, sent, bytes);
+	log_info("cost per event: avg %.1f ns p50 %" PRIu64 " ns p99 %"
+			PRIu64 " ns max %" PRIu64 " ns",
+			(double)total / n,
+			cost[n / 2], cost[n * 99 / 100], cost[n - 1]);
+
+err_kbds:
+	for (i = 0; i < REC_DEV_MAX; ++i)
+		kmscon_kbd_unref(kbds[i]);
+	kmscon_vte_unref(vte);
+err_desc:
+	kmscon_kbd_desc_unref(desc);
+err_cost:
+	free(cost);
+err_recs:
+	free(recs);
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage:\n"
+		"\t%1$s record <file> [options]\n"
+		"\t%1$s replay <file> [speed] [options]\n"
+		"\t%1$s bench <file> [options]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct ev_eloop *eloop;
+	const char *mode, *path;
+	double speed = 1.0;
+	int ret, shift = 2;
+
+	if (argc < 3) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	mode = argv[1];
+	path = argv[2];
+	if (!strcmp(mode, "replay") && argc > 3 && argv[3][0] != '-') {
+		speed = strtod(argv[3], NULL);
+		shift = 3;
+	}
+
+	/* pass the remaining options to the config parser */
+	argv[shift] = argv[0];
+	argc -= shift;
+	argv += shift;
+
+	ret = test_prepare(argc, argv, &eloop);
+	if (ret)
+		goto err_fail;
+
+	if (!strcmp(mode, "record")) {
+		ret = record(eloop, path);
+	} else if (!strcmp(mode, "replay")) {
+		ret = replay(path, speed);
+	} else if (!strcmp(mode, "bench")) {
+		ret = bench(path);
+	} else {
+		usage(argv[0]);
+		ret = -EINVAL;
+	}
+
+	test_exit(eloop);
+err_fail:
+	test_fail(ret);
+	return abs(ret);
+}
@@ -0,0 +1,176 @@
+/*
+ * test_spawn - Test PTY Spawn Latency
+ *
+ * Copyright (c) 2012 David Herrmann <dh.herrmann@googlemail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Test PTY Spawn Latency
+ * This spawns a short-lived child on a new pty many times and measures the
+ * time kmscon_pty_open() blocks and the time until the first output of the
+ * child arrives. This is done once with our plain RSS and once after we
+ * touched a large heap allocation. The results should not depend on the RSS.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "conf.h"
+#include "eloop.h"
+#include "log.h"
+#include "pty.h"
+#include "test_include.h"
+
+#define SPAWN_ROUNDS 100
+#define SPAWN_RSS (256 * 1024 * 1024)
+
+struct spawn_stats {
+	uint64_t min;
+	uint64_t max;
+	uint64_t sum;
+};
+
+static char *spawn_argv[] = { "/bin/echo", "ready", NULL };
+static bool got_output;
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void stats_add(struct spawn_stats *st, uint64_t val)
+{
+	if (!st->sum || val < st->min)
+		st->min = val;
+	if (val > st->max)
+		st->max = val;
+	st->sum += val;
+}
+
+static void stats_print(const char *name, size_t rss,
+			struct spawn_stats *st, unsigned int num)
+{
+	log_info("rss +%zu MiB: %s: min %" PRIu64 "us avg %" PRIu64
+			"us max %" PRIu64 "us",
+			rss / (1024 * 1024), name, st->min, st->sum / num,
+			st->max);
+}
+
+static void pty_input(struct kmscon_pty *pty, const char *u8, size_t len,
+			void *data)
+{
+	struct ev_eloop *eloop = data;
+
+	if (len)
+		got_output = true;
+	ev_eloop_exit(eloop);
+}
+
+static int run_rounds(struct ev_eloop *eloop, struct kmscon_pty *pty,
+			size_t rss)
+{
+	struct spawn_stats open_st, output_st;
+	uint64_t start, opened, done;
+	unsigned int i;
+	int ret;
+
+	memset(&open_st, 0, sizeof(open_st));
+	memset(&output_st, 0, sizeof(output_st));
+
+	for (i = 0; i < SPAWN_ROUNDS; ++i) {
+		got_output = false;
+
+		start = now_usec();
+		ret = kmscon_pty_open(pty, 80, 24);
+		if (ret)
+			return ret;
+		opened = now_usec();
+
+		ev_eloop_run(eloop, -1);
+		done = now_usec();
+		kmscon_pty_close(pty);
+
+		if (!got_output) {
+			log_err("child did not produce any output");
+			return -EFAULT;
+		}
+
+		stats_add(&open_st, opened - start);
+		stats_add(&output_st, done - start);
+	}
+
+	/* reap the remaining children */
+	ev_eloop_run(eloop, 100);
+
+	stats_print("open", rss, &open_st, SPAWN_ROUNDS);
+	stats_print("first output", rss, &output_st, SPAWN_ROUNDS);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+	struct ev_eloop *eloop;
+	struct kmscon_pty *pty;
+	char *heap;
+
+	ret = test_prepare(argc, argv, &eloop);
+	if (ret)
+		goto err_fail;
+
+	conf_global.login = spawn_argv[0];
+	conf_global.argv = spawn_argv;
+
+	ret = kmscon_pty_new(&pty, eloop, pty_input, eloop);
+	if (ret)
+		goto err_exit;
+
+	ret = run_rounds(eloop, pty, 0);
+	if (ret)
+		goto err_pty;
+
+	heap = malloc(SPAWN_RSS);
+	if (!heap) {
+		ret = -ENOMEM;
+		goto err_pty;
+	}
+	memset(heap, 0xff, SPAWN_RSS);
+
+	ret = run_rounds(eloop, pty, SPAWN_RSS);
+	free(heap);
+
+err_pty:
+	kmscon_pty_unref(pty);
+err_exit:
+	test_exit(eloop);
+err_fail:
+	test_fail(ret);
+	return abs(ret);
+}
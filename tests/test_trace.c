@@ -0,0 +1,108 @@
+/*
+ * test_trace - Event Trace Converter
+ *
+ * Copyright (c) 2012 David Herrmann <dh.herrmann@googlemail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Event Trace Converter
+ * "test_trace <dump>" converts a trace dumped by "kmscon --trace <dump>" into
+ * Chrome trace JSON on stdout. Without arguments, this records events from
+ * two threads, wrapping one ring, dumps them into a temporary file and
+ * converts it, which exercises the whole trace path.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "log.h"
+#include "trace.h"
+
+static void *record_events(void *data)
+{
+	unsigned long i, num = (unsigned long)data;
+
+	for (i = 0; i < num; ++i) {
+		kmscon_trace_begin(KMSCON_TRACE_VTE_INPUT, i);
+		kmscon_trace_point(KMSCON_TRACE_SCROLL, 1, 0);
+		kmscon_trace_end(KMSCON_TRACE_VTE_INPUT);
+	}
+
+	return NULL;
+}
+
+static int self_test(void)
+{
+	char file[] = "/tmp/kmscon-trace-XXXXXX";
+	pthread_t thread;
+	int fd, ret;
+
+	fd = mkstemp(file);
+	if (fd < 0)
+		return -errno;
+	close(fd);
+
+	ret = kmscon_trace_start(file);
+	if (ret)
+		goto out;
+
+	/* the second thread wraps its ring */
+	record_events((void*)16UL);
+	ret = -pthread_create(&thread, NULL, record_events,
+				(void*)(unsigned long)KMSCON_TRACE_RING);
+	if (ret)
+		goto out_stop;
+	pthread_join(thread, NULL);
+
+	ret = kmscon_trace_dump(NULL);
+	if (ret)
+		goto out_stop;
+
+	ret = kmscon_trace_to_json(file, stdout);
+
+out_stop:
+	kmscon_trace_stop();
+out:
+	unlink(file);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+
+	if (argc > 1)
+		ret = kmscon_trace_to_json(argv[1], stdout);
+	else
+		ret = self_test();
+
+	if (ret) {
+		log_err("trace test failed, errno %d: %s", ret, strerror(-ret));
+		return abs(ret);
+	}
+
+	return EXIT_SUCCESS;
+}